@@ -0,0 +1,98 @@
+// Measures the cost of checking the data against its checksums on read (see
+// FileInterface::SetVerifyReads).
+//
+// Usage: read_verify [device_path [file_size_mb [passes]]]
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "fs/error_code.h"
+#include "fs/file_interface.h"
+#include "fs/filesystem_interface.h"
+#include "fs/linfs_factory.h"
+
+using namespace fs;
+
+namespace {
+
+constexpr size_t kReadSize = 64 * 1024;
+
+void Check(ErrorCode error_code, const char* what) {
+  if (error_code != ErrorCode::kSuccess) {
+    std::fprintf(stderr, "%s failed: %d\n", what, static_cast<int>(error_code));
+    std::exit(1);
+  }
+}
+
+// Reads the whole file |passes| times by |kReadSize| bytes and returns the
+// time of each pass in seconds.
+std::vector<double> ReadPasses(FilesystemInterface* fs, bool verify, int passes) {
+  ErrorCode error_code;
+  FileInterface* file = fs->OpenFile("/data", false, &error_code);
+  Check(error_code, "OpenFile");
+  file->SetVerifyReads(verify);
+
+  std::vector<char> buf(kReadSize);
+  std::vector<double> times;
+  for (int pass = 0; pass < passes; ++pass) {
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t offset = 0; offset < file->GetSize(); offset += kReadSize) {
+      file->ReadAt(offset, buf.data(), buf.size(), &error_code);
+      Check(error_code, "ReadAt");
+    }
+    times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+                        .count());
+  }
+  file->Close();
+  return times;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  std::string device_path = argc > 1 ? argv[1] : "read_verify.img";
+  uint64_t file_size = (argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 256) << 20;
+  int passes = argc > 3 ? std::atoi(argv[3]) : 5;
+
+  ErrorCode error_code;
+  FilesystemInterface* fs = CreateLinFS(&error_code);
+  Check(error_code, "CreateLinFS");
+  FilesystemInterface::FormatOptions options;
+  options.data_cluster_size = FilesystemInterface::ClusterSize::k1MB;
+  options.extent_tree = true;
+  Check(fs->Format(device_path.c_str(), options), "Format");
+  Check(fs->Load(device_path.c_str()), "Load");
+
+  FileInterface* file = fs->OpenFile("/data", false, &error_code);
+  Check(error_code, "OpenFile");
+  std::vector<char> buf(1 << 20);
+  for (size_t i = 0; i < buf.size(); ++i)
+    buf[i] = static_cast<char>(i * 131 + i / 4096);
+  for (uint64_t written = 0; written < file_size; written += buf.size()) {
+    file->Write(buf.data(), buf.size(), &error_code);
+    Check(error_code, "Write");
+  }
+  file->Close();
+  Check(fs->Scrub(), "Scrub");
+
+  std::vector<double> plain = ReadPasses(fs, false, passes);
+  std::vector<double> verified = ReadPasses(fs, true, passes);
+  fs->Release();
+  std::remove(device_path.c_str());
+
+  double plain_total = 0, verified_total = 0;
+  std::printf("pass  plain MB/s  verified MB/s  overhead\n");
+  for (int pass = 0; pass < passes; ++pass) {
+    double mb = static_cast<double>(file_size) / (1 << 20);
+    std::printf("%4d  %10.0f  %13.0f  %7.1f%%\n", pass + 1, mb / plain[pass],
+                mb / verified[pass], (verified[pass] / plain[pass] - 1) * 100);
+    plain_total += plain[pass];
+    verified_total += verified[pass];
+  }
+  std::printf("total overhead: %.1f%%\n", (verified_total / plain_total - 1) * 100);
+  return 0;
+}
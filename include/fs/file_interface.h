@@ -3,6 +3,8 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
+#include <functional>
 
 #include "fs/error_code.h"
 
@@ -10,6 +12,50 @@ namespace fs {
 
 class FileInterface {
  public:
+  // Buffers for scatter/gather I/O (see 12).
+  struct ReadBuffer {
+    char* data;
+    size_t size;
+  };
+  struct WriteBuffer {
+    const char* data;
+    size_t size;
+  };
+
+  // Read-only view of file data in memory (see 11).
+  class MappedRange {
+   public:
+    struct Span {
+      const char* data;  // nullptr for holes, which consist of zeros
+      size_t size;
+    };
+
+    virtual const Span* spans() const = 0;
+    virtual size_t spans_count() const = 0;
+    // Unpins the data.  The spans are invalid after that.
+    virtual void Release() = 0;
+
+   protected:
+    ~MappedRange() = default;
+  };
+
+  // Writable view of the whole file in memory (see 14).
+  class MappedFile {
+   public:
+    virtual char* data() const = 0;
+    virtual size_t size() const = 0;
+    // Writes the changes to the device.
+    virtual ErrorCode Sync() = 0;
+    // Unmaps the file.  The pointers are invalid after that.
+    virtual void Release() = 0;
+
+   protected:
+    ~MappedFile() = default;
+  };
+
+  // Called when an asynchronous operation completes (see 13).
+  using Completion = std::function<void(ErrorCode error_code, size_t size)>;
+
   // File operations:
   //
   // 1. Read from a file
@@ -43,6 +89,10 @@ class FileInterface {
   // if (error_code != ErrorCode::kSuccess)
   //   ...
   //
+  // Notes:
+  //  * The cursor may be set after the end of the file.  Then Read() reads
+  //    nothing and Write() leaves a hole (see 9).
+  //
   // Thread safety: Thread safe
   // Error (exception) safety:
   //   * GetCursor: No error
@@ -62,10 +112,260 @@ class FileInterface {
   //
   // file->Close();
   //
+  // Notes:
+  //  * Close() flushes the write buffer and ignores errors.  Call Flush()
+  //    before if you care about them.
+  //  * It waits for the asynchronous operations in flight (see 13).
+  //  * It writes the file size to the device (see 6).
+  //
   // Thread safety: Not thread safe
   // Error (exception) safety: No error
   virtual void Close() = 0;
 
+  // 6. Buffer writes in memory (delayed allocation)
+  //
+  // ErrorCode error_code = file->SetWriteBuffer(64 * 1024);
+  // if (error_code != ErrorCode::kSuccess)
+  //   ...
+  // file->Write(buf, N, &error_code);  // doesn't touch the device
+  // ...
+  // error_code = file->Flush();
+  // if (error_code != ErrorCode::kSuccess)
+  //   ...
+  //
+  // Notes:
+  //  * Sequential writes are collected in the buffer of the given size and the
+  //    space for them is allocated at once when the buffer is flushed: on
+  //    Flush(), Close(), Read(), a write elsewhere in the file, or when the
+  //    buffer is full.  Size 0 (default) disables buffering.
+  //  * Buffered data is visible only through this handle until it's flushed.
+  //  * All buffers share the budget set by FilesystemInterface::SetWriteBufferBudget.
+  //  * Writes past the end of the file extend its size only in memory.
+  //    Flush() and Close() write it to the device even without the buffer, so
+  //    after a crash the file ends where it did at the last of them.
+  //
+  // Thread safety: Thread safe
+  // Error (exception) safety: Strong guarantee
+  virtual ErrorCode SetWriteBuffer(size_t size) = 0;
+  virtual ErrorCode Flush() = 0;
+
+  // 6.1. Buffer reads in memory (read-ahead)
+  //
+  // ErrorCode error_code = file->SetReadBuffer(64 * 1024);
+  // if (error_code != ErrorCode::kSuccess)
+  //   ...
+  // file->Read(buf, 64, &error_code);  // reads 64KB ahead
+  // file->Read(buf, 64, &error_code);  // doesn't touch the device
+  //
+  // Notes:
+  //  * Reads smaller than the buffer are served from it.  When it doesn't
+  //    contain the requested bytes, it's filled starting with them.  Size 0
+  //    (default) disables buffering; a cluster or more is recommended.
+  //  * The buffer is dropped whenever the file is written, truncated or
+  //    appended to through any handle, so reads always see the flushed data.
+  //    While the file is mapped (see 14), reads skip the buffer.
+  //
+  // Thread safety: Thread safe
+  // Error (exception) safety: Strong guarantee
+  virtual ErrorCode SetReadBuffer(size_t size) = 0;
+
+  // 6.2. Verify the data on read
+  //
+  // file->SetVerifyReads(false);
+  //
+  // Notes:
+  //  * By default reads check the data against its checksums, which
+  //    FilesystemInterface::Scrub adds, and fail with kErrorFormat if it's
+  //    corrupted.  Every 4 KB of the data has a checksum of its own, so only
+  //    the chunks with the requested bytes are checked, as they are read.
+  //  * Data written after the last Scrub() has no checksums and isn't checked.
+  //
+  // Thread safety: Thread safe
+  // Error (exception) safety: No error
+  virtual void SetVerifyReads(bool verify) = 0;
+
+  // 7. Read from or write on a file at the given offset
+  //
+  // ErrorCode error_code;
+  // char buf[N];
+  // size_t read = file->ReadAt(offset, buf, N, &error_code);
+  // if (error_code != ErrorCode::kSuccess)
+  //   ...
+  // size_t written = file->WriteAt(offset, buf, N, &error_code);
+  // if (error_code != ErrorCode::kSuccess)
+  //   ...
+  //
+  // Notes:
+  //  * Unlike Read() and Write(), they neither use nor move the cursor.
+  //  * Writes of different parts of a file don't wait for each other (except
+  //    while the space is allocated), and reads wait only for the writes of
+  //    the same bytes.  It's true for Read() and Write() as well.
+  //
+  // Thread safety: Thread safe
+  // Error (exception) safety: Strong guarantee
+  virtual size_t ReadAt(uint64_t offset, char* buf, size_t buf_size, ErrorCode* error_code) = 0;
+  virtual size_t WriteAt(uint64_t offset, const char* buf, size_t buf_size,
+                         ErrorCode* error_code) = 0;
+
+  // 8. Change the file size
+  //
+  // ErrorCode error_code = file->Truncate(size);
+  // if (error_code != ErrorCode::kSuccess)
+  //   ...
+  //
+  // Notes:
+  //  * If the file is bigger than |size|, the rest of the data is lost and the
+  //    space is released.  Otherwise the file is extended by a hole (see 9).
+  //  * The cursor isn't changed, so it may become greater than the file size.
+  //
+  // Thread safety: Thread safe
+  // Error (exception) safety: Basic guarantee
+  virtual ErrorCode Truncate(uint64_t size) = 0;
+
+  // 9. Find data and holes in a sparse file
+  //
+  // ErrorCode error_code;
+  // uint64_t data = file->FindData(offset, &error_code);
+  // if (error_code != ErrorCode::kSuccess)
+  //   ...
+  // uint64_t hole = file->FindHole(data, &error_code);
+  // if (error_code != ErrorCode::kSuccess)
+  //   ...
+  //
+  // Notes:
+  //  * Writes after the end of the file leave holes which take no space and
+  //    are read as zeros.  Only the filesystems formatted with the extent
+  //    tree support them, others fill the holes with zeros.
+  //  * FindData() returns the first offset of data at or after |offset|, or
+  //    fails with kErrorNotFound if there is no more data.
+  //  * FindHole() returns the first offset of a hole at or after |offset|.
+  //    The end of the file counts as a hole.
+  //
+  // Thread safety: Thread safe
+  // Error (exception) safety: Strong guarantee
+  virtual uint64_t FindData(uint64_t offset, ErrorCode* error_code) = 0;
+  virtual uint64_t FindHole(uint64_t offset, ErrorCode* error_code) = 0;
+
+  // 10. Append to a file from many threads at once
+  //
+  // ErrorCode error_code;
+  // char buf[N] = ...;
+  // uint64_t offset = file->Append(buf, N, &error_code);
+  // if (error_code != ErrorCode::kSuccess)
+  //   ...
+  //
+  // Notes:
+  //  * The data is written after the end of the file and the data of all
+  //    previous Append() calls, and its offset is returned.  The cursor is
+  //    neither used nor moved.
+  //  * Only the space allocation is serialized, the data of concurrent
+  //    Append() calls is written in parallel.  The file size includes the
+  //    appended data in order of the calls, and Append() returns once it
+  //    includes its own data.
+  //
+  // Thread safety: Thread safe
+  // Error (exception) safety: Basic guarantee (the appended range may contain
+  //                           garbage if the data couldn't be written)
+  virtual uint64_t Append(const char* buf, size_t buf_size, ErrorCode* error_code) = 0;
+
+  // 11. Read a file without copying
+  //
+  // ErrorCode error_code;
+  // FileInterface::MappedRange* range = file->MapRange(offset, N, &error_code);
+  // if (error_code != ErrorCode::kSuccess)
+  //   ...
+  // for (size_t i = 0; i < range->spans_count(); ++i)
+  //   Parse(range->spans()[i].data, range->spans()[i].size);
+  // range->Release();
+  //
+  // Notes:
+  //  * The spans point straight to the device's memory mapping, one span per
+  //    contiguous piece of data.  They cover the requested range, or its part
+  //    before the end of the file.
+  //  * The data is pinned until Release(): writes of the same bytes and
+  //    truncation of the file wait for it.  Release the range before writing
+  //    it through the same thread.
+  //  * The range stays valid after the file is closed.
+  //
+  // Thread safety: Thread safe
+  // Error (exception) safety: Strong guarantee
+  virtual MappedRange* MapRange(uint64_t offset, uint64_t size, ErrorCode* error_code) = 0;
+
+  // 12. Read to or write from many buffers at once
+  //
+  // ErrorCode error_code;
+  // FileInterface::WriteBuffer bufs[] = {{header, N}, {payload, M}, {trailer, K}};
+  // size_t written = file->WriteV(bufs, 3, &error_code);
+  // if (error_code != ErrorCode::kSuccess)
+  //   ...
+  //
+  // Notes:
+  //  * They work as Read(), Write(), ReadAt() and WriteAt() with all the
+  //    buffers concatenated, but lock the file and look for its data only
+  //    once.
+  //
+  // Thread safety: Thread safe
+  // Error (exception) safety: Strong guarantee
+  virtual size_t ReadV(const ReadBuffer* bufs, size_t count, ErrorCode* error_code) = 0;
+  virtual size_t WriteV(const WriteBuffer* bufs, size_t count, ErrorCode* error_code) = 0;
+  virtual size_t ReadVAt(uint64_t offset, const ReadBuffer* bufs, size_t count,
+                         ErrorCode* error_code) = 0;
+  virtual size_t WriteVAt(uint64_t offset, const WriteBuffer* bufs, size_t count,
+                          ErrorCode* error_code) = 0;
+
+  // 13. Read or write without blocking the caller
+  //
+  // ErrorCode error_code = file->ReadAsync(offset, buf, N,
+  //                                        [](ErrorCode error_code, size_t read) {
+  //                                          if (error_code != ErrorCode::kSuccess)
+  //                                            ...
+  //                                        });
+  // if (error_code != ErrorCode::kSuccess)
+  //   ...  // the operation hasn't been started, the callback won't be called
+  //
+  // Notes:
+  //  * They work as ReadAt() and WriteAt() on the filesystem's I/O threads and
+  //    pass their result to |completion| there.  The buffer must stay valid
+  //    until then.
+  //  * Operations in flight run in any order.
+  //  * Close() waits for all operations of the file and their callbacks, so
+  //    don't call it from a callback.
+  //
+  // Thread safety: Thread safe
+  // Error (exception) safety: Strong guarantee
+  virtual ErrorCode ReadAsync(uint64_t offset, char* buf, size_t buf_size,
+                              Completion completion) = 0;
+  virtual ErrorCode WriteAsync(uint64_t offset, const char* buf, size_t buf_size,
+                               Completion completion) = 0;
+
+  // 14. Access a file through pointers
+  //
+  // ErrorCode error_code;
+  // FileInterface::MappedFile* mapped_file = file->Map(&error_code);
+  // if (error_code != ErrorCode::kSuccess)
+  //   ...
+  // Index* index = reinterpret_cast<Index*>(mapped_file->data());
+  // index->Insert(key, value);
+  // error_code = mapped_file->Sync();
+  // if (error_code != ErrorCode::kSuccess)
+  //   ...
+  // mapped_file->Release();
+  //
+  // Notes:
+  //  * The data must be contiguous on the device, otherwise the error is
+  //    kErrorNotSupported.  Files of one section and defragmented files with
+  //    the extent tree are.  Empty and sparse files aren't.
+  //  * The changes are visible to the readers of the file at once, but they
+  //    reach the device for sure only on Sync().  Release() doesn't sync.
+  //  * The size is fixed until Release(): writes, appends and truncation of
+  //    the file wait for it, so release the mapping before them in the same
+  //    thread.  Reads don't wait.
+  //  * The mapping stays valid after the file is closed.
+  //
+  // Thread safety: Thread safe
+  // Error (exception) safety: Strong guarantee
+  virtual MappedFile* Map(ErrorCode* error_code) = 0;
+
  protected:
   // You are not permitted to delete it directly.  Always use Close().
   ~FileInterface() = default;
@@ -19,7 +19,61 @@ class FilesystemInterface {
     k512B = 9,
     k1KB = 10,
     k2KB = 11,
-    k4KB = 12
+    k4KB = 12,
+    // The following sizes are allowed only for data clusters
+    k8KB = 13,
+    k16KB = 14,
+    k32KB = 15,
+    k64KB = 16,
+    k128KB = 17,
+    k256KB = 18,
+    k512KB = 19,
+    k1MB = 20
+  };
+
+  struct FormatOptions {
+    ClusterSize cluster_size = ClusterSize::k1KB;       // for directories, symlinks
+                                                        // and file headers (up to 4KB)
+    ClusterSize data_cluster_size = ClusterSize::k1KB;  // for file data (up to 1MB),
+                                                        // not less than |cluster_size|
+    bool extent_tree = false;  // index file data by a B-tree instead of a list of
+                               // sections (faster seeks, requires v1.2 readers)
+    bool name_index = false;   // hash names of directory entries (lookups don't
+                               // scan directories, requires v1.2 readers)
+    bool tagged_slots = false; // keep types and hashes of names in directory slots
+                               // (lookups load fewer entries, requires v1.2 readers)
+  };
+
+  struct DefragmenterOptions {
+    uint64_t bytes_per_second = 8 << 20;  // I/O rate limit, 0 means no limit
+    uint64_t bytes_per_pass = 1ULL << 30; // maximum amount of data moved per pass
+    uint32_t pass_interval_ms = 60000;    // delay between two passes
+    uint32_t min_sections = 3;            // skip files consisting of fewer sections
+  };
+
+  struct Stats {
+    uint64_t cluster_size = 0;          // in bytes
+    uint64_t data_cluster_size = 0;     // in bytes
+    uint64_t total_clusters = 0;        // device size in clusters
+    uint64_t free_clusters = 0;         // clusters in unused sections
+    uint64_t free_extents = 0;          // runs of adjacent unused clusters
+    uint64_t largest_free_extent = 0;   // in clusters
+    uint64_t free_extents_histogram[64] = {0};  // [n] is the number of free extents
+                                                // of [2^n, 2^(n+1)) clusters
+    uint64_t device_reads = 0;          // read requests to the device since loading
+    uint64_t device_writes = 0;         // write requests to the device since loading
+  };
+
+  enum class CopyMode : uint8_t {
+    kCopy,   // copy the data
+    kClone,  // share the data until either file changes it (copy-on-write)
+  };
+
+  struct EntryStats {
+    uint64_t sections = 0;              // number of sections in the entry's chain
+    uint64_t average_section_size = 0;  // in bytes
+    uint64_t slots = 0;                 // directories only: number of slots for entries
+    uint64_t used_slots = 0;            // directories only: number of occupied slots
   };
 
   // Service routines:
@@ -47,9 +101,142 @@ class FilesystemInterface {
   // if (error_code != ErrorCode::kSuccess)
   //   ...
   //
+  // 3.1. Format a new device with separate cluster sizes for metadata and data
+  //
+  // FilesystemInterface::FormatOptions options;
+  // options.cluster_size = FilesystemInterface::ClusterSize::k1KB;
+  // options.data_cluster_size = FilesystemInterface::ClusterSize::k1MB;
+  // ErrorCode error_code = fs->Format("/path/to/device", options);
+  // if (error_code != ErrorCode::kSuccess)
+  //   ...
+  //
   // Thread safety: Not thread safe
   // Error (exception) safety: Basic guarantee
   virtual ErrorCode Format(const char* device_path, ClusterSize cluster_size) const = 0;
+  virtual ErrorCode Format(const char* device_path, const FormatOptions& options) const = 0;
+
+  // 4. Defragment files
+  //
+  // FilesystemInterface::DefragmenterOptions options;
+  // options.bytes_per_second = 1 << 20;
+  // ErrorCode error_code = fs->StartDefragmenter(options);
+  // if (error_code != ErrorCode::kSuccess)
+  //   ...
+  // fs->StopDefragmenter();
+  //
+  // Notes:
+  //  * StartDefragmenter runs passes in the background until StopDefragmenter
+  //    is called or the filesystem is released.  Defragment runs a single pass
+  //    in the calling thread.
+  //  * Files which are open at the moment are skipped.
+  //
+  // Thread safety: Not thread safe
+  // Error (exception) safety: Strong guarantee
+  virtual ErrorCode StartDefragmenter(const DefragmenterOptions& options) = 0;
+  virtual void StopDefragmenter() = 0;
+  virtual ErrorCode Defragment(const DefragmenterOptions& options) = 0;
+
+  // 4.1. Store identical data once
+  //
+  // uint64_t released = 0;
+  // ErrorCode error_code = fs->Deduplicate(&released);
+  // if (error_code != ErrorCode::kSuccess)
+  //   ...
+  //
+  // Notes:
+  //  * It runs a pass over the whole filesystem in the calling thread.  Data
+  //    pieces (extents) of the same size and content are shared as clones do
+  //    (see CopyFile) and the space of the duplicates is released.
+  //    |released| receives its size in bytes.
+  //  * Only files with the extent tree (see FormatOptions) take part, so
+  //    other devices get kErrorNotSupported.  Files which are open at the
+  //    moment are skipped.
+  //  * Files seen by the pass can't be removed until it ends (kErrorBusy).
+  //  * Older readers refuse to load the device after the first pass.
+  //
+  // Thread safety: Thread safe
+  // Error (exception) safety: Basic guarantee
+  virtual ErrorCode Deduplicate(uint64_t* released = nullptr) = 0;
+
+  // 4.2. Check the integrity of file data
+  //
+  // uint64_t corrupted = 0;
+  // ErrorCode error_code = fs->Scrub(&corrupted);
+  // if (error_code != ErrorCode::kSuccess)
+  //   ...
+  // if (corrupted != 0)
+  //   ...  // restore the device from a backup
+  //
+  // Notes:
+  //  * It runs a pass over the whole filesystem in the calling thread.  Every
+  //    piece of data (extent) is checked against the CRC-32C checksums of its
+  //    4 KB chunks, and the data without them gets them.  |corrupted|
+  //    receives the number of pieces with chunks which don't match.
+  //  * Writes drop the checksums of the data they change until the next
+  //    pass.  Reads check them (see FileInterface::SetVerifyReads).
+  //  * Only files with the extent tree (see FormatOptions) have checksums, so
+  //    other devices get kErrorNotSupported.  Files mapped by
+  //    FileInterface::Map are skipped.
+  //  * Older readers refuse to load the device after the first pass.
+  //
+  // Thread safety: Thread safe
+  // Error (exception) safety: Basic guarantee
+  virtual ErrorCode Scrub(uint64_t* corrupted = nullptr) = 0;
+
+  // 5. Limit the memory used by write buffers of all open files
+  //
+  // fs->SetWriteBufferBudget(64 << 20);
+  //
+  // Notes:
+  //  * See FileInterface::SetWriteBuffer.  When the budget is exhausted, files
+  //    flush their buffers and write directly to the device.
+  //
+  // Thread safety: Thread safe
+  // Error (exception) safety: No error
+  virtual void SetWriteBufferBudget(uint64_t size) = 0;
+
+  // 5.1. Limit the memory used to remember contents of directories
+  //
+  // fs->SetDirectoryCacheBudget(16 << 20);
+  //
+  // Notes:
+  //  * Names, offsets and types of entries of recently used directories are
+  //    kept in memory, so lookups in them don't read the device.  The least
+  //    recently used directories are forgotten when the budget is exhausted.
+  //    Directories which don't fit in it get a much smaller filter of names,
+  //    so creating a new entry in them doesn't scan them either.  0 disables
+  //    the cache.
+  //
+  // Thread safety: Thread safe
+  // Error (exception) safety: No error
+  virtual void SetDirectoryCacheBudget(uint64_t size) = 0;
+
+  // 6. Get allocation and fragmentation statistics
+  //
+  // FilesystemInterface::Stats stats;
+  // ErrorCode error_code = fs->GetStats(&stats);
+  // if (error_code != ErrorCode::kSuccess)
+  //   ...
+  // std::cout << stats.free_clusters << "/" << stats.total_clusters << std::endl;
+  //
+  // 6.1. Get statistics of a file, directory or symlink
+  //
+  // FilesystemInterface::EntryStats entry_stats;
+  // ErrorCode error_code = fs->GetStats("/root/.profile", &entry_stats);
+  // if (error_code != ErrorCode::kSuccess)
+  //   ...
+  //
+  // Notes:
+  //  * Both walk the section chains, so they take time proportional to the
+  //    number of unused sections or the entry's sections respectively.
+  //  * The last component of |path| isn't resolved if it's a symlink.
+  //  * Stats::device_reads and device_writes count the requests of open files
+  //    as well, but not accesses to memory mappings.
+  //
+  // Thread safety: Thread safe
+  // Error (exception) safety: Strong guarantee
+  virtual ErrorCode GetStats(Stats* stats) = 0;
+  virtual ErrorCode GetStats(const char* path, EntryStats* stats) = 0;
 
   // Filesystem operations:
   //
@@ -181,6 +368,28 @@ class FilesystemInterface {
   virtual bool IsDirectory(const char* path, ErrorCode* error_code) = 0;
   virtual bool IsSymlink(const char* path, ErrorCode* error_code) = 0;
 
+  // 7. Copy a file
+  //
+  // ErrorCode error_code = fs->CopyFile("/root/.profile", "/backup/.profile",
+  //                                     FilesystemInterface::CopyMode::kClone);
+  // if (error_code != ErrorCode::kSuccess)
+  //   ...
+  //
+  // Notes:
+  //  * The data is copied inside the device, the holes are kept.  A clone
+  //    doesn't copy anything: both files share the data, and a write copies
+  //    the touched extent first.  Files without the extent tree (see
+  //    FormatOptions) and files mapped by FileInterface::Map are always
+  //    copied.
+  //  * The copy appears complete.  |dst| must not exist.
+  //  * Data buffered by open handles of |src| isn't copied.  Flush them first.
+  //  * Older readers refuse to load the device after the first clone.
+  //
+  // Thread safety: Thread safe
+  // Error (exception) safety: Strong guarantee
+  virtual ErrorCode CopyFile(const char* src, const char* dst,
+                             CopyMode mode = CopyMode::kCopy) = 0;
+
  protected:
   // You are not permitted to delete it directly.  Always use Release().
   ~FilesystemInterface() = default;
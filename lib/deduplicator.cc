@@ -0,0 +1,153 @@
+#include "lib/deduplicator.h"
+
+#include <algorithm>
+#include <mutex>
+#include <shared_mutex>
+
+namespace fs {
+
+namespace linfs {
+
+namespace {
+
+// Read the data by chunks of this size.
+constexpr size_t kChunkSize = 64 * 1024;
+
+}  // namespace
+
+uint64_t Deduplicator::RunPass() {
+  std::vector<std::shared_ptr<DirectoryEntry>> dirs{root_entry_};
+  while (!dirs.empty()) {
+    std::shared_ptr<DirectoryEntry> dir = std::move(dirs.back());
+    dirs.pop_back();
+    DeduplicateDirectory(dir, dirs);
+  }
+  return released_;
+}
+
+void Deduplicator::DeduplicateDirectory(const std::shared_ptr<DirectoryEntry>& dir,
+                                        std::vector<std::shared_ptr<DirectoryEntry>>& subdirs) {
+  uint64_t cookie = 0;
+  do {
+    std::shared_ptr<Entry> entry;
+    {
+      // See LinFS::GetDirectory why the entry must be shared in the locked directory.
+      std::shared_lock<SharedMutex> lock = dir->LockShared();
+
+      std::unique_ptr<Entry> next_entry;
+      cookie = dir->GetNextEntry(cookie, reader_writer_.get(), &next_entry, nullptr,
+                                 Entry::Type::kSymlink);
+      if (cookie == 0)
+        continue;
+      if (next_entry->type() == Entry::Type::kFile &&
+          (!next_entry->As<FileEntry>()->extent_tree() || cache_->EntryIsShared(next_entry.get())))
+        continue;  // The file can't share its data or is open.  Skip it.
+      entry = cache_->GetSharedEntry(std::move(next_entry));
+    }
+
+    if (entry->type() == Entry::Type::kDirectory) {
+      subdirs.push_back(std::static_pointer_cast<DirectoryEntry>(entry));
+      continue;
+    }
+
+    files_.push_back(std::static_pointer_cast<FileEntry>(entry));
+    entry.reset();
+    try {
+      DeduplicateFile(files_.size() - 1);
+    }
+    catch (...) {
+      /* The file is still consistent.  Skip it. */
+    }
+  } while (cookie != 0);
+}
+
+void Deduplicator::DeduplicateFile(size_t file) {
+  std::unique_lock<SharedMutex> lock = files_[file]->Lock();
+
+  // Someone could open the file after we had checked it.
+  if (files_[file].use_count() > 1)
+    return;
+
+  std::vector<ExtentTree::Extent> extents;
+  files_[file]->ForEachExtent(reader_writer_.get(), [&extents](const ExtentTree::Extent& extent) {
+    extents.push_back(extent);
+  });
+  for (const ExtentTree::Extent& extent : extents)
+    DeduplicateExtent(file, extent);
+}
+
+void Deduplicator::DeduplicateExtent(size_t file, const ExtentTree::Extent& extent) {
+  uint64_t hash = Hash(extent);
+  auto blocks = blocks_.equal_range(hash);
+  for (auto it = blocks.first; it != blocks.second; ++it) {
+    if (it->second.extent.length == extent.length && ShareWith(file, extent, it->second))
+      return;
+  }
+  blocks_.emplace(hash, Block{file, extent});
+}
+
+bool Deduplicator::ShareWith(size_t file, const ExtentTree::Extent& extent, const Block& block) {
+  if (block.extent.section_offset == extent.section_offset &&
+      block.extent.data_offset == extent.data_offset)
+    return true;  // They are clones already.
+
+  FileEntry* source = files_[block.file].get();
+  std::unique_lock<SharedMutex> lock;
+  if (block.file != file) {
+    lock = source->Lock();
+    // Someone could open the file after we had indexed it.
+    if (files_[block.file].use_count() > 1)
+      return false;
+  }
+
+  ExtentTree::Extent source_extent;
+  if (!source->FindExtent(block.extent.file_offset, reader_writer_.get(), &source_extent) ||
+      source_extent.section_offset != block.extent.section_offset ||
+      source_extent.data_offset != block.extent.data_offset ||
+      source_extent.length != block.extent.length || !SameData(source_extent, extent))
+    return false;
+
+  files_[file]->ShareExtent(extent, source, source_extent, reader_writer_.get(), allocator_);
+  if (!extent.shared)
+    released_ += extent.length;
+  return true;
+}
+
+uint64_t Deduplicator::Hash(const ExtentTree::Extent& extent) {
+  // FNV-1a.
+  constexpr uint64_t kOffsetBasis = 14695981039346656037ULL;
+  constexpr uint64_t kPrime = 1099511628211ULL;
+
+  uint64_t hash = kOffsetBasis;
+  std::vector<char> buf(std::min<uint64_t>(kChunkSize, extent.length));
+  uint64_t data_offset = extent.device_offset();
+  for (uint64_t done = 0; done != extent.length;) {
+    size_t chunk = std::min<uint64_t>(buf.size(), extent.length - done);
+    reader_writer_->Read(data_offset + done, buf.data(), chunk);
+    for (size_t i = 0; i != chunk; ++i)
+      hash = (hash ^ static_cast<uint8_t>(buf[i])) * kPrime;
+    done += chunk;
+  }
+  return hash;
+}
+
+bool Deduplicator::SameData(const ExtentTree::Extent& extent1,
+                            const ExtentTree::Extent& extent2) {
+  std::vector<char> buf1(std::min<uint64_t>(kChunkSize, extent1.length));
+  std::vector<char> buf2(buf1.size());
+  uint64_t data_offset1 = extent1.device_offset();
+  uint64_t data_offset2 = extent2.device_offset();
+  for (uint64_t done = 0; done != extent1.length;) {
+    size_t chunk = std::min<uint64_t>(buf1.size(), extent1.length - done);
+    reader_writer_->Read(data_offset1 + done, buf1.data(), chunk);
+    reader_writer_->Read(data_offset2 + done, buf2.data(), chunk);
+    if (!std::equal(buf1.begin(), buf1.begin() + chunk, buf2.begin()))
+      return false;
+    done += chunk;
+  }
+  return true;
+}
+
+}  // namespace linfs
+
+}  // namespace fs
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "lib/entries/directory_entry.h"
+#include "lib/entries/file_entry.h"
+#include "lib/entry_cache.h"
+#include "lib/extent_tree.h"
+#include "lib/section_allocator.h"
+#include "lib/utils/reader_writer.h"
+
+namespace fs {
+
+namespace linfs {
+
+// Walks the whole filesystem and makes the extents with the same data share
+// one section (see ExtentLayout::kFlagShared), so the duplicates are stored
+// once.  Files without the extent tree are skipped.
+class Deduplicator {
+ public:
+  Deduplicator(std::unique_ptr<ReaderWriter> reader_writer, SectionAllocator* allocator,
+               EntryCache* cache, std::shared_ptr<DirectoryEntry> root_entry)
+      : reader_writer_(std::move(reader_writer)), allocator_(allocator), cache_(cache),
+        root_entry_(std::move(root_entry)) {}
+
+  // Returns the number of released bytes.
+  uint64_t RunPass();
+
+ private:
+  // An extent seen by the pass.
+  struct Block {
+    size_t file;  // index in |files_|
+    ExtentTree::Extent extent;
+  };
+
+  void DeduplicateDirectory(const std::shared_ptr<DirectoryEntry>& dir,
+                            std::vector<std::shared_ptr<DirectoryEntry>>& subdirs);
+  void DeduplicateFile(size_t file);
+  // Shares the section of an earlier block with the data of |extent| or adds
+  // the extent to |blocks_|.
+  void DeduplicateExtent(size_t file, const ExtentTree::Extent& extent);
+  // Returns false if |block| has changed since it was indexed or has other
+  // data.
+  bool ShareWith(size_t file, const ExtentTree::Extent& extent, const Block& block);
+
+  uint64_t Hash(const ExtentTree::Extent& extent);
+  bool SameData(const ExtentTree::Extent& extent1, const ExtentTree::Extent& extent2);
+
+  std::unique_ptr<ReaderWriter> reader_writer_;
+  SectionAllocator* allocator_;
+  EntryCache* cache_;
+  std::shared_ptr<DirectoryEntry> root_entry_;
+
+  // The files are shared until the end of the pass, so nobody removes them
+  // while their blocks are indexed.
+  std::vector<std::shared_ptr<FileEntry>> files_;
+  std::unordered_multimap<uint64_t, Block> blocks_;  // by the hash of the data
+  uint64_t released_ = 0;
+};
+
+}  // namespace linfs
+
+}  // namespace fs
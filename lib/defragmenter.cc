@@ -0,0 +1,134 @@
+#include "lib/defragmenter.h"
+
+#include <shared_mutex>
+#include <utility>
+
+namespace fs {
+
+namespace linfs {
+
+void Defragmenter::RunPass() {
+  pass_start_ = std::chrono::steady_clock::now();
+  pass_bytes_ = 0;
+
+  std::vector<std::shared_ptr<DirectoryEntry>> dirs{root_entry_};
+  while (!dirs.empty() && !Stopped()) {
+    std::shared_ptr<DirectoryEntry> dir = std::move(dirs.back());
+    dirs.pop_back();
+    DefragmentDirectory(dir, dirs);
+  }
+}
+
+void Defragmenter::Start() {
+  stop_ = false;
+  thread_ = std::thread([this] { Run(); });
+}
+
+void Defragmenter::Stop() noexcept {
+  if (!thread_.joinable())
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(stop_mutex_);
+    stop_ = true;
+  }
+  stop_cv_.notify_all();
+  thread_.join();
+}
+
+void Defragmenter::Run() noexcept {
+  std::unique_lock<std::mutex> lock(stop_mutex_);
+  while (!stop_) {
+    lock.unlock();
+    try {
+      RunPass();
+    }
+    catch (...) {
+      /* Never mind.  Let's try again next time. */
+    }
+    lock.lock();
+
+    stop_cv_.wait_for(lock, std::chrono::milliseconds(options_.pass_interval_ms),
+                      [this] { return stop_; });
+  }
+}
+
+void Defragmenter::DefragmentDirectory(const std::shared_ptr<DirectoryEntry>& dir,
+                                       std::vector<std::shared_ptr<DirectoryEntry>>& subdirs) {
+  uint64_t cookie = 0;
+  do {
+    std::shared_ptr<Entry> entry;
+    {
+      // See LinFS::GetDirectory why the entry must be shared in the locked directory.
+      std::shared_lock<SharedMutex> lock = dir->LockShared();
+
+      std::unique_ptr<Entry> next_entry;
+      cookie = dir->GetNextEntry(cookie, reader_writer_.get(), &next_entry, nullptr,
+                                 Entry::Type::kSymlink);
+      if (cookie == 0)
+        continue;
+      if (next_entry->type() == Entry::Type::kFile && cache_->EntryIsShared(next_entry.get()))
+        continue;  // The file is open.  Skip it.
+      entry = cache_->GetSharedEntry(std::move(next_entry));
+    }
+
+    if (entry->type() == Entry::Type::kDirectory) {
+      subdirs.push_back(std::static_pointer_cast<DirectoryEntry>(entry));
+      continue;
+    }
+
+    std::shared_ptr<FileEntry> file = std::static_pointer_cast<FileEntry>(entry);
+    entry.reset();
+    try {
+      DefragmentFile(file);
+    }
+    catch (...) {
+      /* The file is still consistent.  Skip it. */
+    }
+  } while (cookie != 0 && !Stopped());
+}
+
+void Defragmenter::DefragmentFile(const std::shared_ptr<FileEntry>& file) {
+  std::unique_lock<SharedMutex> lock = file->Lock();
+
+  // Someone could open the file after we had checked it.
+  if (file.use_count() > 1)
+    return;
+
+  if (file->size() > options_.bytes_per_pass - pass_bytes_)
+    return;  // It doesn't fit in the rest of the budget.
+
+  if (file->CountSections(reader_writer_.get()) < options_.min_sections)
+    return;
+
+  // Don't keep the file locked while sleeping.  Anyone could open, change or
+  // clone it meanwhile, then the copy is stale and the file is skipped.
+  uint64_t generation = file->generation();
+  file->Defragment(reader_writer_.get(), allocator_,
+                   [this, &file, &lock, generation](uint64_t bytes) {
+                     lock.unlock();
+                     bool go_on = Throttle(bytes);
+                     lock.lock();
+                     return go_on && file.use_count() == 1 && file->generation() == generation;
+                   });
+}
+
+bool Defragmenter::Throttle(uint64_t bytes) {
+  pass_bytes_ += bytes;
+  if (options_.bytes_per_second == 0)
+    return true;
+
+  std::chrono::steady_clock::time_point deadline =
+      pass_start_ + std::chrono::microseconds(pass_bytes_ * 1000000 / options_.bytes_per_second);
+  std::unique_lock<std::mutex> lock(stop_mutex_);
+  return !stop_cv_.wait_until(lock, deadline, [this] { return stop_; });
+}
+
+bool Defragmenter::Stopped() {
+  std::lock_guard<std::mutex> lock(stop_mutex_);
+  return stop_;
+}
+
+}  // namespace linfs
+
+}  // namespace fs
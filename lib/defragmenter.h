@@ -0,0 +1,68 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "fs/filesystem_interface.h"
+#include "lib/entries/directory_entry.h"
+#include "lib/entries/file_entry.h"
+#include "lib/entry_cache.h"
+#include "lib/section_allocator.h"
+#include "lib/utils/reader_writer.h"
+
+namespace fs {
+
+namespace linfs {
+
+// Walks the whole filesystem and moves the data of fragmented files to
+// contiguous sections.  It can do that either in the calling thread (see
+// RunPass) or periodically in the background (see Start and Stop).
+class Defragmenter {
+ public:
+  using Options = FilesystemInterface::DefragmenterOptions;
+
+  Defragmenter(std::unique_ptr<ReaderWriter> reader_writer, SectionAllocator* allocator,
+               EntryCache* cache, std::shared_ptr<DirectoryEntry> root_entry,
+               const Options& options)
+      : reader_writer_(std::move(reader_writer)), allocator_(allocator), cache_(cache),
+        root_entry_(std::move(root_entry)), options_(options) {}
+  ~Defragmenter() { Stop(); }
+
+  void RunPass();
+
+  void Start();
+  void Stop() noexcept;
+
+ private:
+  void Run() noexcept;
+  void DefragmentDirectory(const std::shared_ptr<DirectoryEntry>& dir,
+                           std::vector<std::shared_ptr<DirectoryEntry>>& subdirs);
+  void DefragmentFile(const std::shared_ptr<FileEntry>& file);
+  bool Throttle(uint64_t bytes);
+  bool Stopped();
+
+  std::unique_ptr<ReaderWriter> reader_writer_;
+  SectionAllocator* allocator_;
+  EntryCache* cache_;
+  std::shared_ptr<DirectoryEntry> root_entry_;
+  const Options options_;
+
+  // The current pass' progress.
+  std::chrono::steady_clock::time_point pass_start_;
+  uint64_t pass_bytes_ = 0;
+
+  // Background thread and its stop flag.
+  std::thread thread_;
+  bool stop_ = false;
+  std::mutex stop_mutex_;
+  std::condition_variable stop_cv_;
+};
+
+}  // namespace linfs
+
+}  // namespace fs
@@ -0,0 +1,215 @@
+#include "lib/dentry_cache.h"
+
+namespace fs {
+
+namespace linfs {
+
+DentryCache::Result DentryCache::Find(uint64_t dir_offset, const char* name, Dentry* dentry) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto dir_it = directories_.find(dir_offset);
+  if (dir_it == directories_.end())
+    return Result::kUnknown;
+
+  Directory& dir = dir_it->second;
+  lru_.splice(lru_.begin(), lru_, dir.lru_it);
+  auto it = dir.dentries.find(name);
+  if (it != dir.dentries.end()) {
+    *dentry = it->second;
+    return Result::kFound;
+  }
+  if (dir.complete)
+    return Result::kNotFound;
+  if (dir.filter != nullptr)
+    return dir.filter->MayContain(BloomFilter::Hash(name)) ? Result::kMaybe : Result::kNotFound;
+  return dir.oversized ? Result::kMaybe : Result::kUnknown;
+}
+
+bool DentryCache::Fill(uint64_t dir_offset,
+                       const std::vector<std::pair<std::string, Dentry>>& dentries) {
+  uint64_t size = 0;
+  for (const auto& dentry : dentries)
+    size += DentrySize(dentry.first);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  Drop(dir_offset);
+  Directory* dir = GetDirectory(dir_offset);
+  if (dir == nullptr)
+    return false;
+  if (!Acquire(size, dir_offset)) {
+    Drop(dir_offset);
+    return false;
+  }
+
+  try {
+    dir->dentries.insert(dentries.begin(), dentries.end());
+  }
+  catch (...) {
+    budget_.Release(size);
+    Drop(dir_offset);
+    throw;
+  }
+  dir->size += size;
+  dir->complete = true;
+  return true;
+}
+
+bool DentryCache::FillFilter(uint64_t dir_offset, const std::vector<uint64_t>& hashes) {
+  // Leave room for as many new entries.
+  auto filter = std::make_unique<BloomFilter>(hashes.size() * 2);
+  for (uint64_t hash : hashes)
+    filter->Add(hash);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  Drop(dir_offset);
+  Directory* dir = GetDirectory(dir_offset);
+  if (dir == nullptr)
+    return false;
+  if (!Acquire(filter->size(), dir_offset)) {
+    dir->oversized = true;
+    return false;
+  }
+  dir->size += filter->size();
+  dir->filter = std::move(filter);
+  return true;
+}
+
+void DentryCache::Add(uint64_t dir_offset, const char* name, const Dentry& dentry) noexcept {
+  std::lock_guard<std::mutex> lock(mutex_);
+  try {
+    Directory* dir = GetDirectory(dir_offset);
+    if (dir == nullptr || dir->oversized)
+      return;
+    if (dir->filter != nullptr) {
+      uint64_t hash = BloomFilter::Hash(name);
+      if (!dir->filter->MayContain(hash))
+        dir->filter->Add(hash);
+      if (dir->filter->overfull())
+        Drop(dir_offset);  // It would let through too many names.
+      return;
+    }
+
+    std::string key(name);
+    uint64_t size = DentrySize(key);
+    if (!Acquire(size, dir_offset)) {
+      // A complete directory without the new entry would lie about it.
+      if (!dir->complete)
+        Drop(dir_offset);
+      else if (!ReplaceWithFilter(dir_offset, *dir, name))
+        dir->oversized = true;
+      return;
+    }
+    dir->size += size;
+    if (!dir->dentries.emplace(std::move(key), dentry).second) {
+      dir->size -= size;
+      budget_.Release(size);
+    }
+  }
+  catch (...) {
+    Drop(dir_offset);
+  }
+}
+
+void DentryCache::Remove(uint64_t dir_offset, const char* name) noexcept {
+  std::lock_guard<std::mutex> lock(mutex_);
+  try {
+    auto dir_it = directories_.find(dir_offset);
+    if (dir_it == directories_.end())
+      return;
+
+    // Filters keep removed names, they only let them through.
+    Directory& dir = dir_it->second;
+    auto it = dir.dentries.find(name);
+    if (it == dir.dentries.end())
+      return;
+    uint64_t size = DentrySize(it->first);
+    dir.dentries.erase(it);
+    dir.size -= size;
+    budget_.Release(size);
+  }
+  catch (...) {
+    Drop(dir_offset);
+  }
+}
+
+void DentryCache::Forget(uint64_t dir_offset) noexcept {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Drop(dir_offset);
+}
+
+void DentryCache::SetLimit(uint64_t limit) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  budget_.SetLimit(limit);
+  limit_ = limit;
+}
+
+bool DentryCache::Acquire(uint64_t size, uint64_t keep) {
+  while (!budget_.Acquire(size)) {
+    // Evict the least recently used directory, but not the one we add to.
+    auto it = lru_.rbegin();
+    if (it != lru_.rend() && *it == keep)
+      ++it;
+    if (it == lru_.rend())
+      return false;
+    Drop(*it);
+  }
+  return true;
+}
+
+DentryCache::Directory* DentryCache::GetDirectory(uint64_t dir_offset) {
+  auto dir_it = directories_.find(dir_offset);
+  if (dir_it != directories_.end()) {
+    lru_.splice(lru_.begin(), lru_, dir_it->second.lru_it);
+    return &dir_it->second;
+  }
+
+  if (!Acquire(kDirectoryOverhead, dir_offset))
+    return nullptr;
+  try {
+    lru_.push_front(dir_offset);
+  }
+  catch (...) {
+    budget_.Release(kDirectoryOverhead);
+    throw;
+  }
+  try {
+    Directory& dir = directories_[dir_offset];
+    dir.size = kDirectoryOverhead;
+    dir.lru_it = lru_.begin();
+    return &dir;
+  }
+  catch (...) {
+    lru_.pop_front();
+    budget_.Release(kDirectoryOverhead);
+    throw;
+  }
+}
+
+bool DentryCache::ReplaceWithFilter(uint64_t dir_offset, Directory& dir, const char* name) {
+  auto filter = std::make_unique<BloomFilter>((dir.dentries.size() + 1) * 2);
+  for (const auto& dentry : dir.dentries)
+    filter->Add(BloomFilter::Hash(dentry.first.c_str()));
+  filter->Add(BloomFilter::Hash(name));
+
+  budget_.Release(dir.size - kDirectoryOverhead);
+  dir.size = kDirectoryOverhead;
+  dir.dentries.clear();
+  dir.complete = false;
+  if (!Acquire(filter->size(), dir_offset))
+    return false;
+  dir.size += filter->size();
+  dir.filter = std::move(filter);
+  return true;
+}
+
+void DentryCache::Drop(uint64_t dir_offset) noexcept {
+  auto dir_it = directories_.find(dir_offset);
+  if (dir_it == directories_.end())
+    return;
+  budget_.Release(dir_it->second.size);
+  lru_.erase(dir_it->second.lru_it);
+  directories_.erase(dir_it);
+}
+
+}  // namespace linfs
+
+}  // namespace fs
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "lib/entries/entry.h"
+#include "lib/utils/bloom_filter.h"
+#include "lib/utils/memory_budget.h"
+
+namespace fs {
+
+namespace linfs {
+
+// Remembers names, offsets and types of entries of recently used directories,
+// so lookups don't go to the device.  Directories which don't fit in the
+// memory budget get a Bloom filter of their names instead, so at least most
+// misses in them are answered, or are remembered as oversized if even the
+// filter doesn't fit, so they aren't scanned again.  Directories are
+// identified by their offsets and evicted in LRU order when the budget is
+// exhausted.
+//
+// The cache must be changed under the exclusive lock of the directory and
+// filled under at least the shared one, so its contents match the device.
+class DentryCache {
+ public:
+  struct Dentry {
+    uint64_t offset;
+    Entry::Type type;
+  };
+
+  enum class Result {
+    kUnknown,   // nothing is known about the directory, scan it
+    kFound,
+    kNotFound,  // the directory is cached entirely or filtered and has no such entry
+    kMaybe,     // the filter lets the name through or the directory is
+                // oversized, find it on the device
+  };
+
+  explicit DentryCache(uint64_t limit) : budget_(limit), limit_(limit) {}
+
+  Result Find(uint64_t dir_offset, const char* name, Dentry* dentry);
+  // Remembers all entries of the directory, so misses are answered as well.
+  // Returns false if they don't fit in the budget.
+  bool Fill(uint64_t dir_offset, const std::vector<std::pair<std::string, Dentry>>& dentries);
+  // Remembers BloomFilter::Hash of all names of the directory, or that it's
+  // oversized if the filter doesn't fit in the budget either.
+  bool FillFilter(uint64_t dir_offset, const std::vector<uint64_t>& hashes);
+  void Add(uint64_t dir_offset, const char* name, const Dentry& dentry) noexcept;
+  void Remove(uint64_t dir_offset, const char* name) noexcept;
+  // Drops the removed directory.
+  void Forget(uint64_t dir_offset) noexcept;
+
+  // Doesn't evict anything until the next addition.
+  void SetLimit(uint64_t limit);
+  uint64_t limit() const { return limit_; }
+  // Returns false if the budget can't hold even an empty directory.
+  bool enabled() const { return limit_ >= kDirectoryOverhead; }
+
+  // Approximate memory taken by one entry.
+  static uint64_t DentrySize(const std::string& name) { return name.size() + kDentryOverhead; }
+
+ private:
+  static constexpr uint64_t kDentryOverhead = 64;
+  static constexpr uint64_t kDirectoryOverhead = 128;
+
+  struct Directory {
+    std::unordered_map<std::string, Dentry> dentries;
+    bool complete = false;  // all entries are here
+    // Names of all entries if they don't fit in the budget, |dentries| are
+    // empty then.
+    std::unique_ptr<BloomFilter> filter;
+    bool oversized = false;  // nothing but the directory itself fits
+    uint64_t size = 0;      // acquired from |budget_|
+    std::list<uint64_t>::iterator lru_it;
+  };
+
+  // Acquires |size| bytes evicting other directories than |keep| if needed.
+  bool Acquire(uint64_t size, uint64_t keep);
+  // Returns nullptr if even a new empty directory doesn't fit in the budget.
+  Directory* GetDirectory(uint64_t dir_offset);
+  // Makes the filter of |dir|'s entries and |name|.  Returns false and leaves
+  // |dir| empty if it doesn't fit in the budget.
+  bool ReplaceWithFilter(uint64_t dir_offset, Directory& dir, const char* name);
+  void Drop(uint64_t dir_offset) noexcept;
+
+  std::unordered_map<uint64_t, Directory> directories_;
+  std::list<uint64_t> lru_;  // the most recently used first
+  MemoryBudget budget_;
+  std::atomic<uint64_t> limit_;
+  std::mutex mutex_;
+};
+
+}  // namespace linfs
+
+}  // namespace fs
@@ -0,0 +1,365 @@
+#include "lib/directory_index.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "fs/limits.h"
+#include "lib/entries/entry.h"
+#include "lib/layout/section_layout.h"
+#include "lib/sections/section.h"
+#include "lib/utils/byte_order.h"
+#include "lib/utils/format_exception.h"
+
+namespace fs {
+
+namespace linfs {
+
+namespace {
+
+IndexLayout::Record PackRecord(const IndexLayout::Record& record) {
+  return IndexLayout::Record{ByteOrder::Pack(record.entry_offset),
+                             ByteOrder::Pack(record.slot_offset), ByteOrder::Pack(record.hash),
+                             0};
+}
+
+IndexLayout::Record UnpackRecord(const IndexLayout::Record& record) {
+  return IndexLayout::Record{ByteOrder::Unpack(record.entry_offset),
+                             ByteOrder::Unpack(record.slot_offset),
+                             ByteOrder::Unpack(record.hash), 0};
+}
+
+// Makes a list of the slots between |slots_offset| and |slots_end|, which
+// ends with |next_free_slot|.
+void LinkSlots(uint64_t slots_offset, uint64_t slots_end, uint64_t next_free_slot,
+               ReaderWriter* writer) {
+  std::vector<uint64_t> slots((slots_end - slots_offset) / sizeof(uint64_t));
+  for (size_t i = 0; i != slots.size(); ++i) {
+    uint64_t next = i + 1 != slots.size() ? slots_offset + (i + 1) * sizeof(uint64_t)
+                                          : next_free_slot;
+    slots[i] = ByteOrder::Pack(next | IndexLayout::kFreeSlot);
+  }
+  writer->Write(reinterpret_cast<const char*>(slots.data()), slots.size() * sizeof(uint64_t),
+                slots_offset);
+}
+
+// Returns true if the record at |j| can't move to |i| (its home is in (i, j]).
+bool StaysAt(uint64_t home, uint64_t i, uint64_t j) {
+  return i <= j ? i < home && home <= j : i < home || home <= j;
+}
+
+}  // namespace
+
+DirectoryIndex DirectoryIndex::Create(uint64_t header_offset, uint64_t section_offset,
+                                      uint64_t slots_offset, uint64_t slots_end,
+                                      ReaderWriter* writer) {
+  DirectoryIndex index(header_offset);
+  LinkSlots(slots_offset, slots_end, 0, writer);
+  index.StoreHeader(Header{0, 0, 0, slots_offset != slots_end ? slots_offset : 0,
+                           section_offset},
+                    writer);
+  return index;
+}
+
+uint32_t DirectoryIndex::Hash(const char* name) {
+  // FNV-1a of the name as it's stored in the entry's header.
+  uint32_t hash = 2166136261U;
+  for (size_t i = 0, size = strnlen(name, kNameMax); i != size; ++i)
+    hash = (hash ^ static_cast<uint8_t>(name[i])) * 16777619U;
+  return hash;
+}
+
+bool DirectoryIndex::Find(const char* name, ReaderWriter* reader,
+                          const std::function<bool(uint64_t entry_offset)>& matches,
+                          bool* dropped) {
+  Header header = LoadHeader(reader);
+  *dropped = header.table_offset == 0 && header.count != 0;
+  if (header.table_offset == 0)
+    return false;
+
+  uint32_t hash = Hash(name);
+  uint64_t mask = header.capacity - 1;
+  for (uint64_t n = 0, i = hash & mask; n != header.capacity; ++n, i = (i + 1) & mask) {
+    Record record = ReadRecord(header, i, reader);
+    if (record.entry_offset == 0)
+      return false;
+    if (record.hash == hash && matches(record.entry_offset))
+      return true;
+  }
+  return false;
+}
+
+void DirectoryIndex::Insert(const char* name, uint64_t entry_offset, uint64_t slot,
+                            ReaderWriter* reader_writer, SectionAllocator* allocator,
+                            const Collector& collect) {
+  Header header = LoadHeader(reader_writer);
+  if (header.table_offset == 0 && header.count != 0)
+    Rebuild(header, reader_writer, allocator, collect);
+  // Keep the table at most 3/4 full, so probe sequences stay short.
+  if ((header.table_offset == 0 && header.count == 0) ||
+      (header.table_offset != 0 && (header.count + 1) * 4 > header.capacity * 3)) {
+    try {
+      Grow(header, reader_writer, allocator);
+    }
+    catch (...) {
+      // There is no room for a bigger table.  Lookups stop at an empty
+      // record, so keep one while filling this table and then scan the slots.
+      if (header.table_offset != 0 && header.count + 2 > header.capacity)
+        Drop(header, reader_writer, allocator);
+    }
+  }
+  if (header.free_slot == 0)
+    AddSlots(header, reader_writer, allocator);
+
+  uint64_t slot_offset = header.free_slot;
+  uint64_t next_free_slot = reader_writer->Read<uint64_t>(slot_offset);
+  if ((next_free_slot & IndexLayout::kFreeSlot) == 0)
+    throw FormatException();  // the slot is in use
+
+  if (header.table_offset != 0) {
+    uint32_t hash = Hash(name);
+    uint64_t mask = header.capacity - 1;
+    uint64_t n = 0, i = hash & mask;
+    for (; n != header.capacity; ++n, i = (i + 1) & mask)
+      if (ReadRecord(header, i, reader_writer).entry_offset == 0)
+        break;
+    if (n == header.capacity)
+      throw FormatException();  // the table is full
+
+    WriteRecord(header, i, Record{entry_offset, slot_offset, hash, 0}, reader_writer);
+  }
+  reader_writer->Write<uint64_t>(slot, slot_offset);
+  header.free_slot = next_free_slot & ~IndexLayout::kFreeSlot;
+  ++header.count;
+  StoreHeader(header, reader_writer);
+}
+
+bool DirectoryIndex::Remove(const char* name, uint64_t entry_offset,
+                            ReaderWriter* reader_writer) {
+  Header header = LoadHeader(reader_writer);
+  if (header.table_offset == 0)
+    return false;
+
+  uint64_t mask = header.capacity - 1;
+  uint64_t n = 0, i = Hash(name) & mask;
+  Record record;
+  for (; n != header.capacity; ++n, i = (i + 1) & mask) {
+    record = ReadRecord(header, i, reader_writer);
+    if (record.entry_offset == 0)
+      return false;
+    if (record.entry_offset == entry_offset)
+      break;
+  }
+  if (n == header.capacity)
+    return false;
+
+  reader_writer->Write<uint64_t>(header.free_slot | IndexLayout::kFreeSlot, record.slot_offset);
+  header.free_slot = record.slot_offset;
+  --header.count;
+
+  // Move the following records back, so that lookups don't stop at the hole.
+  for (uint64_t j = (i + 1) & mask;; j = (j + 1) & mask) {
+    Record next = ReadRecord(header, j, reader_writer);
+    if (next.entry_offset == 0)
+      break;
+    if (StaysAt(next.hash & mask, i, j))
+      continue;
+    WriteRecord(header, i, next, reader_writer);
+    i = j;
+  }
+  WriteRecord(header, i, Record{0, 0, 0, 0}, reader_writer);
+  StoreHeader(header, reader_writer);
+  return true;
+}
+
+void DirectoryIndex::FreeSlot(uint64_t slot_offset, ReaderWriter* reader_writer) {
+  Header header = LoadHeader(reader_writer);
+  reader_writer->Write<uint64_t>(header.free_slot | IndexLayout::kFreeSlot, slot_offset);
+  header.free_slot = slot_offset;
+  --header.count;
+  StoreHeader(header, reader_writer);
+}
+
+bool DirectoryIndex::Dropped(ReaderWriter* reader) {
+  Header header = LoadHeader(reader);
+  return header.table_offset == 0 && header.count != 0;
+}
+
+uint64_t DirectoryIndex::Count(ReaderWriter* reader) {
+  return LoadHeader(reader).count;
+}
+
+void DirectoryIndex::Release(ReaderWriter* reader_writer, SectionAllocator* allocator) noexcept {
+  try {
+    Header header = LoadHeader(reader_writer);
+    if (header.table_offset != 0)
+      allocator->ReleaseSection(header.table_offset, reader_writer);
+  }
+  catch (...) {
+    /* Well, the table is lost. */
+  }
+}
+
+DirectoryIndex::Header DirectoryIndex::LoadHeader(ReaderWriter* reader) {
+  Header header = reader->Read<Header>(header_offset_);
+  header.table_offset = ByteOrder::Unpack(header.table_offset);
+  header.capacity = ByteOrder::Unpack(header.capacity);
+  header.count = ByteOrder::Unpack(header.count);
+  header.free_slot = ByteOrder::Unpack(header.free_slot);
+  header.last_section = ByteOrder::Unpack(header.last_section);
+  if (header.table_offset != 0 &&
+      (header.capacity == 0 || (header.capacity & (header.capacity - 1)) != 0 ||
+       header.count >= header.capacity))
+    throw FormatException();  // the index is broken
+  return header;
+}
+
+void DirectoryIndex::StoreHeader(const Header& header, ReaderWriter* writer) {
+  writer->Write<Header>(Header{ByteOrder::Pack(header.table_offset),
+                               ByteOrder::Pack(header.capacity), ByteOrder::Pack(header.count),
+                               ByteOrder::Pack(header.free_slot),
+                               ByteOrder::Pack(header.last_section)},
+                        header_offset_);
+}
+
+DirectoryIndex::Record DirectoryIndex::ReadRecord(const Header& header, uint64_t i,
+                                                  ReaderWriter* reader) {
+  return UnpackRecord(reader->Read<Record>(
+      header.table_offset + sizeof(SectionLayout::Header) + i * sizeof(Record)));
+}
+
+void DirectoryIndex::WriteRecord(const Header& header, uint64_t i, const Record& record,
+                                 ReaderWriter* writer) {
+  writer->Write<Record>(PackRecord(record), header.table_offset +
+                                                sizeof(SectionLayout::Header) +
+                                                i * sizeof(Record));
+}
+
+void DirectoryIndex::Grow(Header& header, ReaderWriter* reader_writer,
+                          SectionAllocator* allocator) {
+  // The first table takes one cluster.
+  Section table =
+      AllocateTable(std::max<uint64_t>(header.capacity * 2, 1), reader_writer, allocator);
+  std::vector<Record> records;
+  try {
+    std::vector<Record> old_records(header.capacity);
+    if (header.table_offset != 0)
+      reader_writer->Read(header.table_offset + sizeof(SectionLayout::Header),
+                          reinterpret_cast<char*>(old_records.data()),
+                          old_records.size() * sizeof(Record));
+    for (const Record& packed : old_records)
+      if (packed.entry_offset != 0)
+        records.push_back(UnpackRecord(packed));
+  }
+  catch (...) {
+    allocator->ReleaseSection(table, reader_writer);
+    throw;
+  }
+
+  uint64_t old_table_offset = FillTable(header, table, records, reader_writer, allocator);
+  if (old_table_offset != 0)
+    allocator->ReleaseSection(old_table_offset, reader_writer);
+}
+
+void DirectoryIndex::Drop(Header& header, ReaderWriter* reader_writer,
+                          SectionAllocator* allocator) {
+  uint64_t table_offset = header.table_offset;
+  header.table_offset = 0;
+  header.capacity = 0;
+  StoreHeader(header, reader_writer);
+  allocator->ReleaseSection(table_offset, reader_writer);
+}
+
+void DirectoryIndex::Rebuild(Header& header, ReaderWriter* reader_writer,
+                             SectionAllocator* allocator, const Collector& collect) {
+  // Leave room for the entry being inserted.
+  uint64_t capacity = 1;
+  while ((header.count + 1) * 4 > capacity * 3)
+    capacity *= 2;
+
+  Section table(0, 0, 0);
+  try {
+    table = AllocateTable(capacity, reader_writer, allocator);
+  }
+  catch (...) {
+    return;  // Keep scanning the slots.
+  }
+
+  std::vector<Record> records;
+  try {
+    records = collect();
+  }
+  catch (...) {
+    allocator->ReleaseSection(table, reader_writer);
+    throw;
+  }
+  header.count = records.size();
+  FillTable(header, table, records, reader_writer, allocator);
+}
+
+Section DirectoryIndex::AllocateTable(uint64_t capacity, ReaderWriter* reader_writer,
+                                      SectionAllocator* allocator) {
+  return allocator->AllocateContiguousSection(
+      capacity * sizeof(Record) + sizeof(SectionLayout::Header), Entry::Type::kNone,
+      reader_writer);
+}
+
+uint64_t DirectoryIndex::FillTable(Header& header, const Section& table,
+                                   const std::vector<Record>& records,
+                                   ReaderWriter* reader_writer, SectionAllocator* allocator) {
+  uint64_t capacity = 1;
+  while (capacity * 2 * sizeof(Record) <= table.data_size())
+    capacity *= 2;
+
+  try {
+    if (records.size() >= capacity)
+      throw FormatException();  // more entries than the index counts
+
+    std::vector<Record> packed_records(capacity, Record{0, 0, 0, 0});
+    for (const Record& record : records) {
+      uint64_t i = record.hash & (capacity - 1);
+      while (packed_records[i].entry_offset != 0)
+        i = (i + 1) & (capacity - 1);
+      packed_records[i] = PackRecord(record);
+    }
+    reader_writer->Write(reinterpret_cast<const char*>(packed_records.data()),
+                         packed_records.size() * sizeof(Record), table.data_offset());
+
+    Header filled = header;
+    filled.table_offset = table.base_offset();
+    filled.capacity = capacity;
+    StoreHeader(filled, reader_writer);
+  }
+  catch (...) {
+    allocator->ReleaseSection(table, reader_writer);
+    throw;
+  }
+
+  uint64_t old_table_offset = header.table_offset;
+  header.table_offset = table.base_offset();
+  header.capacity = capacity;
+  return old_table_offset;
+}
+
+void DirectoryIndex::AddSlots(Header& header, ReaderWriter* reader_writer,
+                              SectionAllocator* allocator) {
+  Section section = allocator->AllocateSection(1, Entry::Type::kDirectory, reader_writer);
+  try {
+    LinkSlots(section.data_offset(), section.data_offset() + section.data_size(), 0,
+              reader_writer);
+    Section::Load(header.last_section, reader_writer).SetNext(section.base_offset(),
+                                                              reader_writer);
+  }
+  catch (...) {
+    allocator->ReleaseSection(section, reader_writer);
+    throw;
+  }
+
+  header.last_section = section.base_offset();
+  header.free_slot = section.data_offset();
+  StoreHeader(header, reader_writer);
+}
+
+}  // namespace linfs
+
+}  // namespace fs
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "lib/layout/index_layout.h"
+#include "lib/section_allocator.h"
+#include "lib/utils/reader_writer.h"
+
+namespace fs {
+
+namespace linfs {
+
+// Hash table which maps names of a directory's entries to their offsets and
+// slots (see IndexLayout).  It owns the table and the free slots list, but
+// not the directory's sections.
+class DirectoryIndex {
+ public:
+  // Writes an empty index at |header_offset| and links the slots between
+  // |slots_offset| and |slots_end| of the directory's |section_offset| in the
+  // free list.
+  static DirectoryIndex Create(uint64_t header_offset, uint64_t section_offset,
+                               uint64_t slots_offset, uint64_t slots_end, ReaderWriter* writer);
+
+  static uint32_t Hash(const char* name);
+
+  DirectoryIndex(uint64_t header_offset) : header_offset_(header_offset) {}
+
+  // Returns the records of every entry of the directory.
+  using Collector = std::function<std::vector<IndexLayout::Record>()>;
+
+  // Calls |matches| for the entries whose names have the same hash as |name|
+  // until it returns true.  Returns false if it never did.  If the table was
+  // dropped (see Insert), sets |*dropped| instead, so the caller has to scan
+  // the slots.
+  bool Find(const char* name, ReaderWriter* reader,
+            const std::function<bool(uint64_t entry_offset)>& matches, bool* dropped);
+  // Puts |slot| (the entry's offset or its tagged slot) to a free slot,
+  // allocating a new section of the directory if there are none, and adds
+  // |entry_offset| to the table.  If there is no room for a bigger table, it
+  // fills the current one while lookups still stop at an empty record and
+  // then drops it.  Later calls rebuild the dropped table from the records
+  // returned by |collect| as soon as there is room for it.
+  void Insert(const char* name, uint64_t entry_offset, uint64_t slot,
+              ReaderWriter* reader_writer, SectionAllocator* allocator,
+              const Collector& collect);
+  // Returns false if there is no such entry or if the table was dropped.
+  bool Remove(const char* name, uint64_t entry_offset, ReaderWriter* reader_writer);
+  // Puts the slot at |slot_offset| to the free list, which is how entries are
+  // removed while the table is dropped.
+  void FreeSlot(uint64_t slot_offset, ReaderWriter* reader_writer);
+  bool Dropped(ReaderWriter* reader);
+  uint64_t Count(ReaderWriter* reader);
+  // Releases the table.
+  void Release(ReaderWriter* reader_writer, SectionAllocator* allocator) noexcept;
+
+ private:
+  using Header = IndexLayout::Header;
+  using Record = IndexLayout::Record;
+
+  Header LoadHeader(ReaderWriter* reader);
+  void StoreHeader(const Header& header, ReaderWriter* writer);
+  Record ReadRecord(const Header& header, uint64_t i, ReaderWriter* reader);
+  void WriteRecord(const Header& header, uint64_t i, const Record& record, ReaderWriter* writer);
+
+  // Moves the records to a twice bigger table.  Both update the stored
+  // |header| as well.
+  void Grow(Header& header, ReaderWriter* reader_writer, SectionAllocator* allocator);
+  // Releases the table, leaving |header.count| as it is.
+  void Drop(Header& header, ReaderWriter* reader_writer, SectionAllocator* allocator);
+  // Makes a table of the records returned by |collect|.  Does nothing if
+  // there is still no room for it.
+  void Rebuild(Header& header, ReaderWriter* reader_writer, SectionAllocator* allocator,
+               const Collector& collect);
+  // Allocates a contiguous section for at least |capacity| records.
+  Section AllocateTable(uint64_t capacity, ReaderWriter* reader_writer,
+                        SectionAllocator* allocator);
+  // Writes |records| to |table|, which replaces the table of |header|, or
+  // releases |table| if it fails.  Returns the offset of the old table.
+  uint64_t FillTable(Header& header, const Section& table, const std::vector<Record>& records,
+                     ReaderWriter* reader_writer, SectionAllocator* allocator);
+  // Adds a new section to the directory and links its slots in the free list.
+  void AddSlots(Header& header, ReaderWriter* reader_writer, SectionAllocator* allocator);
+
+  const uint64_t header_offset_;
+};
+
+}  // namespace linfs
+
+}  // namespace fs
@@ -1,8 +1,11 @@
 #include "lib/entries/directory_entry.h"
 
 #include <cassert>
+#include <utility>
+#include <vector>
 
 #include "lib/layout/entry_layout.h"
+#include "lib/layout/index_layout.h"
 #include "lib/sections/section_directory.h"
 
 namespace fs {
@@ -12,32 +15,71 @@ namespace linfs {
 std::unique_ptr<DirectoryEntry> DirectoryEntry::Create(uint64_t entry_offset,
                                                        uint64_t entry_size,
                                                        ReaderWriter* writer,
-                                                       const char* name) {
-  writer->Write<EntryLayout::DirectoryHeader>(EntryLayout::DirectoryHeader(name), entry_offset);
-  ClearEntries(entry_offset + sizeof(EntryLayout::DirectoryHeader),
-               entry_offset + entry_size, writer);
-  return std::make_unique<DirectoryEntry>(entry_offset);
+                                                       const char* name,
+                                                       uint8_t flags) {
+  writer->Write<EntryLayout::DirectoryHeader>(EntryLayout::DirectoryHeader(name, flags),
+                                              entry_offset);
+  if ((flags & EntryLayout::kFlagNameIndex) != 0) {
+    uint64_t index_offset = entry_offset + sizeof(EntryLayout::DirectoryHeader);
+    DirectoryIndex::Create(index_offset, entry_offset - sizeof(SectionLayout::Header),
+                           index_offset + sizeof(IndexLayout::Header),
+                           entry_offset + entry_size, writer);
+  }
+  else
+    ClearEntries(entry_offset + sizeof(EntryLayout::DirectoryHeader),
+                 entry_offset + entry_size, writer);
+  return std::make_unique<DirectoryEntry>(entry_offset, flags);
+}
+
+bool DirectoryEntry::name_index() const {
+  return (flags_ & EntryLayout::kFlagNameIndex) != 0;
+}
+
+bool DirectoryEntry::tagged_slots() const {
+  return (flags_ & EntryLayout::kFlagTaggedSlots) != 0;
 }
 
-void DirectoryEntry::AddEntry(const Entry* entry, ReaderWriter* reader_writer,
-                              SectionAllocator* allocator) {
+void DirectoryEntry::Release(ReaderWriter* reader_writer, SectionAllocator* allocator) noexcept {
+  if (name_index())
+    GetIndex().Release(reader_writer, allocator);
+  Entry::Release(reader_writer, allocator);
+}
+
+void DirectoryEntry::AddEntry(const Entry* entry, const char* name,
+                              ReaderWriter* reader_writer, SectionAllocator* allocator) {
+  uint64_t slot = MakeSlot(entry, name);
+  if (name_index()) {
+    GetIndex().Insert(name, entry->base_offset(), slot, reader_writer, allocator, [&] {
+      std::vector<IndexLayout::Record> records;
+      FindSlot(reader_writer, [&](uint64_t slot_offset, uint64_t it_slot) {
+        char it_name[kNameMax + 1];
+        uint64_t entry_offset = EntryOffset(it_slot);
+        Entry::Load(entry_offset, reader_writer, it_name);
+        records.push_back(
+            IndexLayout::Record{entry_offset, slot_offset, DirectoryIndex::Hash(it_name), 0});
+        return false;
+      });
+      return records;
+    });
+    return;
+  }
+
   SectionDirectory sec_dir = Section::Load(section_offset(), reader_writer);
 
-  bool success = sec_dir.AddEntry(entry->base_offset(), reader_writer,
-                                  sizeof(EntryLayout::DirectoryHeader));
+  bool success = sec_dir.AddEntry(slot, reader_writer, sizeof(EntryLayout::DirectoryHeader));
   while (!success && sec_dir.next_offset()) {
     sec_dir = Section::Load(sec_dir.next_offset(), reader_writer);
-    success = sec_dir.AddEntry(entry->base_offset(), reader_writer);
+    success = sec_dir.AddEntry(slot, reader_writer);
   }
   if (success)
     return;
 
-  SectionDirectory next_sec_dir = allocator->AllocateSection(1, reader_writer);
+  SectionDirectory next_sec_dir = allocator->AllocateSection(1, type(), reader_writer);
   try {
     ClearEntries(next_sec_dir.data_offset(),
                  next_sec_dir.data_offset() + next_sec_dir.data_size(),
                  reader_writer);
-    success = next_sec_dir.AddEntry(entry->base_offset(), reader_writer);
+    success = next_sec_dir.AddEntry(slot, reader_writer);
     assert(success && "no space in the just allocated section");
 
     // Update next directory entry stored in |sec_dir.next_offset()|
@@ -49,16 +91,37 @@ void DirectoryEntry::AddEntry(const Entry* entry, ReaderWriter* reader_writer,
   }
 }
 
-bool DirectoryEntry::RemoveEntry(const Entry* entry, ReaderWriter* reader_writer,
-                                 SectionAllocator* allocator) {
+bool DirectoryEntry::RemoveEntry(const Entry* entry, const char* name,
+                                 ReaderWriter* reader_writer, SectionAllocator* allocator) {
+  uint64_t slot = MakeSlot(entry, name);
+  if (name_index()) {
+    // The index keeps the sections for the new entries.
+    DirectoryIndex index = GetIndex();
+    if (index.Remove(name, entry->base_offset(), reader_writer))
+      return true;
+    if (!index.Dropped(reader_writer))
+      return false;
+
+    uint64_t slot_offset = 0;
+    FindSlot(reader_writer, [&](uint64_t it_slot_offset, uint64_t it_slot) {
+      if (it_slot != slot)
+        return false;
+      slot_offset = it_slot_offset;
+      return true;
+    });
+    if (slot_offset == 0)
+      return false;
+    index.FreeSlot(slot_offset, reader_writer);
+    return true;
+  }
+
   SectionDirectory sec_dir = Section::Load(section_offset(), reader_writer);
   SectionDirectory last_used_sec_dir = sec_dir;  // It's always used.
 
-  bool success = sec_dir.RemoveEntry(entry->base_offset(), reader_writer,
-                                     sizeof(EntryLayout::DirectoryHeader));
+  bool success = sec_dir.RemoveEntry(slot, reader_writer, sizeof(EntryLayout::DirectoryHeader));
   while (!success && sec_dir.next_offset()) {
     sec_dir = Section::Load(sec_dir.next_offset(), reader_writer);
-    success = sec_dir.RemoveEntry(entry->base_offset(), reader_writer);
+    success = sec_dir.RemoveEntry(slot, reader_writer);
 
     // Track the last non-empty section and release unused ones when possible.
     try {
@@ -82,6 +145,9 @@ bool DirectoryEntry::RemoveEntry(const Entry* entry, ReaderWriter* reader_writer
 }
 
 bool DirectoryEntry::HasEntries(ReaderWriter* reader) {
+  if (name_index())
+    return GetIndex().Count(reader) != 0;
+
   SectionDirectory sec_dir = Section::Load(section_offset(), reader);
 
   bool has_entries = sec_dir.HasEntries(reader, sizeof(EntryLayout::DirectoryHeader));
@@ -93,18 +159,59 @@ bool DirectoryEntry::HasEntries(ReaderWriter* reader) {
   return has_entries;
 }
 
+uint64_t DirectoryEntry::CountSlots(ReaderWriter* reader, uint64_t* used_slots) {
+  SectionDirectory sec_dir = Section::Load(section_offset(), reader);
+  SectionDirectory::Iterator it = sec_dir.EntriesBegin(reader, SlotsPosition());
+
+  uint64_t slots = 0;
+  *used_slots = 0;
+  while (1) {
+    for (; it != sec_dir.EntriesEnd(); ++it) {
+      ++slots;
+      if (SectionDirectory::IsUsed(*it))
+        ++*used_slots;
+    }
+
+    if (!sec_dir.next_offset())
+      return slots;
+
+    sec_dir = Section::Load(sec_dir.next_offset(), reader);
+    it = sec_dir.EntriesBegin(reader);
+  }
+}
+
 std::unique_ptr<Entry> DirectoryEntry::FindEntryByName(const char* entry_name,
                                                        ReaderWriter* reader) {
+  if (name_index()) {
+    std::unique_ptr<Entry> found;
+    bool dropped = false;
+    GetIndex().Find(entry_name, reader, [&](uint64_t entry_offset) {
+      char it_name[kNameMax + 1];
+      std::unique_ptr<Entry> it_entry = Entry::Load(entry_offset, reader, it_name);
+      if (strcmp(entry_name, it_name) != 0)
+        return false;  // Just the same hash.
+      found = std::move(it_entry);
+      return true;
+    }, &dropped);
+    if (!dropped)
+      return found;
+    // There was no room for the table, so scan the slots.
+  }
+
+  bool tagged = tagged_slots();
+  uint16_t fingerprint = SectionDirectory::Fingerprint(DirectoryIndex::Hash(entry_name));
   SectionDirectory sec_dir = Section::Load(section_offset(), reader);
-  SectionDirectory::Iterator it = sec_dir.EntriesBegin(reader, sizeof(EntryLayout::DirectoryHeader));
+  std::vector<uint64_t> slots = sec_dir.ReadSlots(reader, SlotsPosition());
 
   while (1) {
-    for (; it != sec_dir.EntriesEnd(); ++it) {
-      if (*it == 0)
+    for (uint64_t slot : slots) {
+      if (!SectionDirectory::IsUsed(slot))
+        continue;
+      if (tagged && SectionDirectory::SlotFingerprint(slot) != fingerprint)
         continue;
 
       char it_name[kNameMax + 1];
-      std::unique_ptr<Entry> it_entry = Entry::Load(*it, reader, it_name);
+      std::unique_ptr<Entry> it_entry = Entry::Load(EntryOffset(slot), reader, it_name);
       if (strcmp(entry_name, it_name) == 0)
         return it_entry;
     }
@@ -113,15 +220,39 @@ std::unique_ptr<Entry> DirectoryEntry::FindEntryByName(const char* entry_name,
       return nullptr;
 
     sec_dir = Section::Load(sec_dir.next_offset(), reader);
-    it = sec_dir.EntriesBegin(reader);
+    slots = sec_dir.ReadSlots(reader);
   }
 }
 
-uint64_t DirectoryEntry::GetNextEntryName(uint64_t cursor, ReaderWriter* reader,
-                                          char* next_buf) {
+void DirectoryEntry::ForEachEntry(
+    ReaderWriter* reader,
+    const std::function<void(std::unique_ptr<Entry> entry, const char* name)>& visit) {
+  SectionDirectory sec_dir = Section::Load(section_offset(), reader);
+  std::vector<uint64_t> slots = sec_dir.ReadSlots(reader, SlotsPosition());
+
+  while (1) {
+    for (uint64_t slot : slots) {
+      if (!SectionDirectory::IsUsed(slot))
+        continue;
+      char name[kNameMax + 1];
+      std::unique_ptr<Entry> entry = Entry::Load(EntryOffset(slot), reader, name);
+      visit(std::move(entry), name);
+    }
+
+    if (!sec_dir.next_offset())
+      return;
+
+    sec_dir = Section::Load(sec_dir.next_offset(), reader);
+    slots = sec_dir.ReadSlots(reader);
+  }
+}
+
+uint64_t DirectoryEntry::GetNextEntry(uint64_t cursor, ReaderWriter* reader,
+                                      std::unique_ptr<Entry>* next_entry, char* next_buf,
+                                      Type skip_type) {
   uint64_t start_position = cursor;
   SectionDirectory sec_dir =
-      CursorToSection(start_position, reader, sizeof(EntryLayout::DirectoryHeader),
+      CursorToSection(start_position, reader, SlotsPosition(),
                       false);  // check_cursor -- We will check it by ourselves.
   if (start_position > sec_dir.data_size())
     return 0;  // Some sections were probably released.  Ignore it.
@@ -132,10 +263,18 @@ uint64_t DirectoryEntry::GetNextEntryName(uint64_t cursor, ReaderWriter* reader,
   while (1) {
     for (SectionDirectory::Iterator it = sec_dir.EntriesBegin(reader, start_position);
          it != sec_dir.EntriesEnd(); ++it) {
-      if (*it == 0)
+      uint64_t slot = *it;
+      if (!SectionDirectory::IsUsed(slot))
+        continue;
+      if (tagged_slots() && SectionDirectory::SlotType(slot) == skip_type)
         continue;
 
-      Entry::Load(*it++, reader, next_buf);
+      std::unique_ptr<Entry> entry = Entry::Load(EntryOffset(slot), reader, next_buf);
+      if (entry->type() == skip_type)
+        continue;
+      ++it;
+      if (next_entry != nullptr)
+        *next_entry = std::move(entry);
       uint64_t begin_position = sec_dir.data_offset() + start_position;
       return cursor + it.position() - begin_position;
     }
@@ -149,6 +288,48 @@ uint64_t DirectoryEntry::GetNextEntryName(uint64_t cursor, ReaderWriter* reader,
   }
 }
 
+uint64_t DirectoryEntry::SlotsPosition() const {
+  return sizeof(EntryLayout::DirectoryHeader) + (name_index() ? sizeof(IndexLayout::Header) : 0);
+}
+
+uint64_t DirectoryEntry::MakeSlot(const Entry* entry, const char* name) const {
+  if (!tagged_slots())
+    return entry->base_offset();
+  return SectionDirectory::MakeTaggedSlot(entry->base_offset(), entry->type(),
+                                          DirectoryIndex::Hash(name));
+}
+
+uint64_t DirectoryEntry::EntryOffset(uint64_t slot) const {
+  return tagged_slots() ? SectionDirectory::SlotOffset(slot) : slot;
+}
+
+DirectoryIndex DirectoryEntry::GetIndex() const {
+  return DirectoryIndex(base_offset() + sizeof(EntryLayout::DirectoryHeader));
+}
+
+bool DirectoryEntry::FindSlot(
+    ReaderWriter* reader,
+    const std::function<bool(uint64_t slot_offset, uint64_t slot)>& matches) {
+  SectionDirectory sec_dir = Section::Load(section_offset(), reader);
+  uint64_t start_position = SlotsPosition();
+
+  while (1) {
+    std::vector<uint64_t> slots = sec_dir.ReadSlots(reader, start_position);
+    uint64_t slot_offset = sec_dir.data_offset() + start_position;
+    for (uint64_t slot : slots) {
+      if (SectionDirectory::IsUsed(slot) && matches(slot_offset, slot))
+        return true;
+      slot_offset += sizeof(uint64_t);
+    }
+
+    if (!sec_dir.next_offset())
+      return false;
+
+    sec_dir = Section::Load(sec_dir.next_offset(), reader);
+    start_position = 0;
+  }
+}
+
 void DirectoryEntry::ClearEntries(uint64_t entries_offset, uint64_t entries_end,
                                   ReaderWriter* writer) {
   while (entries_offset != entries_end) {
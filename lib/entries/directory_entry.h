@@ -1,8 +1,10 @@
 #pragma once
 
 #include <cstdint>
+#include <functional>
 #include <memory>
 
+#include "lib/directory_index.h"
 #include "lib/entries/entry.h"
 #include "lib/section_allocator.h"
 #include "lib/utils/reader_writer.h"
@@ -16,20 +18,56 @@ class DirectoryEntry : public Entry {
   static std::unique_ptr<DirectoryEntry> Create(uint64_t entry_offset,
                                                 uint64_t entry_size,
                                                 ReaderWriter* writer,
-                                                const char* name);
+                                                const char* name,
+                                                uint8_t flags = 0);
 
-  DirectoryEntry(uint64_t base_offset) : Entry(Type::kDirectory, base_offset) {}
+  // |flags| are EntryLayout::kFlag* flags of DirectoryHeader.
+  DirectoryEntry(uint64_t base_offset, uint8_t flags = 0)
+      : Entry(Type::kDirectory, base_offset), flags_(flags) {}
   ~DirectoryEntry() override = default;
 
-  void AddEntry(const Entry* entry, ReaderWriter* reader_writer, SectionAllocator* allocator);
-  bool RemoveEntry(const Entry* entry, ReaderWriter* reader_writer,
+  bool name_index() const;
+  bool tagged_slots() const;
+
+  void Release(ReaderWriter* reader_writer, SectionAllocator* allocator) noexcept override;
+
+  // |name| is the name of |entry|.
+  void AddEntry(const Entry* entry, const char* name, ReaderWriter* reader_writer,
+                SectionAllocator* allocator);
+  bool RemoveEntry(const Entry* entry, const char* name, ReaderWriter* reader_writer,
                    SectionAllocator* allocator);
   bool HasEntries(ReaderWriter* reader);
+  // Returns the number of slots for entries and the number of used ones in |used_slots|.
+  uint64_t CountSlots(ReaderWriter* reader, uint64_t* used_slots);
   std::unique_ptr<Entry> FindEntryByName(const char* entry_name, ReaderWriter* reader);
-  uint64_t GetNextEntryName(uint64_t cursor, ReaderWriter* reader, char* next_buf);
+  uint64_t GetNextEntryName(uint64_t cursor, ReaderWriter* reader, char* next_buf) {
+    return GetNextEntry(cursor, reader, nullptr, next_buf);
+  }
+  // Calls |visit| for every entry, reading the slots of each section at once.
+  void ForEachEntry(ReaderWriter* reader,
+                    const std::function<void(std::unique_ptr<Entry> entry,
+                                             const char* name)>& visit);
+  // Entries of |skip_type| are skipped, without loading them if the slots
+  // are tagged.
+  uint64_t GetNextEntry(uint64_t cursor, ReaderWriter* reader,
+                        std::unique_ptr<Entry>* next_entry, char* next_buf = nullptr,
+                        Type skip_type = Type::kNone);
 
  private:
   static void ClearEntries(uint64_t entries_offset, uint64_t entries_end, ReaderWriter* writer);
+
+  // Position of the first slot in the first section.
+  uint64_t SlotsPosition() const;
+  // Returns the value of |entry|'s slot.
+  uint64_t MakeSlot(const Entry* entry, const char* name) const;
+  uint64_t EntryOffset(uint64_t slot) const;
+  DirectoryIndex GetIndex() const;
+  // Calls |matches| with the offset and the value of every used slot until it
+  // returns true.  Returns false if it never did.
+  bool FindSlot(ReaderWriter* reader,
+                const std::function<bool(uint64_t slot_offset, uint64_t slot)>& matches);
+
+  const uint8_t flags_;
 };
 
 }  // namespace linfs
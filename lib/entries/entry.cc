@@ -7,6 +7,7 @@
 #include "lib/entries/none_entry.h"
 #include "lib/entries/symlink_entry.h"
 #include "lib/layout/entry_layout.h"
+#include "lib/section_allocator.h"
 #include "lib/utils/byte_order.h"
 #include "lib/utils/format_exception.h"
 #include "lib/utils/reader_writer.h"
@@ -38,11 +39,12 @@ std::unique_ptr<Entry> Entry::Load(uint64_t entry_offset, ReaderWriter* reader,
                                          ByteOrder::Unpack(header->none.head_offset));
     case Entry::Type::kDirectory:
       CopyName(name_buf, header->directory.name);
-      return std::make_unique<DirectoryEntry>(entry_offset);
+      return std::make_unique<DirectoryEntry>(entry_offset, header->directory.common.flags);
     case Entry::Type::kFile:
       CopyName(name_buf, header->file.name);
-      return std::make_unique<FileEntry>(entry_offset,
-                                         ByteOrder::Unpack(header->file.size));
+      return std::make_unique<FileEntry>(
+          entry_offset, ByteOrder::Unpack(header->file.size),
+          (header->file.common.flags & EntryLayout::kFlagExtentTree) != 0);
     case Entry::Type::kSymlink:
       CopyName(name_buf, header->symlink.name);
       return std::make_unique<SymlinkEntry>(entry_offset);
@@ -51,6 +53,25 @@ std::unique_ptr<Entry> Entry::Load(uint64_t entry_offset, ReaderWriter* reader,
   throw FormatException();  // unknown entry type
 }
 
+uint64_t Entry::CountSections(ReaderWriter* reader, uint64_t* sections_size) {
+  Section section = Section::Load(section_offset(), reader);
+  uint64_t count = 1;
+  uint64_t size = section.size();
+  while (section.next_offset()) {
+    section = Section::Load(section.next_offset(), reader);
+    ++count;
+    size += section.size();
+  }
+
+  if (sections_size != nullptr)
+    *sections_size = size;
+  return count;
+}
+
+void Entry::Release(ReaderWriter* reader_writer, SectionAllocator* allocator) noexcept {
+  allocator->ReleaseSection(section_offset(), reader_writer);
+}
+
 Section Entry::CursorToSection(uint64_t& cursor, ReaderWriter* reader,
                                uint64_t start_position, bool check_cursor) {
   Section section = Section::Load(section_offset(), reader);
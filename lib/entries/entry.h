@@ -14,6 +14,7 @@ namespace fs {
 namespace linfs {
 
 class ReaderWriter;
+class SectionAllocator;
 
 class Entry {
  public:
@@ -40,6 +41,13 @@ class Entry {
     return base_offset() - sizeof(SectionLayout::Header);
   }
 
+  // Returns the number of sections in the entry's chain and optionally their
+  // total size in |sections_size|.
+  virtual uint64_t CountSections(ReaderWriter* reader, uint64_t* sections_size = nullptr);
+
+  // Releases all sections of the removed entry.
+  virtual void Release(ReaderWriter* reader_writer, SectionAllocator* allocator) noexcept;
+
   // Cast to derived class.
   template <typename T>
   T* As() {
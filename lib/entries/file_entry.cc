@@ -1,80 +1,962 @@
 #include "lib/entries/file_entry.h"
 
+#include <algorithm>
+#include <cassert>
+#include <iterator>
+#include <utility>
+#include <vector>
+
 #include "lib/layout/entry_layout.h"
+#include "lib/layout/extent_layout.h"
+#include "lib/layout/section_layout.h"
 #include "lib/sections/section_file.h"
+#include "lib/utils/byte_order.h"
+#include "lib/utils/crc32c.h"
 #include "lib/utils/format_exception.h"
 
+#ifndef NDEBUG
+#include <iostream>
+#endif
+
 namespace fs {
 
 namespace linfs {
 
+namespace {
+
+// Adds the range to |ranges| merging it with the last one if they adjoin.
+// Zero |offset| stands for a hole.
+void AddRange(std::vector<FileEntry::DeviceRange>* ranges, uint64_t offset, uint64_t size) {
+  if (size == 0)
+    return;
+  if (!ranges->empty() && (ranges->back().offset == 0) == (offset == 0) &&
+      (offset == 0 || ranges->back().offset + ranges->back().size == offset))
+    ranges->back().size += size;
+  else
+    ranges->push_back(FileEntry::DeviceRange{offset, size});
+}
+
+// Copies the data of |from| to |to|.  Both must be of the same total size.
+void CopyRanges(const std::vector<FileEntry::DeviceRange>& from,
+                const std::vector<FileEntry::DeviceRange>& to, ReaderWriter* reader_writer) {
+  // Copy the data by chunks of this size.
+  constexpr size_t kChunkSize = 1 << 20;
+
+  uint64_t size = 0;
+  for (const FileEntry::DeviceRange& range : from)
+    size += range.size;
+  std::vector<char> buf(std::min<uint64_t>(kChunkSize, size));
+
+  auto dst = to.begin();
+  uint64_t dst_cursor = 0;
+  for (const FileEntry::DeviceRange& src : from) {
+    for (uint64_t done = 0; done != src.size;) {
+      for (; dst_cursor == dst->size; dst_cursor = 0)
+        ++dst;
+      size_t chunk = std::min<uint64_t>({buf.size(), src.size - done, dst->size - dst_cursor});
+      reader_writer->Read(src.offset + done, buf.data(), chunk);
+      reader_writer->Write(buf.data(), chunk, dst->offset + dst_cursor);
+      done += chunk;
+      dst_cursor += chunk;
+    }
+  }
+}
+
+// Returns the checked range of the whole extent.
+FileEntry::CheckedRange WholeExtent(const ExtentTree::Extent& extent) {
+  return FileEntry::CheckedRange{extent.file_offset, extent.device_offset(), extent.length, {}};
+}
+
+// Writes the checksums of |size| bytes of |data|, which start chunk |first| of
+// |range|, to |checksums|.
+void ChunkChecksums(const FileEntry::CheckedRange& range, size_t first, const char* data,
+                    uint64_t size, uint32_t* checksums) {
+  // Only the first chunk may start in the middle.
+  uint64_t head = range.ChunkPosition(first + 1) - range.ChunkPosition(first);
+  if (head != ExtentLayout::kChecksumChunk && head < size) {
+    *checksums++ = Crc32c(0, data, head);
+    data += head;
+    size -= head;
+  }
+  Crc32cChunks(data, size, ExtentLayout::kChecksumChunk, checksums);
+}
+
+// Returns the checksums of the extent's chunks (see ExtentLayout::kChecksumChunk).
+std::vector<uint32_t> ExtentChecksums(const ExtentTree::Extent& extent, ReaderWriter* reader) {
+  // Read the data by this many chunks at once.
+  constexpr size_t kReadChunks = 256;
+
+  FileEntry::CheckedRange range = WholeExtent(extent);
+  std::vector<uint32_t> checksums(range.ChunkIndex(extent.end() - 1) + 1);
+  std::vector<char> buf(std::min<uint64_t>(kReadChunks * ExtentLayout::kChecksumChunk,
+                                           extent.length));
+  for (size_t first = 0; first < checksums.size(); first += kReadChunks) {
+    uint64_t begin = range.ChunkPosition(first);
+    uint64_t size = range.ChunkPosition(first + kReadChunks) - begin;
+    reader->Read(range.offset + begin - range.position, buf.data(), size);
+    ChunkChecksums(range, first, buf.data(), size, &checksums[first]);
+  }
+  return checksums;
+}
+
+// Returns |count| checksums of the extent's chunks starting with |first|.
+std::vector<uint32_t> LoadChecksums(const ExtentTree::Extent& extent, uint64_t first,
+                                    uint64_t count, ReaderWriter* reader) {
+  std::vector<uint32_t> checksums(count);
+  reader->Read(extent.checksums_offset + sizeof(SectionLayout::Header) + first * sizeof(uint32_t),
+               reinterpret_cast<char*>(checksums.data()), count * sizeof(uint32_t));
+  for (uint32_t& checksum : checksums)
+    checksum = ByteOrder::Unpack(checksum);
+  return checksums;
+}
+
+// Writes |checksums| to a new section and returns it.
+Section StoreChecksums(std::vector<uint32_t> checksums, ReaderWriter* reader_writer,
+                       SectionAllocator* allocator) {
+  uint64_t size = checksums.size() * sizeof(uint32_t);
+  Section section = allocator->AllocateContiguousSection(sizeof(SectionLayout::Header) + size,
+                                                         Entry::Type::kNone, reader_writer);
+  try {
+    for (uint32_t& checksum : checksums)
+      checksum = ByteOrder::Pack(checksum);
+    reader_writer->Write(reinterpret_cast<const char*>(checksums.data()), size,
+                         section.data_offset());
+  }
+  catch (...) {
+    allocator->ReleaseSection(section, reader_writer);
+    throw;
+  }
+  return section;
+}
+
+// Releases the extent's data, but not its checksums.
+void ReleaseExtent(const ExtentTree::Extent& extent, ReaderWriter* reader_writer,
+                   SectionAllocator* allocator) noexcept {
+  if (extent.shared)
+    allocator->ReleaseSharedSection(extent.section_offset, reader_writer);
+  else
+    allocator->ReleaseSection(extent.section_offset, reader_writer);
+}
+
+// Clones share the section of the checksums as well (see CloneData), so it's
+// released like a shared one even if the data isn't shared.
+void ReleaseChecksums(const ExtentTree::Extent& extent, ReaderWriter* reader_writer,
+                      SectionAllocator* allocator) noexcept {
+  if (extent.checksummed)
+    allocator->ReleaseSharedSection(extent.checksums_offset, reader_writer);
+}
+
+}  // namespace
+
 std::unique_ptr<FileEntry> FileEntry::Create(uint64_t entry_offset,
-                                             uint64_t /* entry_size */,
+                                             uint64_t entry_size,
                                              ReaderWriter* writer,
-                                             const char* name) {
-  writer->Write<EntryLayout::FileHeader>(EntryLayout::FileHeader(0, name), entry_offset);
-  return std::make_unique<FileEntry>(entry_offset, 0);
+                                             const char* name,
+                                             bool extent_tree) {
+  uint8_t flags = extent_tree ? EntryLayout::kFlagExtentTree : 0;
+  writer->Write<EntryLayout::FileHeader>(EntryLayout::FileHeader(0, name, flags), entry_offset);
+  if (extent_tree)
+    ExtentTree::Create(entry_offset + sizeof(EntryLayout::FileHeader),
+                       entry_size - sizeof(EntryLayout::FileHeader), writer);
+  return std::make_unique<FileEntry>(entry_offset, 0, extent_tree);
 }
 
-size_t FileEntry::Read(uint64_t cursor, char* buf, size_t buf_size, ReaderWriter* reader) {
-  size_t read = 0;
-  SectionFile sec_file = CursorToSection(cursor, reader, sizeof(EntryLayout::FileHeader));
-  while (1) {
-    size_t rc = sec_file.Read(cursor, buf, buf_size, reader);
-    read += rc;
-    buf += rc;
-    buf_size -= rc;
-    if (buf_size == 0)
-      break;
+uint64_t FileEntry::CountSections(ReaderWriter* reader, uint64_t* sections_size) {
+  if (!extent_tree_)
+    return Entry::CountSections(reader, sections_size);
 
-    if (!sec_file.next_offset())
-      throw FormatException();  // file size is smaller than expected
+  // The first section, the nodes and the extents.
+  ExtentTree tree = GetExtentTree(reader);
+  uint64_t size = 0;
+  uint64_t count = 1 + tree.CountNodes(reader, &size);
+  size += Section::Load(section_offset(), reader).size();
+  tree.ForEachExtent(reader, [&count, &size, reader](const ExtentTree::Extent& extent) {
+    ++count;
+    size += Section::Load(extent.section_offset, reader).size();
+    if (extent.checksummed) {
+      ++count;
+      size += Section::Load(extent.checksums_offset, reader).size();
+    }
+  });
 
-    sec_file = Section::Load(sec_file.next_offset(), reader);
-    cursor = 0;
-  }
+  if (sections_size != nullptr)
+    *sections_size = size;
+  return count;
+}
 
-  return read;
+void FileEntry::Release(ReaderWriter* reader_writer, SectionAllocator* allocator) noexcept {
+  if (extent_tree_) {
+    try {
+      ExtentTree tree = GetExtentTree(reader_writer);
+      tree.ForEachExtent(reader_writer, [reader_writer, allocator](const ExtentTree::Extent& extent) {
+        ReleaseExtent(extent, reader_writer, allocator);
+        ReleaseChecksums(extent, reader_writer, allocator);
+      });
+      tree.ReleaseNodes(reader_writer, allocator);
+    }
+    catch (...) {
+#ifndef NDEBUG
+      std::cerr << "Leaked some extents of the file at " << std::hex << base_offset()
+                << std::endl;
+#endif
+    }
+  }
+  Entry::Release(reader_writer, allocator);
 }
 
 size_t FileEntry::Write(uint64_t cursor, const char* buf, size_t buf_size,
                         ReaderWriter* reader_writer, SectionAllocator* allocator) {
-  size_t written = 0;
+  // The chain can't have holes.
+  if (!extent_tree_ && cursor > size())
+    Truncate(cursor, reader_writer, allocator);
+
+  // Allocate all the required space before writing, so appends produce as
+  // few sections as possible.
+  std::vector<DeviceRange> ranges;
+  MapRange(cursor, buf_size, reader_writer, allocator, &ranges);
+  for (const DeviceRange& range : ranges) {
+    reader_writer->Write(buf, range.size, range.offset);
+    buf += range.size;
+  }
+
+  GrowSize(cursor + buf_size);
+  return buf_size;
+}
+
+uint64_t FileEntry::ReserveAppend(uint64_t size, std::unique_lock<SharedMutex>& lock,
+                                  ReaderWriter* reader_writer, SectionAllocator* allocator,
+                                  std::vector<DeviceRange>* ranges) {
+  appends_cv_.wait(lock, [this] { return mappings_ == 0; });
+
+  // Usual writes could extend the file after the last reservation.
+  uint64_t offset = std::max<uint64_t>(this->size(), writes_end_);
+  if (!appends_.empty())
+    offset = std::max(offset, appends_.back().end);
+  if (size == 0)
+    return offset;
+
+  MapRange(offset, size, reader_writer, allocator, ranges);
+  appends_.push_back(Reservation{offset, offset + size, false});
+  return offset;
+}
+
+void FileEntry::PublishAppend(uint64_t offset, std::unique_lock<SharedMutex>& lock) {
+  auto it = std::find_if(appends_.begin(), appends_.end(),
+                         [offset](const Reservation& reservation) {
+                           return reservation.offset == offset;
+                         });
+  if (it == appends_.end())
+    return;  // Nothing has been reserved.
+  it->done = true;
+
+  // Publish all finished reservations which have no unfinished ones before.
+  uint64_t end = size();
+  while (!appends_.empty() && appends_.front().done) {
+    end = std::max(end, appends_.front().end);
+    appends_.pop_front();
+  }
+  GrowSize(end);
+  appends_cv_.notify_all();
+
+  appends_cv_.wait(lock, [this, offset] {
+    return appends_.empty() || appends_.front().offset > offset;
+  });
+}
+
+void FileEntry::WaitForAppends(std::unique_lock<SharedMutex>& lock) {
+  appends_cv_.wait(lock, [this] { return appends_.empty(); });
+}
+
+void FileEntry::ReserveWrite(uint64_t begin, uint64_t end, std::unique_lock<SharedMutex>& lock) {
+  appends_cv_.wait(lock, [this, begin, end] {
+    return std::none_of(appends_.begin(), appends_.end(),
+                        [begin, end](const Reservation& reservation) {
+                          return reservation.offset < end && begin < reservation.end;
+                        });
+  });
+  writes_end_ = std::max(writes_end_, end);
+  ++writes_;
+}
+
+void FileEntry::FinishWrite() {
+  // The finished writes are within the size, and the failed ones have
+  // nothing to keep.
+  if (--writes_ == 0)
+    writes_end_ = 0;
+}
+
+void FileEntry::Truncate(uint64_t size, ReaderWriter* reader_writer,
+                         SectionAllocator* allocator) {
+  // Fill the new space by chunks of this size.
+  constexpr size_t kChunkSize = 64 * 1024;
+
+  if (size >= this->size() && extent_tree_) {
+    if (size != this->size())
+      SetSize(size, reader_writer);
+    return;
+  }
+
+  if (size >= this->size()) {
+    std::vector<char> zeros(std::min<uint64_t>(kChunkSize, size - this->size()));
+    while (this->size() != size) {
+      Write(this->size(), zeros.data(), std::min<uint64_t>(zeros.size(), size - this->size()),
+            reader_writer, allocator);
+    }
+    return;
+  }
+
+  // Nobody writes after the new end (see FileImpl::Truncate), so appends
+  // may follow it at once.
+  writes_end_ = std::min(writes_end_, size);
+  if (extent_tree_)
+    return TruncateExtents(size, reader_writer, allocator);
+
+  // Find the section with the new end of the file.
+  uint64_t end = sizeof(EntryLayout::FileHeader) + size;
+  Section last = Section::Load(section_offset(), reader_writer);
+  uint64_t position = 0;
+  while (end - position > last.data_size()) {
+    if (!last.next_offset())
+      throw FormatException();  // file size is greater than its chain
+    position += last.data_size();
+    last = Section::Load(last.next_offset(), reader_writer);
+  }
+
+  // The file stays consistent if we fail after any step, but the tail may be
+  // leaked.
+  SetSize(size, reader_writer);
+  uint64_t tail_offset = last.next_offset();
+  if (tail_offset != 0)
+    last.SetNext(0, reader_writer);
+  {
+    // The chain has been cut.  Index it again on demand.
+    std::lock_guard<std::mutex> lock(extents_mutex_);
+    extents_.clear();
+  }
+  if (tail_offset != 0)
+    allocator->ReleaseSection(tail_offset, reader_writer);
+  allocator->ShrinkSection(last, sizeof(SectionLayout::Header) + end - position, type(),
+                           reader_writer);
+}
+
+uint64_t FileEntry::FindData(uint64_t offset, ReaderWriter* reader) {
+  if (offset >= size())
+    return size();
+  if (!extent_tree_)
+    return offset;
+
+  ExtentTree::Extent extent;
+  if (!GetExtentTree(reader).Find(offset, reader, &extent))
+    return size();
+  return std::min<uint64_t>(size(), std::max(offset, extent.file_offset));
+}
+
+uint64_t FileEntry::FindHole(uint64_t offset, ReaderWriter* reader) {
+  if (offset >= size() || !extent_tree_)
+    return size();
+
+  // Skip the adjacent extents.
+  ExtentTree tree = GetExtentTree(reader);
+  ExtentTree::Extent extent;
+  while (offset < size() && tree.Find(offset, reader, &extent) && extent.file_offset <= offset)
+    offset = extent.end();
+  return std::min<uint64_t>(size(), offset);
+}
+
+void FileEntry::CopyData(FileEntry* source, ReaderWriter* reader_writer,
+                         SectionAllocator* allocator) {
+  // Copy every run of data at once, so it takes as few sections as possible.
+  uint64_t size = source->size();
+  for (uint64_t offset = source->FindData(0, reader_writer); offset < size;) {
+    uint64_t end = source->FindHole(offset, reader_writer);
+    std::vector<DeviceRange> from, to;
+    source->MapData(offset, end - offset, reader_writer, &from);
+    MapRange(offset, end - offset, reader_writer, allocator, &to);
+    CopyRanges(from, to, reader_writer);
+    offset = source->FindData(end, reader_writer);
+  }
+  SetSize(size, reader_writer);
+}
+
+void FileEntry::CloneData(FileEntry* source, ReaderWriter* reader_writer,
+                          SectionAllocator* allocator) {
+  assert(extent_tree_ && source->extent_tree_);
+
+  ExtentTree source_tree = source->GetExtentTree(reader_writer);
+  std::vector<ExtentTree::Extent> extents;
+  source_tree.ForEachExtent(reader_writer, [&extents](const ExtentTree::Extent& extent) {
+    extents.push_back(extent);
+  });
+
+  // The references are taken first.  If something goes wrong after that, the
+  // sections are at worst never released.
+  size_t referenced = 0, checksums_referenced = 0;
+  try {
+    for (; referenced != extents.size(); ++referenced)
+      allocator->ShareSection(extents[referenced].section_offset, reader_writer);
+    for (; checksums_referenced != extents.size(); ++checksums_referenced) {
+      if (extents[checksums_referenced].checksummed)
+        allocator->ShareSection(extents[checksums_referenced].checksums_offset, reader_writer);
+    }
+    for (ExtentTree::Extent& extent : extents) {
+      if (!extent.shared) {
+        extent.shared = true;
+        source_tree.Update(extent, reader_writer);
+      }
+    }
+    GetExtentTree(reader_writer).Assign(extents, reader_writer, allocator);
+  }
+  catch (...) {
+    for (size_t i = 0; i != referenced; ++i)
+      allocator->ReleaseSharedSection(extents[i].section_offset, reader_writer);
+    for (size_t i = 0; i != checksums_referenced; ++i)
+      ReleaseChecksums(extents[i], reader_writer, allocator);
+    throw;
+  }
+  SetSize(source->size(), reader_writer);
+}
+
+void FileEntry::ShareExtent(const ExtentTree::Extent& extent, FileEntry* source,
+                            ExtentTree::Extent source_extent, ReaderWriter* reader_writer,
+                            SectionAllocator* allocator) {
+  assert(extent_tree_ && source->extent_tree_ && extent.length == source_extent.length);
+
+  // If something goes wrong, the source's extent may stay marked as shared
+  // with nobody, which UnshareExtent handles.
+  allocator->ShareSection(source_extent.section_offset, reader_writer);
+  try {
+    if (!source_extent.shared) {
+      source_extent.shared = true;
+      source->GetExtentTree(reader_writer).Update(source_extent, reader_writer);
+    }
+    ExtentTree::Extent shared_extent = extent;
+    shared_extent.section_offset = source_extent.section_offset;
+    shared_extent.data_offset = source_extent.data_offset;
+    shared_extent.shared = true;
+    GetExtentTree(reader_writer).Update(shared_extent, reader_writer);
+  }
+  catch (...) {
+    allocator->ReleaseSharedSection(source_extent.section_offset, reader_writer);
+    throw;
+  }
+  ReleaseExtent(extent, reader_writer, allocator);
+}
+
+bool FileEntry::Defragment(ReaderWriter* reader_writer, SectionAllocator* allocator,
+                           const std::function<bool(uint64_t)>& throttle) {
+  // Copy the data by chunks of this size.
+  constexpr size_t kChunkSize = 64 * 1024;
+
+  if (extent_tree_)
+    return DefragmentExtents(reader_writer, allocator, throttle);
+
+  SectionFile head = Section::Load(section_offset(), reader_writer);
+  if (!head.next_offset())
+    return true;  // Nothing to do.
+
+  uint64_t head_size = head.data_size() - sizeof(EntryLayout::FileHeader);
+  uint64_t rest_size = size() > head_size ? size() - head_size : 0;
+  uint64_t rest_offset = 0;
+  if (rest_size != 0) {
+    SectionFile rest = allocator->AllocateContiguousSection(
+        sizeof(SectionLayout::Header) + rest_size, type(), reader_writer);
+    try {
+      std::vector<char> buf(std::min<uint64_t>(kChunkSize, rest_size));
+      SectionFile src = Section::Load(head.next_offset(), reader_writer);
+      uint64_t src_cursor = 0;
+      for (uint64_t copied = 0; copied != rest_size;) {
+        if (src_cursor == src.data_size()) {
+          if (!src.next_offset())
+            throw FormatException();  // file size is greater than its chain
+          src = Section::Load(src.next_offset(), reader_writer);
+          src_cursor = 0;
+        }
+
+        size_t chunk = std::min<uint64_t>(buf.size(), rest_size - copied);
+        chunk = src.Read(src_cursor, buf.data(), chunk, reader_writer);
+        rest.Write(copied, buf.data(), chunk, reader_writer);
+        src_cursor += chunk;
+        copied += chunk;
+
+        if (!throttle(chunk)) {
+          allocator->ReleaseSection(rest, reader_writer);
+          return false;
+        }
+      }
+    }
+    catch (...) {
+      allocator->ReleaseSection(rest, reader_writer);
+      throw;
+    }
+    rest_offset = rest.base_offset();
+  }
+
+  // Swap the chains.  It's a single write, so the file is consistent even if
+  // something goes wrong.
+  uint64_t old_rest_offset = head.next_offset();
+  try {
+    head.SetNext(rest_offset, reader_writer);
+  }
+  catch (...) {
+    if (rest_offset != 0)
+      allocator->ReleaseSection(rest_offset, reader_writer);
+    throw;
+  }
+  {
+    // The chain has been changed entirely.  Index it again on demand.
+    std::lock_guard<std::mutex> lock(extents_mutex_);
+    extents_.clear();
+  }
+  allocator->ReleaseSection(old_rest_offset, reader_writer);
+  return true;
+}
+
+uint64_t FileEntry::MapRange(uint64_t cursor, uint64_t size, ReaderWriter* reader_writer,
+                             SectionAllocator* allocator, std::vector<DeviceRange>* ranges) {
+  if (extent_tree_)
+    return MapExtents(cursor, size, reader_writer, allocator, ranges);
+  return MapChain(cursor, size, reader_writer, allocator, ranges);
+}
+
+void FileEntry::MapData(uint64_t cursor, uint64_t size, ReaderWriter* reader,
+                        std::vector<DeviceRange>* ranges, std::vector<CheckedRange>* checked) {
+  if (!extent_tree_) {
+    MapChain(cursor, size, reader, nullptr, ranges);
+    return;
+  }
+
+  ExtentTree tree = GetExtentTree(reader);
+  while (size != 0) {
+    ExtentTree::Extent extent;
+    bool found = tree.Find(cursor, reader, &extent);
+    uint64_t mapped;
+    if (found && extent.file_offset <= cursor) {
+      mapped = std::min(size, extent.end() - cursor);
+      AddRange(ranges, extent.device_offset() + cursor - extent.file_offset, mapped);
+      if (checked != nullptr && extent.checksummed) {
+        // Only the chunks with the mapped data.
+        CheckedRange range = WholeExtent(extent);
+        size_t first = range.ChunkIndex(cursor);
+        size_t last = range.ChunkIndex(cursor + mapped - 1);
+        uint64_t begin = range.ChunkPosition(first);
+        uint64_t end = range.ChunkPosition(last + 1);
+        checked->push_back(CheckedRange{begin, range.offset + begin - range.position, end - begin,
+                                        LoadChecksums(extent, first, last + 1 - first, reader)});
+      }
+    }
+    else {
+      mapped = found ? std::min(size, extent.file_offset - cursor) : size;
+      AddRange(ranges, 0, mapped);
+    }
+    size -= mapped;
+    cursor += mapped;
+  }
+}
+
+uint64_t FileEntry::ReadChecked(const CheckedRange& range, size_t first, size_t count,
+                                ReaderWriter* reader, char* data) {
+  count = std::min(count, range.checksums.size() - first);
+  uint64_t begin = range.ChunkPosition(first);
+  uint64_t size = range.ChunkPosition(first + count) - begin;
+  reader->Read(range.offset + begin - range.position, data, size);
+  std::vector<uint32_t> checksums(count);
+  ChunkChecksums(range, first, data, size, checksums.data());
+  if (!std::equal(checksums.begin(), checksums.end(), range.checksums.begin() + first))
+    throw FormatException();  // the data is corrupted
+  return size;
+}
+
+uint64_t FileEntry::MapChain(uint64_t cursor, uint64_t size, ReaderWriter* reader_writer,
+                             SectionAllocator* allocator, std::vector<DeviceRange>* ranges) {
   uint64_t old_cursor = cursor;
-  SectionFile sec_file = CursorToSection(cursor, reader_writer, sizeof(EntryLayout::FileHeader));
+  uint64_t old_size = size;
+  Section section = CursorToSection(cursor, reader_writer);
+  uint64_t position = sizeof(EntryLayout::FileHeader) + old_cursor - cursor;
   while (1) {
-    size_t rc = sec_file.Write(cursor, buf, buf_size, reader_writer);
-    written += rc;
-    buf += rc;
-    buf_size -= rc;
-    if (buf_size == 0)
+    uint64_t mapped = std::min(size, section.data_size() - cursor);
+    AddRange(ranges, section.data_offset() + cursor, mapped);
+    size -= mapped;
+    if (size == 0)
       break;
 
-    if (!sec_file.next_offset()) {
-      SectionFile next_sec_file = allocator->AllocateSection(buf_size, reader_writer);
+    if (!section.next_offset()) {
+      if (allocator == nullptr)
+        break;
+
+      // Grow the last section in place when possible.  Thus appends produce
+      // one contiguous section instead of a chain of small ones.
+      if (allocator->ExtendSection(section, size, type(), reader_writer)) {
+        UpdateExtent(position, section);
+        cursor += mapped;
+        continue;
+      }
+
+      Section next_section = allocator->AllocateSection(size, type(), reader_writer);
       try {
-        sec_file.SetNext(next_sec_file.base_offset(), reader_writer);
+        section.SetNext(next_section.base_offset(), reader_writer);
       }
       catch (...) {
-        allocator->ReleaseSection(next_sec_file, reader_writer);
+        allocator->ReleaseSection(next_section, reader_writer);
         throw;
       }
-      sec_file = next_sec_file;
+      UpdateExtent(position, section);
+      position += section.data_size();
+      section = next_section;
+    }
+    else {
+      position += section.data_size();
+      section = Section::Load(section.next_offset(), reader_writer);
     }
-    else
-      sec_file = Section::Load(sec_file.next_offset(), reader_writer);
     cursor = 0;
   }
 
-  if (old_cursor + written > size())
-    SetSize(old_cursor + written, reader_writer);
+  return old_size - size;
+}
+
+uint64_t FileEntry::MapExtents(uint64_t cursor, uint64_t size, ReaderWriter* reader_writer,
+                               SectionAllocator* allocator, std::vector<DeviceRange>* ranges) {
+  ExtentTree tree = GetExtentTree(reader_writer);
+  uint64_t old_size = size;
+  while (size != 0) {
+    ExtentTree::Extent extent;
+    bool found = tree.Find(cursor, reader_writer, &extent);
+    uint64_t mapped;
+    if (found && extent.file_offset <= cursor) {
+      // The space is already allocated, but may be shared, and the data is
+      // about to change, so its checksum becomes invalid.
+      if (extent.shared || extent.checksummed) {
+        if (allocator == nullptr)
+          break;
+        ExtentTree::Extent old_extent = extent;
+        extent.checksummed = false;
+        if (extent.shared)
+          UnshareExtent(tree, extent, cursor, size, reader_writer, allocator);
+        else
+          tree.Update(extent, reader_writer);
+        ReleaseChecksums(old_extent, reader_writer, allocator);
+      }
+      mapped = std::min(size, extent.end() - cursor);
+      AddRange(ranges, extent.device_offset() + cursor - extent.file_offset, mapped);
+    }
+    else {
+      if (allocator == nullptr)
+        break;
+      uint64_t can_map = found ? std::min(size, extent.file_offset - cursor) : size;
+      mapped = FillHole(tree, cursor, can_map, reader_writer, allocator, ranges);
+    }
+    size -= mapped;
+    cursor += mapped;
+  }
+
+  return old_size - size;
+}
+
+uint64_t FileEntry::FillHole(ExtentTree& tree, uint64_t cursor, uint64_t size,
+                             ReaderWriter* reader_writer, SectionAllocator* allocator,
+                             std::vector<DeviceRange>* ranges) {
+  // Take the space after the extent right before the hole if its section has
+  // free space or can grow in place.  Shared sections are left as they are:
+  // the other files could take the same space.
+  ExtentTree::Extent prev;
+  if (cursor != 0 && tree.Find(cursor - 1, reader_writer, &prev) && prev.end() == cursor &&
+      !prev.shared) {
+    Section section = Section::Load(prev.section_offset, reader_writer);
+    uint64_t used = prev.data_offset + prev.length;
+    if (section.data_size() > used ||
+        allocator->ExtendSection(section, size, type(), reader_writer)) {
+      uint64_t mapped = std::min(size, section.data_size() - used);
+      AddRange(ranges, section.data_offset() + used, mapped);
+      ExtentTree::Extent old_prev = prev;
+      prev.length += mapped;
+      prev.checksummed = false;
+      tree.Update(prev, reader_writer);
+      ReleaseChecksums(old_prev, reader_writer, allocator);
+      return mapped;
+    }
+  }
+
+  // Otherwise allocate space for the rest of the hole at once.
+  Section section = allocator->AllocateSection(size, type(), reader_writer);
+  try {
+    uint64_t mapped = std::min(size, section.data_size());
+    tree.Insert(ExtentTree::Extent{cursor, section.base_offset(), mapped}, reader_writer,
+                allocator);
+    AddRange(ranges, section.data_offset(), mapped);
+    return mapped;
+  }
+  catch (...) {
+    allocator->ReleaseSection(section, reader_writer);
+    throw;
+  }
+}
+
+void FileEntry::UnshareExtent(ExtentTree& tree, ExtentTree::Extent& extent, uint64_t cursor,
+                              uint64_t size, ReaderWriter* reader_writer,
+                              SectionAllocator* allocator) {
+  // Nobody else can take a new reference to the section while we hold the
+  // last one, so the check is reliable.
+  if (!allocator->SectionIsShared(extent.section_offset, reader_writer)) {
+    extent.shared = false;
+    tree.Update(extent, reader_writer);
+    return;
+  }
+
+  // Copy only the data about to change, as much of it as the new section
+  // takes.  The rest of the extent keeps referring to the shared section.
+  Section copy = allocator->AllocateSection(std::min(size, extent.end() - cursor), type(),
+                                            reader_writer);
+  ExtentTree::Extent middle{cursor, copy.base_offset(),
+                            std::min({size, extent.end() - cursor, copy.data_size()})};
+  ExtentTree::Extent left = extent;
+  left.length = cursor - extent.file_offset;
+  ExtentTree::Extent right = extent;
+  right.file_offset = middle.end();
+  right.data_offset += right.file_offset - extent.file_offset;
+  right.length = extent.end() - right.file_offset;
 
-  return written;
+  // Each step leaves every offset of the file in extents with the same data,
+  // so at worst some extents overlap if something goes wrong.
+  bool right_inserted = false, middle_inserted = false;
+  try {
+    CopyRanges({DeviceRange{extent.device_offset() + left.length, middle.length}},
+               {DeviceRange{copy.data_offset(), middle.length}}, reader_writer);
+    if (right.length != 0) {
+      allocator->ShareSection(extent.section_offset, reader_writer);
+      try {
+        tree.Insert(right, reader_writer, allocator);
+      }
+      catch (...) {
+        allocator->ReleaseSharedSection(extent.section_offset, reader_writer);
+        throw;
+      }
+      right_inserted = true;
+    }
+
+    if (left.length == 0) {
+      tree.Update(middle, reader_writer);
+      middle_inserted = true;
+    }
+    else {
+      // Keep the extents ordered by their ends, as lookups expect.
+      ExtentTree::Extent covering = extent;
+      covering.length = right.file_offset - extent.file_offset;
+      if (right_inserted)
+        tree.Update(covering, reader_writer);
+      tree.Insert(middle, reader_writer, allocator);
+      middle_inserted = true;
+      tree.Update(left, reader_writer);
+    }
+  }
+  catch (...) {
+    if (!middle_inserted)
+      allocator->ReleaseSection(copy, reader_writer);
+    throw;
+  }
+
+  // The left part takes over the extent's reference.
+  if (left.length == 0)
+    allocator->ReleaseSharedSection(extent.section_offset, reader_writer);
+  extent = middle;
+}
+
+void FileEntry::TruncateExtents(uint64_t size, ReaderWriter* reader_writer,
+                                SectionAllocator* allocator) {
+  ExtentTree tree = GetExtentTree(reader_writer);
+  std::vector<ExtentTree::Extent> extents, released_shared, released_checksums;
+  std::vector<Section> released;
+  tree.ForEachExtent(reader_writer, [&](const ExtentTree::Extent& extent) {
+    if (extent.file_offset < size)
+      extents.push_back(extent);
+    else if (extent.shared)
+      released_shared.push_back(extent);
+    else
+      released.push_back(Section::Load(extent.section_offset, reader_writer));
+    if (extent.file_offset >= size)
+      released_checksums.push_back(extent);
+  });
+  bool cut = !extents.empty() && extents.back().end() > size;
+  if (cut) {
+    released_checksums.push_back(extents.back());
+    extents.back().length = size - extents.back().file_offset;
+    extents.back().checksummed = false;
+  }
+
+  SetSize(size, reader_writer);
+  if (cut && released.empty() && released_shared.empty()) {
+    tree.Update(extents.back(), reader_writer);
+  }
+  else {
+    // The root is written at once, so the file is consistent even if
+    // something goes wrong.
+    tree.Assign(extents, reader_writer, allocator);
+  }
+  allocator->ReleaseSections(released, reader_writer);
+  for (const ExtentTree::Extent& extent : released_shared)
+    allocator->ReleaseSharedSection(extent.section_offset, reader_writer);
+  for (const ExtentTree::Extent& extent : released_checksums)
+    ReleaseChecksums(extent, reader_writer, allocator);
+  if (cut && !extents.back().shared) {
+    Section last = Section::Load(extents.back().section_offset, reader_writer);
+    allocator->ShrinkSection(
+        last, sizeof(SectionLayout::Header) + extents.back().data_offset + extents.back().length,
+        type(), reader_writer);
+  }
+}
+
+bool FileEntry::DefragmentExtents(ReaderWriter* reader_writer, SectionAllocator* allocator,
+                                  const std::function<bool(uint64_t)>& throttle) {
+  constexpr size_t kChunkSize = 64 * 1024;
+
+  ExtentTree tree = GetExtentTree(reader_writer);
+  std::vector<ExtentTree::Extent> extents;
+  tree.ForEachExtent(reader_writer, [&extents](const ExtentTree::Extent& extent) {
+    extents.push_back(extent);
+  });
+  if (extents.size() <= 1)
+    return true;  // Nothing to do.
+
+  // A section can't have holes, so sparse files are left as they are.  So
+  // are clones, which would lose their shared space.
+  uint64_t data_size = 0;
+  for (const ExtentTree::Extent& extent : extents) {
+    if (extent.shared)
+      return true;
+    data_size += extent.length;
+  }
+  if (data_size != size())
+    return true;
+
+  SectionFile data = allocator->AllocateContiguousSection(
+      sizeof(SectionLayout::Header) + size(), type(), reader_writer);
+  try {
+    std::vector<char> buf(std::min<uint64_t>(kChunkSize, size()));
+    for (const ExtentTree::Extent& extent : extents) {
+      for (uint64_t copied = 0; copied != extent.length;) {
+        size_t chunk = std::min<uint64_t>(buf.size(), extent.length - copied);
+        reader_writer->Read(extent.device_offset() + copied, buf.data(), chunk);
+        data.Write(extent.file_offset + copied, buf.data(), chunk, reader_writer);
+        copied += chunk;
+
+        if (!throttle(chunk)) {
+          allocator->ReleaseSection(data, reader_writer);
+          return false;
+        }
+      }
+    }
+
+    // The root is written at once, so the file is consistent even if
+    // something goes wrong.
+    tree.Assign({ExtentTree::Extent{0, data.base_offset(), size()}}, reader_writer, allocator);
+  }
+  catch (...) {
+    allocator->ReleaseSection(data, reader_writer);
+    throw;
+  }
+
+  for (const ExtentTree::Extent& extent : extents) {
+    allocator->ReleaseSection(extent.section_offset, reader_writer);
+    ReleaseChecksums(extent, reader_writer, allocator);
+  }
+  return true;
+}
+
+uint64_t FileEntry::Scrub(ReaderWriter* reader_writer, SectionAllocator* allocator) {
+  if (!extent_tree_)
+    return 0;
+
+  ExtentTree tree = GetExtentTree(reader_writer);
+  std::vector<ExtentTree::Extent> extents;
+  tree.ForEachExtent(reader_writer, [&extents](const ExtentTree::Extent& extent) {
+    extents.push_back(extent);
+  });
+
+  uint64_t corrupted = 0;
+  for (ExtentTree::Extent& extent : extents) {
+    std::vector<uint32_t> checksums = ExtentChecksums(extent, reader_writer);
+    if (extent.checksummed) {
+      if (checksums != LoadChecksums(extent, 0, checksums.size(), reader_writer))
+        ++corrupted;
+      continue;
+    }
+    Section section = StoreChecksums(std::move(checksums), reader_writer, allocator);
+    extent.checksummed = true;
+    extent.checksums_offset = section.base_offset();
+    try {
+      tree.Update(extent, reader_writer);
+    }
+    catch (...) {
+      allocator->ReleaseSection(section, reader_writer);
+      throw;
+    }
+  }
+  return corrupted;
+}
+
+ExtentTree FileEntry::GetExtentTree(ReaderWriter* reader) {
+  // The first section of such files never changes, so load its size only once.
+  uint64_t root_size = extent_tree_root_size_;
+  if (root_size == 0) {
+    root_size = Section::Load(section_offset(), reader).data_size() -
+                sizeof(EntryLayout::FileHeader);
+    extent_tree_root_size_ = root_size;
+  }
+  return ExtentTree(base_offset() + sizeof(EntryLayout::FileHeader), root_size);
+}
+
+Section FileEntry::CursorToSection(uint64_t& cursor, ReaderWriter* reader) {
+  uint64_t position = sizeof(EntryLayout::FileHeader) + cursor;
+
+  std::lock_guard<std::mutex> lock(extents_mutex_);
+
+  if (extents_.empty())
+    extents_.emplace(0, Section::Load(section_offset(), reader));
+
+  // The last indexed section which starts before |position|.
+  auto it = std::prev(extents_.upper_bound(position));
+  while (position - it->first >= it->second.data_size() && it->second.next_offset()) {
+    // |it| is the last indexed section, otherwise upper_bound would have found
+    // the following one.  Index the next section.
+    uint64_t next_position = it->first + it->second.data_size();
+    it = extents_.emplace_hint(extents_.end(), next_position,
+                               Section::Load(it->second.next_offset(), reader));
+  }
+
+  cursor = position - it->first;
+  if (cursor > it->second.data_size())
+    throw FormatException();  // cursor is greater than file's size
+
+  return it->second;
+}
+
+void FileEntry::UpdateExtent(uint64_t position, const Section& section) {
+  std::lock_guard<std::mutex> lock(extents_mutex_);
+
+  // Not indexed sections will be loaded from the device later.
+  auto it = extents_.find(position);
+  if (it != extents_.end())
+    it->second = section;
+}
+
+void FileEntry::PersistSize(ReaderWriter* writer) {
+  std::lock_guard<std::mutex> lock(size_mutex_);
+  // Clear the flag before reading the size, so a concurrent ExtendSize is
+  // never lost.
+  if (!size_dirty_.exchange(false))
+    return;
+  try {
+    writer->Write<uint64_t>(size_, base_offset() + offsetof(EntryLayout::FileHeader, size));
+  }
+  catch (...) {
+    size_dirty_ = true;
+    throw;
+  }
 }
 
 void FileEntry::SetSize(uint64_t size, ReaderWriter* writer) {
+  std::lock_guard<std::mutex> lock(size_mutex_);
   writer->Write<uint64_t>(size, base_offset() + offsetof(EntryLayout::FileHeader, size));
   size_ = size;
+  size_dirty_ = false;
 }
 
 }  // namespace linfs
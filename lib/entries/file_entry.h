@@ -1,12 +1,23 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <vector>
 
 #include "lib/entries/entry.h"
+#include "lib/extent_tree.h"
+#include "lib/layout/extent_layout.h"
 #include "lib/section_allocator.h"
+#include "lib/sections/section.h"
+#include "lib/utils/range_lock.h"
 #include "lib/utils/reader_writer.h"
 
 namespace fs {
@@ -15,25 +26,251 @@ namespace linfs {
 
 class FileEntry : public Entry {
  public:
+  // A piece of the file data on the device.
+  struct DeviceRange {
+    uint64_t offset;
+    uint64_t size;
+  };
+  // A piece of checksummed data on the device (see Scrub).  It starts at a
+  // chunk boundary (see ExtentLayout::kChecksumChunk) or at the start of its
+  // extent and has the checksum of every chunk.
+  struct CheckedRange {
+    uint64_t position;  // in the file
+    uint64_t offset;    // on the device
+    uint64_t size;
+    std::vector<uint32_t> checksums;
+
+    // Index of the chunk with |file_position|.
+    size_t ChunkIndex(uint64_t file_position) const {
+      return file_position / ExtentLayout::kChecksumChunk -
+             position / ExtentLayout::kChecksumChunk;
+    }
+    // Position of the first byte of chunk |index| in the file, or the end of
+    // the range if there is no such chunk.
+    uint64_t ChunkPosition(size_t index) const {
+      uint64_t chunk_position = (position / ExtentLayout::kChecksumChunk + index) *
+                                ExtentLayout::kChecksumChunk;
+      return std::min(position + size, std::max(position, chunk_position));
+    }
+  };
+
   static std::unique_ptr<FileEntry> Create(uint64_t entry_offset,
                                            uint64_t entry_size,
                                            ReaderWriter* writer,
-                                           const char* name);
+                                           const char* name,
+                                           bool extent_tree = false);
 
-  FileEntry(uint64_t base_offset, uint64_t size)
-      : Entry(Type::kFile, base_offset), size_(size) {}
+  FileEntry(uint64_t base_offset, uint64_t size, bool extent_tree = false)
+      : Entry(Type::kFile, base_offset), size_(size), extent_tree_(extent_tree) {}
   ~FileEntry() override = default;
 
   uint64_t size() const { return size_; }
+  // Whether the data is indexed by the extent tree instead of the chain.
+  bool extent_tree() const { return extent_tree_; }
+
+  uint64_t CountSections(ReaderWriter* reader, uint64_t* sections_size = nullptr) override;
+  void Release(ReaderWriter* reader_writer, SectionAllocator* allocator) noexcept override;
 
-  size_t Read(uint64_t cursor, char* buf, size_t buf_size, ReaderWriter* reader);
+  // Writing after the end of the file leaves a hole (see Truncate).
   size_t Write(uint64_t cursor, const char* buf, size_t buf_size,
                ReaderWriter* reader_writer, SectionAllocator* allocator);
 
+  // Allocates the missing space for |size| bytes at |cursor| and adds the
+  // ranges of the device they take to |ranges|.  The file size isn't changed.
+  // If |allocator| is null, only the space which has been allocated before is
+  // mapped, and the shared lock is enough.  Returns the number of mapped bytes.
+  // Files without the extent tree must have |cursor| within them.
+  uint64_t MapRange(uint64_t cursor, uint64_t size, ReaderWriter* reader_writer,
+                    SectionAllocator* allocator, std::vector<DeviceRange>* ranges);
+  // Maps |size| bytes of the data at |cursor| to |ranges|.  Holes are mapped
+  // to ranges with zero |offset|.  The shared lock is enough.  If |checked|
+  // isn't null, the chunks of the mapped data which have checksums are added
+  // to it in order of the file, so the caller can check what it reads (see
+  // ReadChecked).
+  void MapData(uint64_t cursor, uint64_t size, ReaderWriter* reader,
+               std::vector<DeviceRange>* ranges, std::vector<CheckedRange>* checked = nullptr);
+  // Reads |count| chunks of |range| starting with |first| (or as many as
+  // there are) to |data| and returns their size.  Throws FormatException if
+  // any of them doesn't match its checksum.
+  static uint64_t ReadChecked(const CheckedRange& range, size_t first, size_t count,
+                              ReaderWriter* reader, char* data);
+  // Sets the size if it's greater than the current one.  The space up to
+  // |size| must be mapped and written.  The new size is kept in memory until
+  // PersistSize, so appends don't write the header every time.
+  void GrowSize(uint64_t size) {
+    if (size > this->size())
+      ExtendSize(size);
+  }
+  // Writes the size to the header if it has grown since the last time.  The
+  // file's lock isn't required.  Until then the device keeps the old size,
+  // which never covers the data that hasn't been written yet, so the file is
+  // consistent, only the tail of the data is lost after a crash.
+  void PersistSize(ReaderWriter* writer);
+
+  // Changes whenever the file's data or size does, so handles can tell
+  // whether the data they have read ahead is still valid.  Writers bump it
+  // before unlocking the range (or the file).
+  uint64_t generation() const { return generation_; }
+  void BumpGeneration() { ++generation_; }
+
+  // Writers of different parts of the file lock only their ranges of bytes
+  // and hold Lock() only to allocate space and update the size.
+  RangeLock::Guard LockRange(uint64_t begin, uint64_t end) {
+    return range_lock_.Lock(begin, end);
+  }
+  RangeLock::Guard LockRangeShared(uint64_t begin, uint64_t end) {
+    return range_lock_.LockShared(begin, end);
+  }
+
+  // Appending without the exclusive lock held during the I/O.  ReserveAppend
+  // maps |size| bytes after the end of the file, the writes after it and all
+  // previous reservations to |ranges|.  The caller writes the data there without any
+  // lock and passes the returned offset to PublishAppend, which extends the
+  // file size once all previous reservations are published, and waits for
+  // that.  Both require the exclusive lock, which |lock| must hold.
+  // ReserveAppend waits while the file is mapped.
+  uint64_t ReserveAppend(uint64_t size, std::unique_lock<SharedMutex>& lock,
+                         ReaderWriter* reader_writer, SectionAllocator* allocator,
+                         std::vector<DeviceRange>* ranges);
+  void PublishAppend(uint64_t offset, std::unique_lock<SharedMutex>& lock);
+  // Waits until all reservations are published.  Call it before releasing
+  // the file's space.
+  void WaitForAppends(std::unique_lock<SharedMutex>& lock);
+  // Usual writes of [begin, end) must keep off the reserved space.
+  // ReserveWrite waits until no reservation overlaps the range, and keeps the
+  // following ones after |end| until FinishWrite, which must follow it whether
+  // the write has succeeded or not.  Both require the exclusive lock.
+  // appending() requires the shared one at least.
+  void ReserveWrite(uint64_t begin, uint64_t end, std::unique_lock<SharedMutex>& lock);
+  void FinishWrite();
+  bool appending() const { return !appends_.empty(); }
+
+  // Mappings of the whole file (see MappedFileImpl) fix its size.  Appends
+  // wait for them, other writers wait for their range lock.  Adding and
+  // removing require the exclusive lock.  mapped() requires no lock, readers
+  // check it to skip their read buffers, which stores through the mapping
+  // don't invalidate.
+  bool mapped() const { return mappings_ != 0; }
+  void AddMapping() { ++mappings_; }
+  void RemoveMapping() {
+    if (--mappings_ == 0)
+      appends_cv_.notify_all();
+  }
+
+  // Return the offset of the first byte of data (or hole) at or after
+  // |offset|, or the file size if there is no such one.  Files without the
+  // extent tree have no holes.
+  uint64_t FindData(uint64_t offset, ReaderWriter* reader);
+  uint64_t FindHole(uint64_t offset, ReaderWriter* reader);
+
+  // Changes the file size.  The released sections are given back to
+  // |allocator| at once.  The new space is a hole if the file has the extent
+  // tree, otherwise it's filled with zeros.
+  void Truncate(uint64_t size, ReaderWriter* reader_writer, SectionAllocator* allocator);
+
+  // Fill this new file with the data of |source|, which must be locked.
+  // CopyData copies the data and keeps the holes.  CloneData shares the data
+  // sections (see ExtentLayout::kFlagShared), so both files must have the
+  // extent tree and |source| must be locked exclusively.
+  void CopyData(FileEntry* source, ReaderWriter* reader_writer, SectionAllocator* allocator);
+  void CloneData(FileEntry* source, ReaderWriter* reader_writer, SectionAllocator* allocator);
+
+  // Deduplication (see Deduplicator).  The file must have the extent tree.
+  // ShareExtent makes |extent| refer to the section of |source_extent| of
+  // |source|, which has the same data, and releases its own section.  Both
+  // files must be locked exclusively.
+  void ForEachExtent(ReaderWriter* reader,
+                     const std::function<void(const ExtentTree::Extent&)>& visitor) {
+    GetExtentTree(reader).ForEachExtent(reader, visitor);
+  }
+  bool FindExtent(uint64_t file_offset, ReaderWriter* reader, ExtentTree::Extent* extent) {
+    return GetExtentTree(reader).Find(file_offset, reader, extent) &&
+           extent->file_offset == file_offset;
+  }
+  void ShareExtent(const ExtentTree::Extent& extent, FileEntry* source,
+                   ExtentTree::Extent source_extent, ReaderWriter* reader_writer,
+                   SectionAllocator* allocator);
+
+  // Checks the checksums of all extents and adds them to the extents which
+  // have none (see ExtentLayout::kFlagChecksum).  Returns the number of
+  // extents with corrupted chunks.  Requires the exclusive lock.  Files
+  // without the extent tree have no checksums.
+  uint64_t Scrub(ReaderWriter* reader_writer, SectionAllocator* allocator);
+
+  // Moves the data which doesn't fit in the first section to one contiguous
+  // section, so the chain is at most two sections long (or the tree has only
+  // one extent).  |throttle| is called
+  // after every copied chunk and may abort the operation by returning false.
+  // It may unlock the file meanwhile, but then it must abort if the file has
+  // changed.  Returns false if the operation has been aborted.
+  bool Defragment(ReaderWriter* reader_writer, SectionAllocator* allocator,
+                  const std::function<bool(uint64_t)>& throttle);
+
  private:
+  uint64_t MapChain(uint64_t cursor, uint64_t size, ReaderWriter* reader_writer,
+                    SectionAllocator* allocator, std::vector<DeviceRange>* ranges);
+
+  // Implementations for files with the extent tree.
+  uint64_t MapExtents(uint64_t cursor, uint64_t size, ReaderWriter* reader_writer,
+                      SectionAllocator* allocator, std::vector<DeviceRange>* ranges);
+  // Maps the hole (or the space after the end of the file) at |cursor|.
+  // Returns the number of mapped bytes.
+  uint64_t FillHole(ExtentTree& tree, uint64_t cursor, uint64_t size,
+                    ReaderWriter* reader_writer, SectionAllocator* allocator,
+                    std::vector<DeviceRange>* ranges);
+  // Moves the data of |extent| in [cursor, cursor + size) to a section of its
+  // own if its section is still shared with other files, splitting the rest
+  // of |extent| around it, and clears its flag.  Then |extent| is the extent
+  // which contains |cursor|.
+  void UnshareExtent(ExtentTree& tree, ExtentTree::Extent& extent, uint64_t cursor,
+                     uint64_t size, ReaderWriter* reader_writer, SectionAllocator* allocator);
+  void TruncateExtents(uint64_t size, ReaderWriter* reader_writer, SectionAllocator* allocator);
+  bool DefragmentExtents(ReaderWriter* reader_writer, SectionAllocator* allocator,
+                         const std::function<bool(uint64_t)>& throttle);
+  ExtentTree GetExtentTree(ReaderWriter* reader);
+
+  // Unlike Entry::CursorToSection, looks for the section in |extents_| and
+  // loads only the sections which haven't been indexed yet.
+  Section CursorToSection(uint64_t& cursor, ReaderWriter* reader);
+  // Keeps |extents_| in sync with the changed |section| which starts at
+  // |position| of the chain.
+  void UpdateExtent(uint64_t position, const Section& section);
+
+  // SetSize writes the size at once (shrinking must reach the device before
+  // the space is released), ExtendSize leaves it to PersistSize.
   void SetSize(uint64_t size, ReaderWriter* writer);
+  void ExtendSize(uint64_t size) {
+    size_ = size;
+    size_dirty_ = true;
+  }
 
   std::atomic<uint64_t> size_;
+  std::atomic<bool> size_dirty_{false};
+  std::mutex size_mutex_;  // orders the writes of the size to the header
+  std::atomic<uint64_t> generation_{0};
+  const bool extent_tree_;
+  std::atomic<uint64_t> extent_tree_root_size_{0};  // loaded on demand
+
+  // The extent index maps positions in the chain (the file header included)
+  // to sections.  It contains the chain's beginning and grows on demand.
+  // Readers hold only the shared lock, so it has its own mutex.
+  std::map<uint64_t, Section> extents_;
+  std::mutex extents_mutex_;
+
+  // Append reservations which haven't been published yet, in order of their
+  // offsets.  They are guarded by the exclusive lock.
+  struct Reservation {
+    uint64_t offset;
+    uint64_t end;
+    bool done;
+  };
+  std::deque<Reservation> appends_;
+  std::condition_variable_any appends_cv_;
+  uint64_t writes_end_ = 0;  // of the writes after the end of the file, guarded as well
+  uint64_t writes_ = 0;      // reserved and not finished, guarded as well
+  std::atomic<uint64_t> mappings_{0};  // changed under the exclusive lock as well
+
+  RangeLock range_lock_;
 };
 
 }  // namespace linfs
@@ -1,8 +1,11 @@
 #include "lib/entries/none_entry.h"
 
+#include <algorithm>
 #include <cassert>
 
 #include "lib/layout/entry_layout.h"
+#include "lib/layout/section_layout.h"
+#include "lib/utils/format_exception.h"
 
 #ifndef NDEBUG
 #include <iostream>
@@ -24,13 +27,26 @@ Section NoneEntry::GetSection(uint64_t max_size, ReaderWriter* reader_writer) {
 
   Section head = Section::Load(head_offset(), reader_writer);
   if (head.size() > max_size) {
-    Section result = Section::Create(head.base_offset() + head.size() - max_size,
-                                     max_size, reader_writer);
-    head.SetSize(head.size() - max_size, reader_writer);
-    return result;
+    // Cut the head's beginning off, so the result can later grow in place at
+    // the expense of the rest (see SectionAllocator::ExtendSection).
+    Section rest = Section::Create(head.base_offset() + max_size, head.size() - max_size,
+                                   reader_writer, head.next_offset());
+    SetHead(rest.base_offset(), reader_writer);
+    IndexReplaced(head.base_offset(), 0, head.next_offset(), rest);
+    try {
+      return Section::Create(head.base_offset(), max_size, reader_writer);
+    }
+    catch (...) {
+#ifndef NDEBUG
+      std::cerr << "Leaked section at " << std::hex << head.base_offset()
+                << " of size " << std::dec << max_size << std::endl;
+#endif
+      throw;
+    }
   }
   else {
     SetHead(head.next_offset(), reader_writer);
+    IndexReplaced(head.base_offset(), 0, head.next_offset(), Section(0, 0, 0));
     // Drop the broken section if its |next_offset| field isn't writable.
     try {
       head.SetNext(0, reader_writer);
@@ -46,12 +62,88 @@ Section NoneEntry::GetSection(uint64_t max_size, ReaderWriter* reader_writer) {
   }
 }
 
+uint64_t NoneEntry::FindSection(uint64_t min_size, ReaderWriter* reader) {
+  BuildIndex(reader);
+  auto it = sizes_.lower_bound(std::make_pair(min_size, uint64_t(0)));
+  return it != sizes_.end() ? it->second : 0;
+}
+
+uint64_t NoneEntry::FindLargestSection(ReaderWriter* reader) {
+  BuildIndex(reader);
+  return !sizes_.empty() ? sizes_.rbegin()->second : 0;
+}
+
+uint64_t NoneEntry::TakeSectionAt(uint64_t section_offset, uint64_t max_size, uint64_t unit,
+                                  ReaderWriter* reader_writer) {
+  BuildIndex(reader_writer);
+  auto it = unused_.find(section_offset);
+  if (it == unused_.end())
+    return 0;
+  uint64_t prev_offset = it->second.prev_offset;
+
+  // It's correct because |unit| is always equal to power of 2.
+  uint64_t taken = std::min(max_size, it->second.size) & ~(unit - 1);
+  if (taken == 0)
+    return 0;
+
+  Section section = Section::Load(section_offset, reader_writer);
+  if (taken == section.size()) {
+    Link(prev_offset, section.next_offset(), reader_writer);
+    IndexReplaced(section_offset, prev_offset, section.next_offset(), Section(0, 0, 0));
+    return taken;
+  }
+
+  // Leave the tail in the chain.
+  Section rest = Section::Create(section_offset + taken, section.size() - taken,
+                                 reader_writer, section.next_offset());
+  Link(prev_offset, rest.base_offset(), reader_writer);
+  IndexReplaced(section_offset, prev_offset, section.next_offset(), rest);
+  return taken;
+}
+
 void NoneEntry::PutSection(Section section, ReaderWriter* reader_writer) {
+  std::vector<Section> sections;
   Section last = section;
-  while (last.next_offset() != 0)
+  while (1) {
+    if (indexed_) {
+      try {
+        sections.push_back(last);
+      }
+      catch (...) {
+        DropIndex();
+      }
+    }
+    if (last.next_offset() == 0)
+      break;
     last = Section::Load(last.next_offset(), reader_writer);
-  last.SetNext(head_offset(), reader_writer);
+  }
+  uint64_t next_offset = head_offset();
+  last.SetNext(next_offset, reader_writer);
   SetHead(section.base_offset(), reader_writer);
+  IndexPrepended(sections, next_offset);
+}
+
+// Links |sections| into one chain in front of the current one.  The head is
+// changed the last, so a failure leaves the chain intact.
+void NoneEntry::PutSections(const std::vector<Section>& sections,
+                            ReaderWriter* reader_writer) {
+  uint64_t old_head_offset = head_offset();
+  uint64_t next_offset = old_head_offset;
+  for (auto it = sections.rbegin(); it != sections.rend(); ++it) {
+    Section section = *it;
+    section.SetNext(next_offset, reader_writer);
+    next_offset = section.base_offset();
+  }
+  SetHead(next_offset, reader_writer);
+  IndexPrepended(sections, old_head_offset);
+}
+
+std::vector<Section> NoneEntry::GetAllSections(ReaderWriter* reader) {
+  std::vector<Section> sections;
+  for (uint64_t it_offset = head_offset(); it_offset != 0;
+       it_offset = sections.back().next_offset())
+    sections.push_back(Section::Load(it_offset, reader));
+  return sections;
 }
 
 void NoneEntry::SetHead(uint64_t head_offset, ReaderWriter* writer) {
@@ -60,6 +152,82 @@ void NoneEntry::SetHead(uint64_t head_offset, ReaderWriter* writer) {
   head_offset_ = head_offset;
 }
 
+void NoneEntry::Link(uint64_t prev_offset, uint64_t next_offset, ReaderWriter* writer) {
+  if (prev_offset == 0)
+    SetHead(next_offset, writer);
+  else
+    writer->Write<uint64_t>(next_offset,
+                            prev_offset + offsetof(SectionLayout::Header, next_offset));
+}
+
+void NoneEntry::BuildIndex(ReaderWriter* reader) {
+  if (indexed_)
+    return;
+
+  try {
+    uint64_t prev_offset = 0;
+    for (uint64_t it_offset = head_offset(); it_offset != 0;) {
+      Section it = Section::Load(it_offset, reader);
+      if (unused_.count(it_offset) != 0)
+        throw FormatException();  // the chain is looped
+      Index(it_offset, prev_offset, it.size());
+      prev_offset = it_offset;
+      it_offset = it.next_offset();
+    }
+  }
+  catch (...) {
+    DropIndex();
+    throw;
+  }
+  indexed_ = true;
+}
+
+void NoneEntry::IndexReplaced(uint64_t offset, uint64_t prev_offset, uint64_t next_offset,
+                              const Section& rest) noexcept {
+  if (!indexed_)
+    return;
+
+  try {
+    auto it = unused_.find(offset);
+    if (it != unused_.end()) {
+      sizes_.erase(std::make_pair(it->second.size, offset));
+      unused_.erase(it);
+    }
+    if (rest.base_offset() != 0)
+      Index(rest.base_offset(), prev_offset, rest.size());
+    if (next_offset != 0)
+      unused_.at(next_offset).prev_offset =
+          rest.base_offset() != 0 ? rest.base_offset() : prev_offset;
+  }
+  catch (...) {
+    DropIndex();
+  }
+}
+
+void NoneEntry::IndexPrepended(const std::vector<Section>& sections,
+                               uint64_t next_offset) noexcept {
+  if (!indexed_)
+    return;
+
+  try {
+    uint64_t prev_offset = 0;
+    for (const Section& section : sections) {
+      Index(section.base_offset(), prev_offset, section.size());
+      prev_offset = section.base_offset();
+    }
+    if (next_offset != 0)
+      unused_.at(next_offset).prev_offset = prev_offset;
+  }
+  catch (...) {
+    DropIndex();
+  }
+}
+
+void NoneEntry::Index(uint64_t offset, uint64_t prev_offset, uint64_t size) {
+  unused_[offset] = Unused{prev_offset, size};
+  sizes_.emplace(size, offset);
+}
+
 }  // namespace linfs
 
 }  // namespace fs
@@ -2,8 +2,12 @@
 
 #include <atomic>
 #include <cstdint>
+#include <map>
 #include <memory>
+#include <set>
 #include <stdexcept>
+#include <utility>
+#include <vector>
 
 #include "lib/entries/entry.h"
 #include "lib/sections/section.h"
@@ -27,13 +31,56 @@ class NoneEntry : public Entry {
   uint64_t section_offset() { throw std::logic_error("NoneEntry::section_offset"); }
 
   Section GetSection(uint64_t max_size, ReaderWriter* reader_writer);
+  // The following ones use the index (see |unused_|), so they don't walk the
+  // chain.  FindSection returns the offset of the smallest unused section of
+  // at least |min_size| bytes, FindLargestSection of the largest one, or 0 if
+  // there is no such section.
+  uint64_t FindSection(uint64_t min_size, ReaderWriter* reader);
+  uint64_t FindLargestSection(ReaderWriter* reader);
+  // Takes at most |max_size| bytes from the beginning of the unused section
+  // at |section_offset|, by whole |unit|s.  Returns the number of taken
+  // bytes, or 0 if there is no such section or it's smaller than |unit|.
+  uint64_t TakeSectionAt(uint64_t section_offset, uint64_t max_size, uint64_t unit,
+                         ReaderWriter* reader_writer);
   void PutSection(Section section, ReaderWriter* reader_writer);
+  void PutSections(const std::vector<Section>& sections, ReaderWriter* reader_writer);
+  std::vector<Section> GetAllSections(ReaderWriter* reader);
   bool HasSections() const { return head_offset() != 0; }
 
  private:
   void SetHead(uint64_t head_offset, ReaderWriter* writer);
+  // Links the section before |next_offset| to it (it's the head if
+  // |prev_offset| is 0).
+  void Link(uint64_t prev_offset, uint64_t next_offset, ReaderWriter* writer);
+
+  // Keep the index in sync with the chain.  They are called right after the
+  // write which changes the chain, and drop the index if they fail.
+  void BuildIndex(ReaderWriter* reader);
+  // The section at |offset| between |prev_offset| and |next_offset| has been
+  // replaced by |rest|, or unlinked if |rest|'s offset is 0.
+  void IndexReplaced(uint64_t offset, uint64_t prev_offset, uint64_t next_offset,
+                     const Section& rest) noexcept;
+  // |sections| have been linked in this order in front of |next_offset|.
+  void IndexPrepended(const std::vector<Section>& sections, uint64_t next_offset) noexcept;
+  void Index(uint64_t offset, uint64_t prev_offset, uint64_t size);
+  void DropIndex() noexcept {
+    unused_.clear();
+    sizes_.clear();
+    indexed_ = false;
+  }
 
   std::atomic<uint64_t> head_offset_;
+
+  // Unused sections by their offsets, each with the offset of the previous
+  // one in the chain (0 for the head), and by their sizes.  It's built on
+  // first use and dropped whenever it may disagree with the chain.
+  struct Unused {
+    uint64_t prev_offset;
+    uint64_t size;
+  };
+  std::map<uint64_t, Unused> unused_;
+  std::set<std::pair<uint64_t, uint64_t>> sizes_;  // sizes and offsets
+  bool indexed_ = false;
 };
 
 }  // namespace linfs
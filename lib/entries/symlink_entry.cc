@@ -57,7 +57,7 @@ void SymlinkEntry::SetTarget(const char* target, ReaderWriter* reader_writer,
     if (target_size == 0)
       break;
 
-    SectionSymlink next_sec_slnk = allocator->AllocateSection(target_size,
+    SectionSymlink next_sec_slnk = allocator->AllocateSection(target_size, type(),
                                                               reader_writer);
     try {
       sec_slnk.SetNext(next_sec_slnk.base_offset(), reader_writer);
@@ -0,0 +1,370 @@
+#include "lib/extent_tree.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "lib/entries/entry.h"
+#include "lib/utils/byte_order.h"
+#include "lib/utils/format_exception.h"
+
+#ifndef NDEBUG
+#include <iostream>
+#endif
+
+namespace fs {
+
+namespace linfs {
+
+namespace {
+
+uint64_t NodeCapacity(uint64_t node_size) {
+  return (node_size - sizeof(ExtentLayout::NodeHeader)) / sizeof(ExtentLayout::Entry);
+}
+
+// Returns the index of the child which may contain |file_offset|.
+template <typename Entries>
+size_t ChildIndex(const Entries& entries, uint64_t file_offset) {
+  auto it = std::upper_bound(entries.begin(), entries.end(), file_offset,
+                             [](uint64_t file_offset, const ExtentLayout::Entry& entry) {
+                               return file_offset < entry.file_offset;
+                             });
+  return it == entries.begin() ? 0 : it - entries.begin() - 1;
+}
+
+ExtentLayout::Entry ToEntry(const ExtentTree::Extent& extent) {
+  uint32_t flags = (extent.shared ? ExtentLayout::kFlagShared : 0) |
+                   (extent.checksummed ? ExtentLayout::kFlagChecksum : 0);
+  return ExtentLayout::Entry{extent.file_offset, extent.section_offset, extent.data_offset,
+                             extent.length, extent.checksummed ? extent.checksums_offset : 0,
+                             flags};
+}
+
+ExtentTree::Extent ToExtent(const ExtentLayout::Entry& entry) {
+  return ExtentTree::Extent{entry.file_offset, entry.section_offset, entry.length,
+                            (entry.flags & ExtentLayout::kFlagShared) != 0,
+                            (entry.flags & ExtentLayout::kFlagChecksum) != 0,
+                            entry.checksums_offset, entry.data_offset};
+}
+
+}  // namespace
+
+ExtentTree ExtentTree::Create(uint64_t root_offset, uint64_t root_size, ReaderWriter* writer) {
+  ExtentTree tree(root_offset, root_size);
+  tree.StoreNode(Node{0, root_offset, root_size, NodeCapacity(root_size), 0, {}}, writer);
+  return tree;
+}
+
+bool ExtentTree::Find(uint64_t file_offset, ReaderWriter* reader, Extent* extent) {
+  return FindIn(LoadRoot(reader), file_offset, reader, extent);
+}
+
+bool ExtentTree::FindLast(ReaderWriter* reader, Extent* extent) {
+  Node node = LoadRoot(reader);
+  if (node.entries.empty())
+    return false;
+
+  while (node.level != 0)
+    node = LoadNode(node.entries.back().section_offset, reader);
+
+  *extent = ToExtent(node.entries.back());
+  return true;
+}
+
+void ExtentTree::Insert(const Extent& extent, ReaderWriter* reader_writer,
+                        SectionAllocator* allocator) {
+  Node root = LoadRoot(reader_writer);
+  NodeEntry unused;
+  InsertIn(root, ToEntry(extent), reader_writer, allocator, &unused);
+}
+
+void ExtentTree::Update(const Extent& extent, ReaderWriter* reader_writer) {
+  Node node = LoadRoot(reader_writer);
+  while (node.level != 0) {
+    if (node.entries.empty())
+      throw FormatException();  // empty node
+    node = LoadNode(node.entries[ChildIndex(node.entries, extent.file_offset)].section_offset,
+                    reader_writer);
+  }
+
+  size_t i = ChildIndex(node.entries, extent.file_offset);
+  if (node.entries.empty() || node.entries[i].file_offset != extent.file_offset)
+    throw FormatException();  // there is no such extent
+
+  // Rewrite only the changed entry.
+  NodeEntry entry = ToEntry(extent);
+  entry.file_offset = ByteOrder::Pack(entry.file_offset);
+  entry.section_offset = ByteOrder::Pack(entry.section_offset);
+  entry.data_offset = ByteOrder::Pack(entry.data_offset);
+  entry.length = ByteOrder::Pack(entry.length);
+  entry.checksums_offset = ByteOrder::Pack(entry.checksums_offset);
+  entry.flags = ByteOrder::Pack(entry.flags);
+  reader_writer->Write<NodeEntry>(entry, node.offset + sizeof(ExtentLayout::NodeHeader) +
+                                             i * sizeof(NodeEntry));
+}
+
+void ExtentTree::Assign(const std::vector<Extent>& extents, ReaderWriter* reader_writer,
+                        SectionAllocator* allocator) {
+  Node root = LoadRoot(reader_writer);
+  std::vector<uint64_t> old_nodes;
+  WalkNodes(root, reader_writer, [&old_nodes](const Node& node) {
+    if (node.section_offset != 0)
+      old_nodes.push_back(node.section_offset);
+  });
+
+  std::vector<NodeEntry> entries;
+  entries.reserve(extents.size());
+  for (const Extent& extent : extents)
+    entries.push_back(ToEntry(extent));
+
+  // Build the tree bottom-up.
+  std::vector<uint64_t> new_nodes;
+  try {
+    uint16_t level = 0;
+    while (entries.size() > root.capacity) {
+      std::vector<NodeEntry> parents;
+      for (auto it = entries.begin(); it != entries.end();) {
+        Node node = AllocateNode(level, reader_writer, allocator);
+        new_nodes.push_back(node.section_offset);
+        size_t count = std::min<uint64_t>(node.capacity, entries.end() - it);
+        node.entries.assign(it, it + count);
+        StoreNode(node, reader_writer);
+        parents.push_back(NodeEntry{it->file_offset, node.section_offset, 0, 0, 0, 0});
+        it += count;
+      }
+      entries.swap(parents);
+      ++level;
+    }
+
+    root.level = level;
+    root.entries.swap(entries);
+    StoreNode(root, reader_writer);
+  }
+  catch (...) {
+    for (uint64_t section_offset : new_nodes)
+      allocator->ReleaseSection(section_offset, reader_writer);
+    throw;
+  }
+
+  for (uint64_t section_offset : old_nodes)
+    allocator->ReleaseSection(section_offset, reader_writer);
+}
+
+void ExtentTree::ForEachExtent(ReaderWriter* reader,
+                               const std::function<void(const Extent&)>& visitor) {
+  WalkNodes(LoadRoot(reader), reader, [&visitor](const Node& node) {
+    if (node.level == 0)
+      for (const NodeEntry& entry : node.entries)
+        visitor(ToExtent(entry));
+  });
+}
+
+uint64_t ExtentTree::CountNodes(ReaderWriter* reader, uint64_t* nodes_size) {
+  uint64_t count = 0;
+  uint64_t size = 0;
+  WalkNodes(LoadRoot(reader), reader, [&count, &size](const Node& node) {
+    ++count;
+    if (node.section_offset != 0)
+      size += sizeof(SectionLayout::Header) + node.size;
+  });
+  if (nodes_size != nullptr)
+    *nodes_size = size;
+  return count - 1;
+}
+
+void ExtentTree::ReleaseNodes(ReaderWriter* reader_writer, SectionAllocator* allocator) noexcept {
+  std::vector<uint64_t> nodes;
+  try {
+    WalkNodes(LoadRoot(reader_writer), reader_writer, [&nodes](const Node& node) {
+      if (node.section_offset != 0)
+        nodes.push_back(node.section_offset);
+    });
+  }
+  catch (...) {
+#ifndef NDEBUG
+    std::cerr << "Leaked some nodes of the extent tree at " << std::hex << root_offset_
+              << std::endl;
+#endif
+  }
+
+  for (uint64_t section_offset : nodes)
+    allocator->ReleaseSection(section_offset, reader_writer);
+}
+
+ExtentTree::Node ExtentTree::LoadRoot(ReaderWriter* reader) {
+  return ReadNode(0, root_offset_, root_size_, reader);
+}
+
+ExtentTree::Node ExtentTree::LoadNode(uint64_t section_offset, ReaderWriter* reader) {
+  Section section = Section::Load(section_offset, reader);
+  return ReadNode(section_offset, section.data_offset(), section.data_size(), reader);
+}
+
+ExtentTree::Node ExtentTree::ReadNode(uint64_t section_offset, uint64_t offset, uint64_t size,
+                                      ReaderWriter* reader) {
+  Node node{section_offset, offset, size, NodeCapacity(size), 0, {}};
+  ExtentLayout::NodeHeader header = reader->Read<ExtentLayout::NodeHeader>(offset);
+  node.level = ByteOrder::Unpack(header.level);
+  uint16_t count = ByteOrder::Unpack(header.count);
+  if (count > node.capacity)
+    throw FormatException();  // the node is broken
+
+  node.entries.resize(count);
+  reader->Read(offset + sizeof header, reinterpret_cast<char*>(node.entries.data()),
+               count * sizeof(NodeEntry));
+  for (NodeEntry& entry : node.entries) {
+    entry.file_offset = ByteOrder::Unpack(entry.file_offset);
+    entry.section_offset = ByteOrder::Unpack(entry.section_offset);
+    entry.data_offset = ByteOrder::Unpack(entry.data_offset);
+    entry.length = ByteOrder::Unpack(entry.length);
+    entry.checksums_offset = ByteOrder::Unpack(entry.checksums_offset);
+    entry.flags = ByteOrder::Unpack(entry.flags);
+  }
+  return node;
+}
+
+void ExtentTree::StoreNode(const Node& node, ReaderWriter* writer) {
+  // Write the whole node at once.
+  std::vector<char> buf(sizeof(ExtentLayout::NodeHeader) + node.entries.size() * sizeof(NodeEntry));
+  ExtentLayout::NodeHeader header;
+  header.level = ByteOrder::Pack(node.level);
+  header.count = ByteOrder::Pack(static_cast<uint16_t>(node.entries.size()));
+  memcpy(buf.data(), &header, sizeof header);
+
+  char* it = buf.data() + sizeof header;
+  for (const NodeEntry& entry : node.entries) {
+    NodeEntry packed{ByteOrder::Pack(entry.file_offset), ByteOrder::Pack(entry.section_offset),
+                     ByteOrder::Pack(entry.data_offset), ByteOrder::Pack(entry.length),
+                     ByteOrder::Pack(entry.checksums_offset), ByteOrder::Pack(entry.flags)};
+    memcpy(it, &packed, sizeof packed);
+    it += sizeof packed;
+  }
+
+  writer->Write(buf.data(), buf.size(), node.offset);
+}
+
+ExtentTree::Node ExtentTree::AllocateNode(uint16_t level, ReaderWriter* reader_writer,
+                                          SectionAllocator* allocator) {
+  // Nodes are metadata, so they take one small cluster.
+  Section section = allocator->AllocateContiguousSection(1, Entry::Type::kNone, reader_writer);
+  return Node{section.base_offset(), section.data_offset(), section.data_size(),
+              NodeCapacity(section.data_size()), level, {}};
+}
+
+bool ExtentTree::FindIn(const Node& node, uint64_t file_offset, ReaderWriter* reader,
+                        Extent* extent) {
+  if (node.level == 0) {
+    // The first extent which ends after |file_offset|.
+    auto it = std::upper_bound(node.entries.begin(), node.entries.end(), file_offset,
+                               [](uint64_t file_offset, const NodeEntry& entry) {
+                                 return file_offset < entry.file_offset + entry.length;
+                               });
+    if (it == node.entries.end())
+      return false;
+    *extent = ToExtent(*it);
+    return true;
+  }
+
+  // The extent can be in one of the following children if |file_offset|
+  // is after the last extent of the first one.
+  for (size_t i = ChildIndex(node.entries, file_offset); i < node.entries.size(); ++i)
+    if (FindIn(LoadNode(node.entries[i].section_offset, reader), file_offset, reader, extent))
+      return true;
+  return false;
+}
+
+bool ExtentTree::InsertIn(Node& node, const NodeEntry& entry, ReaderWriter* reader_writer,
+                          SectionAllocator* allocator, NodeEntry* split) {
+  if (node.level == 0) {
+    auto it = std::upper_bound(node.entries.begin(), node.entries.end(), entry.file_offset,
+                               [](uint64_t file_offset, const NodeEntry& entry) {
+                                 return file_offset < entry.file_offset;
+                               });
+    node.entries.insert(it, entry);
+  }
+  else {
+    if (node.entries.empty())
+      throw FormatException();  // empty node
+
+    size_t i = ChildIndex(node.entries, entry.file_offset);
+    bool changed = false;
+    if (entry.file_offset < node.entries[i].file_offset) {
+      // It's the new first extent of the subtree.
+      node.entries[i].file_offset = entry.file_offset;
+      changed = true;
+    }
+
+    Node child = LoadNode(node.entries[i].section_offset, reader_writer);
+    NodeEntry child_split;
+    if (InsertIn(child, entry, reader_writer, allocator, &child_split)) {
+      node.entries.insert(node.entries.begin() + i + 1, child_split);
+      changed = true;
+    }
+    if (!changed)
+      return false;
+  }
+
+  if (node.entries.size() <= node.capacity) {
+    StoreNode(node, reader_writer);
+    return false;
+  }
+
+  if (node.section_offset == 0) {
+    // The root can't move, so move its entries down to two new nodes.
+    Node left = AllocateNode(node.level, reader_writer, allocator);
+    Node right;
+    try {
+      right = AllocateNode(node.level, reader_writer, allocator);
+    }
+    catch (...) {
+      allocator->ReleaseSection(left.section_offset, reader_writer);
+      throw;
+    }
+    try {
+      size_t half = node.entries.size() / 2;
+      left.entries.assign(node.entries.begin(), node.entries.begin() + half);
+      right.entries.assign(node.entries.begin() + half, node.entries.end());
+      StoreNode(left, reader_writer);
+      StoreNode(right, reader_writer);
+
+      ++node.level;
+      node.entries = {
+          NodeEntry{left.entries.front().file_offset, left.section_offset, 0, 0, 0, 0},
+          NodeEntry{right.entries.front().file_offset, right.section_offset, 0, 0, 0, 0}};
+      StoreNode(node, reader_writer);
+    }
+    catch (...) {
+      allocator->ReleaseSection(left.section_offset, reader_writer);
+      allocator->ReleaseSection(right.section_offset, reader_writer);
+      throw;
+    }
+    return false;
+  }
+
+  // Move the upper half to the new right sibling.
+  Node right = AllocateNode(node.level, reader_writer, allocator);
+  try {
+    size_t half = node.entries.size() / 2;
+    right.entries.assign(node.entries.begin() + half, node.entries.end());
+    StoreNode(right, reader_writer);
+    node.entries.resize(half);
+    StoreNode(node, reader_writer);
+  }
+  catch (...) {
+    allocator->ReleaseSection(right.section_offset, reader_writer);
+    throw;
+  }
+  *split = NodeEntry{right.entries.front().file_offset, right.section_offset, 0, 0, 0, 0};
+  return true;
+}
+
+void ExtentTree::WalkNodes(const Node& node, ReaderWriter* reader,
+                           const std::function<void(const Node&)>& visitor) {
+  visitor(node);
+  if (node.level != 0)
+    for (const NodeEntry& entry : node.entries)
+      WalkNodes(LoadNode(entry.section_offset, reader), reader, visitor);
+}
+
+}  // namespace linfs
+
+}  // namespace fs
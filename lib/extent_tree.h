@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "lib/layout/extent_layout.h"
+#include "lib/section_allocator.h"
+#include "lib/sections/section.h"
+#include "lib/utils/reader_writer.h"
+
+namespace fs {
+
+namespace linfs {
+
+// B+tree which maps file offsets to the sections with the data (see
+// ExtentLayout).  It doesn't own the data sections, only the nodes.
+class ExtentTree {
+ public:
+  struct Extent {
+    uint64_t file_offset;
+    uint64_t section_offset;
+    uint64_t length;
+    bool shared = false;  // see ExtentLayout::kFlagShared
+    bool checksummed = false;  // see ExtentLayout::kFlagChecksum
+    uint64_t checksums_offset = 0;  // see ExtentLayout::Entry
+    uint64_t data_offset = 0;  // in the section's data, see ExtentLayout::Entry
+
+    uint64_t end() const { return file_offset + length; }
+    // Offset of the extent's first byte on the device.
+    uint64_t device_offset() const {
+      return section_offset + sizeof(SectionLayout::Header) + data_offset;
+    }
+  };
+
+  // Writes an empty root node of |root_size| bytes at |root_offset|.
+  static ExtentTree Create(uint64_t root_offset, uint64_t root_size, ReaderWriter* writer);
+
+  ExtentTree(uint64_t root_offset, uint64_t root_size)
+      : root_offset_(root_offset), root_size_(root_size) {}
+
+  // Finds the extent which contains |file_offset| or, if there is no such one,
+  // the first extent after it.  Returns false if there are no extents at all.
+  bool Find(uint64_t file_offset, ReaderWriter* reader, Extent* extent);
+  bool FindLast(ReaderWriter* reader, Extent* extent);
+
+  // Adds |extent| which must not overlap the existing ones.
+  void Insert(const Extent& extent, ReaderWriter* reader_writer, SectionAllocator* allocator);
+  // Changes the section, the length and the flags of the extent at
+  // |extent.file_offset|.
+  void Update(const Extent& extent, ReaderWriter* reader_writer);
+  // Replaces all extents by sorted |extents|.  The root node is written the
+  // last, so the tree is consistent until then.
+  void Assign(const std::vector<Extent>& extents, ReaderWriter* reader_writer,
+              SectionAllocator* allocator);
+
+  // Calls |visitor| for each extent in order of file offsets.
+  void ForEachExtent(ReaderWriter* reader, const std::function<void(const Extent&)>& visitor);
+  // Returns the number of nodes except the root, and the size of their
+  // sections in |nodes_size|.
+  uint64_t CountNodes(ReaderWriter* reader, uint64_t* nodes_size = nullptr);
+  // Releases all nodes except the root.
+  void ReleaseNodes(ReaderWriter* reader_writer, SectionAllocator* allocator) noexcept;
+
+ private:
+  using NodeEntry = ExtentLayout::Entry;
+
+  struct Node {
+    uint64_t section_offset;  // 0 for the root
+    uint64_t offset;
+    uint64_t size;
+    uint64_t capacity;
+    uint16_t level;
+    std::vector<NodeEntry> entries;
+  };
+
+  Node LoadRoot(ReaderWriter* reader);
+  Node LoadNode(uint64_t section_offset, ReaderWriter* reader);
+  Node ReadNode(uint64_t section_offset, uint64_t offset, uint64_t size, ReaderWriter* reader);
+  void StoreNode(const Node& node, ReaderWriter* writer);
+  Node AllocateNode(uint16_t level, ReaderWriter* reader_writer, SectionAllocator* allocator);
+
+  bool FindIn(const Node& node, uint64_t file_offset, ReaderWriter* reader, Extent* extent);
+  // Returns true if |node| has been split.  Then |split| is the entry of the
+  // new right sibling.
+  bool InsertIn(Node& node, const NodeEntry& entry, ReaderWriter* reader_writer,
+                SectionAllocator* allocator, NodeEntry* split);
+  void WalkNodes(const Node& node, ReaderWriter* reader,
+                 const std::function<void(const Node&)>& visitor);
+
+  const uint64_t root_offset_;
+  const uint64_t root_size_;
+};
+
+}  // namespace linfs
+
+}  // namespace fs
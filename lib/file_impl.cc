@@ -2,50 +2,134 @@
 
 #include <algorithm>
 #include <cassert>
+#include <exception>
+#include <limits>
+#include <utility>
 
+#include "lib/layout/extent_layout.h"
+#include "lib/mapped_file_impl.h"
+#include "lib/mapped_range_impl.h"
 #include "lib/utils/exception_handler.h"
 
+#ifndef NDEBUG
+#include <iostream>
+#endif
+
 namespace fs {
 
 namespace linfs {
 
+namespace {
+
+// Checked data is read by this many chunks at once (see FileEntry::ReadChecked).
+constexpr size_t kCheckedChunks = 256;
+
+}  // namespace
+
 size_t FileImpl::Read(char* buf, size_t buf_size, ErrorCode* error_code) {
-  assert((buf != nullptr || buf_size == 0) && error_code != nullptr);
+  uint64_t old_cursor = cursor_;
+  size_t read = ReadAt(old_cursor, buf, buf_size, error_code);
+  if (*error_code == ErrorCode::kSuccess)
+    cursor_ = old_cursor + read;
+  return read;
+}
 
+size_t FileImpl::Write(const char* buf, size_t buf_size, ErrorCode* error_code) {
   uint64_t old_cursor = cursor_;
-  buf_size = std::min(buf_size, file_entry_->size() - old_cursor);
+  size_t written = WriteAt(old_cursor, buf, buf_size, error_code);
+  if (*error_code == ErrorCode::kSuccess)
+    cursor_ = old_cursor + written;
+  return written;
+}
+
+size_t FileImpl::ReadAt(uint64_t offset, char* buf, size_t buf_size, ErrorCode* error_code) {
+  ReadBuffer read_buffer{buf, buf_size};
+  return ReadVAt(offset, &read_buffer, 1, error_code);
+}
 
-  size_t read;
+size_t FileImpl::WriteAt(uint64_t offset, const char* buf, size_t buf_size,
+                         ErrorCode* error_code) {
+  WriteBuffer write_buffer{buf, buf_size};
+  return WriteVAt(offset, &write_buffer, 1, error_code);
+}
+
+size_t FileImpl::ReadV(const ReadBuffer* bufs, size_t count, ErrorCode* error_code) {
+  uint64_t old_cursor = cursor_;
+  size_t read = ReadVAt(old_cursor, bufs, count, error_code);
+  if (*error_code == ErrorCode::kSuccess)
+    cursor_ = old_cursor + read;
+  return read;
+}
+
+size_t FileImpl::WriteV(const WriteBuffer* bufs, size_t count, ErrorCode* error_code) {
+  uint64_t old_cursor = cursor_;
+  size_t written = WriteVAt(old_cursor, bufs, count, error_code);
+  if (*error_code == ErrorCode::kSuccess)
+    cursor_ = old_cursor + written;
+  return written;
+}
+
+size_t FileImpl::ReadVAt(uint64_t offset, const ReadBuffer* bufs, size_t count,
+                         ErrorCode* error_code) {
+  assert((bufs != nullptr || count == 0) && error_code != nullptr);
+
+  uint64_t read = 0;
   try {
-    std::shared_lock<SharedMutex> lock = file_entry_->LockShared();
-    read = file_entry_->Read(old_cursor, buf, buf_size, reader_writer_.get());
+    uint64_t size = 0;
+    for (size_t i = 0; i < count; ++i)
+      size += bufs[i].size;
+
+    {
+      // The buffered data must be visible for the reader.
+      std::lock_guard<std::mutex> buffer_lock(write_buffer_mutex_);
+      FlushWriteBuffer();
+    }
+
+    std::unique_lock<std::mutex> read_buffer_lock(read_buffer_mutex_);
+    // Stores through a mapping don't change the generation, so the buffer
+    // can't tell whether it's still valid.
+    if (size < read_buffer_capacity_ && !file_entry_->mapped())
+      read = BufferedRead(offset, bufs, size);
+    else {
+      read_buffer_lock.unlock();
+      read = ReadRange(offset, bufs, size);
+    }
   }
   catch (...) {
     *error_code = ExceptionHandler::ToErrorCode(std::current_exception());
     return 0;
   }
 
-  cursor_ = old_cursor + read;
   *error_code = ErrorCode::kSuccess;
   return read;
 }
 
-size_t FileImpl::Write(const char* buf, size_t buf_size, ErrorCode* error_code) {
-  assert((buf != nullptr || buf_size == 0) && error_code != nullptr);
-
-  uint64_t old_cursor = cursor_;
+size_t FileImpl::WriteVAt(uint64_t offset, const WriteBuffer* bufs, size_t count,
+                          ErrorCode* error_code) {
+  assert((bufs != nullptr || count == 0) && error_code != nullptr);
 
-  size_t written;
+  uint64_t written = 0;
   try {
-    std::unique_lock<SharedMutex> lock = file_entry_->Lock();
-    written = file_entry_->Write(old_cursor, buf, buf_size, reader_writer_.get(), allocator_);
+    uint64_t size = 0;
+    for (size_t i = 0; i < count; ++i)
+      size += bufs[i].size;
+
+    // Sequential writes are merged in the write buffer.  All the buffers go
+    // either there or to the device, so a failed write leaves nothing behind.
+    std::unique_lock<std::mutex> buffer_lock(write_buffer_mutex_);
+    if (!BufferWrite(offset, bufs, count, size)) {
+      // The buffer is empty now, so the writers of the same handle don't need
+      // to wait for each other.
+      buffer_lock.unlock();
+      WriteRange(offset, bufs, size);
+    }
+    written = size;
   }
   catch (...) {
     *error_code = ExceptionHandler::ToErrorCode(std::current_exception());
     return 0;
   }
 
-  cursor_ = old_cursor + written;
   *error_code = ErrorCode::kSuccess;
   return written;
 }
@@ -56,21 +140,579 @@ uint64_t FileImpl::GetCursor() const {
 }
 
 ErrorCode FileImpl::SetCursor(uint64_t cursor) {
-  if (cursor > file_entry_->size())
-    return ErrorCode::kErrorCursorTooBig;
   // Implicit call of std::atomic::store.
   cursor_ = cursor;
   return ErrorCode::kSuccess;
 }
 
 uint64_t FileImpl::GetSize() const {
-  return file_entry_->size();
+  std::lock_guard<std::mutex> buffer_lock(write_buffer_mutex_);
+  return BufferedSize();
 }
 
 void FileImpl::Close() {
+  {
+    std::unique_lock<std::mutex> lock(async_mutex_);
+    async_cv_.wait(lock, [this] { return async_pending_ == 0; });
+  }
+
+  try {
+    std::lock_guard<std::mutex> buffer_lock(write_buffer_mutex_);
+    FlushWriteBuffer();
+  }
+  catch (...) {
+#ifndef NDEBUG
+    std::cerr << "Lost " << write_buffer_.size() << " buffered byte(s) at "
+              << write_buffer_offset_ << std::endl;
+#endif
+    write_buffer_budget_->Release(write_buffer_.size());
+  }
+
+  try {
+    file_entry_->PersistSize(reader_writer_.get());
+  }
+  catch (...) {
+#ifndef NDEBUG
+    std::cerr << "Lost the size of the file at " << std::hex << file_entry_->base_offset()
+              << std::endl;
+#endif
+  }
   delete this;
 }
 
+ErrorCode FileImpl::ReadAsync(uint64_t offset, char* buf, size_t buf_size,
+                              Completion completion) {
+  return SubmitAsync(
+      [this, offset, buf, buf_size](ErrorCode* error_code) {
+        return ReadAt(offset, buf, buf_size, error_code);
+      },
+      std::move(completion));
+}
+
+ErrorCode FileImpl::WriteAsync(uint64_t offset, const char* buf, size_t buf_size,
+                               Completion completion) {
+  return SubmitAsync(
+      [this, offset, buf, buf_size](ErrorCode* error_code) {
+        return WriteAt(offset, buf, buf_size, error_code);
+      },
+      std::move(completion));
+}
+
+ErrorCode FileImpl::SubmitAsync(std::function<size_t(ErrorCode*)> operation,
+                                Completion completion) {
+  assert(completion);
+
+  try {
+    {
+      std::lock_guard<std::mutex> lock(async_mutex_);
+      ++async_pending_;
+    }
+    try {
+      io_executor_->Submit([this, operation, completion] {
+        ErrorCode error_code;
+        size_t size = operation(&error_code);
+        try {
+          completion(error_code, size);
+        }
+        catch (...) {
+          /* Nobody to report to. */
+        }
+
+        // Close() may delete the file as soon as the mutex is unlocked.
+        std::lock_guard<std::mutex> lock(async_mutex_);
+        if (--async_pending_ == 0)
+          async_cv_.notify_all();
+      });
+    }
+    catch (...) {
+      std::lock_guard<std::mutex> lock(async_mutex_);
+      --async_pending_;
+      throw;
+    }
+  }
+  catch (...) {
+    return ExceptionHandler::ToErrorCode(std::current_exception());
+  }
+
+  return ErrorCode::kSuccess;
+}
+
+FileInterface::MappedFile* FileImpl::Map(ErrorCode* error_code) {
+  assert(error_code != nullptr);
+
+  MappedFile* mapped_file;
+  try {
+    {
+      std::lock_guard<std::mutex> buffer_lock(write_buffer_mutex_);
+      FlushWriteBuffer();
+    }
+
+    // The range lock keeps the writers and Truncate off the file until the
+    // mapping is released.
+    RangeLock::Guard range_lock =
+        file_entry_->LockRangeShared(0, std::numeric_limits<uint64_t>::max());
+    std::unique_lock<SharedMutex> lock = file_entry_->Lock();
+    // The size must be final.
+    file_entry_->WaitForAppends(lock);
+    uint64_t size = file_entry_->size();
+
+    std::vector<FileEntry::DeviceRange> ranges;
+    file_entry_->MapData(0, size, reader_writer_.get(), &ranges);
+    if (ranges.size() == 1 && ranges[0].offset != 0 && file_entry_->extent_tree()) {
+      // The data may be shared with clones, which mustn't see the changes.
+      // That takes copying, and the copy may be not contiguous any more.
+      ranges.clear();
+      file_entry_->MapRange(0, size, reader_writer_.get(), allocator_, &ranges);
+    }
+    if (ranges.size() != 1 || ranges[0].offset == 0) {
+      *error_code = ErrorCode::kErrorNotSupported;
+      return nullptr;
+    }
+
+    mapped_file = new MappedFileImpl(file_entry_, std::move(range_lock), ranges[0],
+                                     reader_writer_->Duplicate());
+  }
+  catch (...) {
+    *error_code = ExceptionHandler::ToErrorCode(std::current_exception());
+    return nullptr;
+  }
+
+  *error_code = ErrorCode::kSuccess;
+  return mapped_file;
+}
+
+ErrorCode FileImpl::Truncate(uint64_t size) {
+  try {
+    std::lock_guard<std::mutex> buffer_lock(write_buffer_mutex_);
+    FlushWriteBuffer();
+
+    while (1) {
+      // Nobody may access the bytes which are released or zeroed.
+      uint64_t begin = std::min(size, file_entry_->size());
+      RangeLock::Guard range_lock =
+          file_entry_->LockRange(begin, std::numeric_limits<uint64_t>::max());
+      // Another Truncate could shrink the file before we locked the range.
+      // Now all of them wait for us, and the file can only grow.
+      if (file_entry_->size() < begin)
+        continue;
+
+      std::unique_lock<SharedMutex> lock = file_entry_->Lock();
+      // Appends write to the space which may be released.
+      file_entry_->WaitForAppends(lock);
+      file_entry_->Truncate(size, reader_writer_.get(), allocator_);
+      file_entry_->BumpGeneration();
+      return ErrorCode::kSuccess;
+    }
+  }
+  catch (...) {
+    return ExceptionHandler::ToErrorCode(std::current_exception());
+  }
+}
+
+uint64_t FileImpl::FindData(uint64_t offset, ErrorCode* error_code) {
+  assert(error_code != nullptr);
+
+  uint64_t data;
+  try {
+    {
+      std::lock_guard<std::mutex> buffer_lock(write_buffer_mutex_);
+      FlushWriteBuffer();
+    }
+
+    std::shared_lock<SharedMutex> lock = file_entry_->LockShared();
+    data = file_entry_->FindData(offset, reader_writer_.get());
+    if (data == file_entry_->size()) {
+      *error_code = ErrorCode::kErrorNotFound;
+      return 0;
+    }
+  }
+  catch (...) {
+    *error_code = ExceptionHandler::ToErrorCode(std::current_exception());
+    return 0;
+  }
+
+  *error_code = ErrorCode::kSuccess;
+  return data;
+}
+
+uint64_t FileImpl::FindHole(uint64_t offset, ErrorCode* error_code) {
+  assert(error_code != nullptr);
+
+  uint64_t hole;
+  try {
+    {
+      std::lock_guard<std::mutex> buffer_lock(write_buffer_mutex_);
+      FlushWriteBuffer();
+    }
+
+    std::shared_lock<SharedMutex> lock = file_entry_->LockShared();
+    hole = std::max(offset, file_entry_->FindHole(offset, reader_writer_.get()));
+  }
+  catch (...) {
+    *error_code = ExceptionHandler::ToErrorCode(std::current_exception());
+    return 0;
+  }
+
+  *error_code = ErrorCode::kSuccess;
+  return hole;
+}
+
+uint64_t FileImpl::Append(const char* buf, size_t buf_size, ErrorCode* error_code) {
+  assert((buf != nullptr || buf_size == 0) && error_code != nullptr);
+
+  uint64_t offset;
+  try {
+    {
+      // The buffered data goes before.
+      std::lock_guard<std::mutex> buffer_lock(write_buffer_mutex_);
+      FlushWriteBuffer();
+    }
+
+    std::vector<FileEntry::DeviceRange> ranges;
+    {
+      std::unique_lock<SharedMutex> lock = file_entry_->Lock();
+      offset = file_entry_->ReserveAppend(buf_size, lock, reader_writer_.get(), allocator_,
+                                          &ranges);
+    }
+
+    // Nobody else writes to the reserved space, so no lock is required.
+    std::exception_ptr write_exception;
+    try {
+      for (const FileEntry::DeviceRange& range : ranges) {
+        reader_writer_->Write(buf, range.size, range.offset);
+        buf += range.size;
+      }
+    }
+    catch (...) {
+      // Publish the reservation anyway, otherwise the following ones wait forever.
+      write_exception = std::current_exception();
+    }
+
+    std::unique_lock<SharedMutex> lock = file_entry_->Lock();
+    file_entry_->PublishAppend(offset, lock);
+    file_entry_->BumpGeneration();
+    if (write_exception)
+      std::rethrow_exception(write_exception);
+  }
+  catch (...) {
+    *error_code = ExceptionHandler::ToErrorCode(std::current_exception());
+    return 0;
+  }
+
+  *error_code = ErrorCode::kSuccess;
+  return offset;
+}
+
+FileInterface::MappedRange* FileImpl::MapRange(uint64_t offset, uint64_t size,
+                                               ErrorCode* error_code) {
+  assert(error_code != nullptr);
+
+  MappedRange* mapped_range;
+  try {
+    {
+      std::lock_guard<std::mutex> buffer_lock(write_buffer_mutex_);
+      FlushWriteBuffer();
+    }
+
+    // The range lock pins the data until the range is released.
+    RangeLock::Guard range_lock = file_entry_->LockRangeShared(offset, RangeEnd(offset, size));
+    std::vector<FileEntry::DeviceRange> ranges;
+    std::vector<FileEntry::CheckedRange> checked;
+    {
+      std::shared_lock<SharedMutex> lock = file_entry_->LockShared();
+      if (offset < file_entry_->size()) {
+        size = std::min(size, file_entry_->size() - offset);
+        file_entry_->MapData(offset, size, reader_writer_.get(), &ranges,
+                             verify_reads_ ? &checked : nullptr);
+      }
+    }
+    // The range lock keeps the data as it is, so it's checked only once.
+    std::vector<char> data(checked.empty() ? 0 : kCheckedChunks * ExtentLayout::kChecksumChunk);
+    for (const FileEntry::CheckedRange& range : checked) {
+      for (size_t first = 0; first < range.checksums.size(); first += kCheckedChunks)
+        FileEntry::ReadChecked(range, first, kCheckedChunks, reader_writer_.get(), data.data());
+    }
+    mapped_range = new MappedRangeImpl(file_entry_, std::move(range_lock), ranges,
+                                       reader_writer_.get());
+  }
+  catch (...) {
+    *error_code = ExceptionHandler::ToErrorCode(std::current_exception());
+    return nullptr;
+  }
+
+  *error_code = ErrorCode::kSuccess;
+  return mapped_range;
+}
+
+ErrorCode FileImpl::SetWriteBuffer(size_t size) {
+  try {
+    std::lock_guard<std::mutex> buffer_lock(write_buffer_mutex_);
+    FlushWriteBuffer();
+    write_buffer_capacity_ = size;
+    if (size == 0)
+      std::vector<char>().swap(write_buffer_);
+    return ErrorCode::kSuccess;
+  }
+  catch (...) {
+    return ExceptionHandler::ToErrorCode(std::current_exception());
+  }
+}
+
+ErrorCode FileImpl::SetReadBuffer(size_t size) {
+  try {
+    std::lock_guard<std::mutex> read_buffer_lock(read_buffer_mutex_);
+    std::vector<char>().swap(read_buffer_);
+    read_buffer_valid_ = false;
+    read_buffer_.reserve(size);
+    read_buffer_capacity_ = size;
+    return ErrorCode::kSuccess;
+  }
+  catch (...) {
+    return ExceptionHandler::ToErrorCode(std::current_exception());
+  }
+}
+
+ErrorCode FileImpl::Flush() {
+  try {
+    {
+      std::lock_guard<std::mutex> buffer_lock(write_buffer_mutex_);
+      FlushWriteBuffer();
+    }
+    file_entry_->PersistSize(reader_writer_.get());
+    return ErrorCode::kSuccess;
+  }
+  catch (...) {
+    return ExceptionHandler::ToErrorCode(std::current_exception());
+  }
+}
+
+uint64_t FileImpl::BufferedSize() const {
+  if (write_buffer_.empty())
+    return file_entry_->size();
+  return std::max(file_entry_->size(), write_buffer_offset_ + write_buffer_.size());
+}
+
+bool FileImpl::BufferWrite(uint64_t cursor, const WriteBuffer* bufs, size_t count,
+                           uint64_t buf_size) {
+  if (write_buffer_capacity_ == 0)
+    return false;
+
+  // Only sequential writes can be merged.
+  if (!write_buffer_.empty() && cursor != write_buffer_offset_ + write_buffer_.size())
+    FlushWriteBuffer();
+
+  if (buf_size > write_buffer_capacity_ - write_buffer_.size()) {
+    FlushWriteBuffer();
+    if (buf_size > write_buffer_capacity_)
+      return false;  // There is no sense to buffer it.
+  }
+
+  if (!write_buffer_budget_->Acquire(buf_size)) {
+    FlushWriteBuffer();
+    return false;
+  }
+
+  size_t old_size = write_buffer_.size();
+  try {
+    if (write_buffer_.empty())
+      write_buffer_offset_ = cursor;
+    for (size_t i = 0; i < count; ++i)
+      write_buffer_.insert(write_buffer_.end(), bufs[i].data, bufs[i].data + bufs[i].size);
+  }
+  catch (...) {
+    write_buffer_.resize(old_size);
+    write_buffer_budget_->Release(buf_size);
+    throw;
+  }
+  return true;
+}
+
+uint64_t FileImpl::ReadRange(uint64_t offset, const ReadBuffer* bufs, uint64_t size) {
+  // Only the writers of the same bytes block the reader.
+  RangeLock::Guard range_lock = file_entry_->LockRangeShared(offset, RangeEnd(offset, size));
+  std::shared_lock<SharedMutex> lock = file_entry_->LockShared();
+  if (offset >= file_entry_->size())
+    return 0;
+  size = std::min(size, file_entry_->size() - offset);
+
+  // Find all the data at once and scatter it over the buffers.
+  std::vector<FileEntry::DeviceRange> ranges;
+  std::vector<FileEntry::CheckedRange> checked;
+  file_entry_->MapData(offset, size, reader_writer_.get(), &ranges,
+                       verify_reads_ ? &checked : nullptr);
+  // Only the chunks with the requested bytes are read and checked.  Whole
+  // chunks go right to the buffers, the chunks which the request cuts go
+  // through |data|, which holds the chunk read last.
+  auto check = checked.begin();
+  std::vector<char> data;
+  uint64_t data_position = 0;  // in the file
+  uint64_t data_size = 0;
+  uint64_t position = offset;
+  const ReadBuffer* buf = bufs;
+  size_t buf_cursor = 0;
+  for (const FileEntry::DeviceRange& range : ranges) {
+    for (uint64_t done = 0; done != range.size;) {
+      for (; buf_cursor == buf->size; buf_cursor = 0)
+        ++buf;
+      size_t chunk = std::min<uint64_t>(range.size - done, buf->size - buf_cursor);
+      while (check != checked.end() && check->position + check->size <= position)
+        ++check;
+      if (range.offset == 0) {
+        std::fill_n(buf->data + buf_cursor, chunk, '\0');  // a hole
+      }
+      else if (check != checked.end() && check->position <= position) {
+        uint64_t check_end = check->position + check->size;
+        size_t first = check->ChunkIndex(position);
+        uint64_t end = position + std::min<uint64_t>(chunk, check_end - position);
+        size_t whole = (end == check_end ? check->checksums.size() : check->ChunkIndex(end)) -
+                       first;
+        if (check->ChunkPosition(first) == position && whole != 0) {
+          chunk = FileEntry::ReadChecked(*check, first, whole, reader_writer_.get(),
+                                         buf->data + buf_cursor);
+        }
+        else {
+          if (position < data_position || position >= data_position + data_size) {
+            data.resize(ExtentLayout::kChecksumChunk);
+            data_size = FileEntry::ReadChecked(*check, first, 1, reader_writer_.get(), data.data());
+            data_position = check->ChunkPosition(first);
+          }
+          chunk = std::min<uint64_t>(chunk, data_position + data_size - position);
+          std::copy_n(data.data() + (position - data_position), chunk, buf->data + buf_cursor);
+        }
+      }
+      else {
+        if (check != checked.end())
+          chunk = std::min<uint64_t>(chunk, check->position - position);
+        reader_writer_->Read(range.offset + done, buf->data + buf_cursor, chunk);
+      }
+      done += chunk;
+      buf_cursor += chunk;
+      position += chunk;
+    }
+  }
+  return size;
+}
+
+uint64_t FileImpl::BufferedRead(uint64_t offset, const ReadBuffer* bufs, uint64_t size) {
+  // Take the generation before reading, so a concurrent write makes the
+  // buffer stale rather than unnoticed.
+  uint64_t generation = file_entry_->generation();
+  // A buffer which isn't full reaches the end of the file.
+  bool reaches_end = read_buffer_.size() < read_buffer_capacity_;
+  if (!read_buffer_valid_ || generation != read_buffer_generation_ ||
+      offset < read_buffer_offset_ ||
+      (offset + size > read_buffer_offset_ + read_buffer_.size() && !reaches_end)) {
+    read_buffer_valid_ = false;
+    read_buffer_.resize(read_buffer_capacity_);
+    ReadBuffer buf{read_buffer_.data(), read_buffer_.size()};
+    read_buffer_.resize(ReadRange(offset, &buf, buf.size));
+    read_buffer_offset_ = offset;
+    read_buffer_generation_ = generation;
+    read_buffer_valid_ = true;
+  }
+
+  if (offset - read_buffer_offset_ >= read_buffer_.size())
+    return 0;
+  size = std::min<uint64_t>(size, read_buffer_.size() - (offset - read_buffer_offset_));
+  const char* data = read_buffer_.data() + (offset - read_buffer_offset_);
+  for (uint64_t done = 0; done != size; ++bufs) {
+    size_t chunk = std::min<uint64_t>(bufs->size, size - done);
+    std::copy_n(data + done, chunk, bufs->data);
+    done += chunk;
+  }
+  return size;
+}
+
+void FileImpl::WriteRange(uint64_t offset, const WriteBuffer* bufs, uint64_t size) {
+  if (size == 0)
+    return;
+
+  RangeLock::Guard range_lock;
+  uint64_t begin;
+  while (1) {
+    // Files without the extent tree have no holes, so the gap before
+    // |offset| is filled with zeros and must be locked as well.
+    begin = offset;
+    if (!file_entry_->extent_tree())
+      begin = std::min(offset, file_entry_->size());
+    range_lock = file_entry_->LockRange(begin, RangeEnd(offset, size));
+    // The file could be truncated before we locked the range.
+    if (file_entry_->extent_tree() || file_entry_->size() >= begin)
+      break;
+  }
+
+  std::vector<FileEntry::DeviceRange> ranges;
+  uint64_t mapped = 0;
+  if (offset + size <= file_entry_->size()) {
+    // Overwriting allocates nothing, so the shared lock is enough.  Unless
+    // appends are pending: the file could grow over their space.
+    std::shared_lock<SharedMutex> lock = file_entry_->LockShared();
+    if (!file_entry_->appending())
+      mapped = file_entry_->MapRange(offset, size, reader_writer_.get(), nullptr, &ranges);
+  }
+  bool reserved = mapped != size;
+  if (reserved) {
+    std::unique_lock<SharedMutex> lock = file_entry_->Lock();
+    // The space reserved for appends isn't published yet, and the appends
+    // don't lock it.
+    file_entry_->ReserveWrite(begin, offset + size, lock);
+    try {
+      if (offset > file_entry_->size() && !file_entry_->extent_tree())
+        file_entry_->Truncate(offset, reader_writer_.get(), allocator_);
+      ranges.clear();
+      file_entry_->MapRange(offset, size, reader_writer_.get(), allocator_, &ranges);
+    }
+    catch (...) {
+      file_entry_->FinishWrite();
+      throw;
+    }
+  }
+
+  // The range lock keeps others off these bytes, so the data is gathered from
+  // the buffers without the file's lock.
+  try {
+    const WriteBuffer* buf = bufs;
+    size_t buf_cursor = 0;
+    for (const FileEntry::DeviceRange& range : ranges) {
+      for (uint64_t done = 0; done != range.size;) {
+        for (; buf_cursor == buf->size; buf_cursor = 0)
+          ++buf;
+        size_t chunk = std::min<uint64_t>(range.size - done, buf->size - buf_cursor);
+        reader_writer_->Write(buf->data + buf_cursor, chunk, range.offset + done);
+        done += chunk;
+        buf_cursor += chunk;
+      }
+    }
+  }
+  catch (...) {
+    if (reserved) {
+      std::unique_lock<SharedMutex> lock = file_entry_->Lock();
+      file_entry_->FinishWrite();
+    }
+    throw;
+  }
+
+  if (reserved || offset + size > file_entry_->size()) {
+    std::unique_lock<SharedMutex> lock = file_entry_->Lock();
+    file_entry_->GrowSize(offset + size);
+    if (reserved)
+      file_entry_->FinishWrite();
+  }
+  // Still under the range lock, see BufferedRead.
+  file_entry_->BumpGeneration();
+}
+
+void FileImpl::FlushWriteBuffer() {
+  if (write_buffer_.empty())
+    return;
+
+  // Now the final size is known, so FileEntry allocates all required space at once.
+  WriteBuffer buf{write_buffer_.data(), write_buffer_.size()};
+  WriteRange(write_buffer_offset_, &buf, buf.size);
+  write_buffer_budget_->Release(write_buffer_.size());
+  write_buffer_.clear();
+}
+
 }  // namespace linfs
 
 }  // namespace fs
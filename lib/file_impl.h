@@ -1,14 +1,21 @@
 #pragma once
 
 #include <atomic>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <vector>
 
 #include "fs/error_code.h"
 #include "fs/file_interface.h"
 #include "lib/entries/file_entry.h"
 #include "lib/section_allocator.h"
+#include "lib/utils/io_executor.h"
+#include "lib/utils/memory_budget.h"
 #include "lib/utils/reader_writer.h"
 
 namespace fs {
@@ -18,9 +25,11 @@ namespace linfs {
 class FileImpl : public FileInterface {
  public:
   FileImpl(std::shared_ptr<FileEntry> file_entry, std::unique_ptr<ReaderWriter> reader_writer,
-           SectionAllocator* allocator)
+           SectionAllocator* allocator, MemoryBudget* write_buffer_budget,
+           IoExecutor* io_executor)
       : cursor_(0), file_entry_(file_entry), reader_writer_(std::move(reader_writer)),
-        allocator_(allocator) {}
+        allocator_(allocator), write_buffer_budget_(write_buffer_budget),
+        io_executor_(io_executor) {}
 
   // File operations:
   size_t Read(char* buf, size_t buf_size, ErrorCode* error_code) override;
@@ -29,14 +38,84 @@ class FileImpl : public FileInterface {
   ErrorCode SetCursor(uint64_t cursor) override;
   uint64_t GetSize() const override;
   void Close() override;
+  ErrorCode SetWriteBuffer(size_t size) override;
+  ErrorCode SetReadBuffer(size_t size) override;
+  void SetVerifyReads(bool verify) override { verify_reads_ = verify; }
+  ErrorCode Flush() override;
+  size_t ReadAt(uint64_t offset, char* buf, size_t buf_size, ErrorCode* error_code) override;
+  size_t WriteAt(uint64_t offset, const char* buf, size_t buf_size,
+                 ErrorCode* error_code) override;
+  ErrorCode Truncate(uint64_t size) override;
+  uint64_t FindData(uint64_t offset, ErrorCode* error_code) override;
+  uint64_t FindHole(uint64_t offset, ErrorCode* error_code) override;
+  uint64_t Append(const char* buf, size_t buf_size, ErrorCode* error_code) override;
+  MappedRange* MapRange(uint64_t offset, uint64_t size, ErrorCode* error_code) override;
+  size_t ReadV(const ReadBuffer* bufs, size_t count, ErrorCode* error_code) override;
+  size_t WriteV(const WriteBuffer* bufs, size_t count, ErrorCode* error_code) override;
+  size_t ReadVAt(uint64_t offset, const ReadBuffer* bufs, size_t count,
+                 ErrorCode* error_code) override;
+  size_t WriteVAt(uint64_t offset, const WriteBuffer* bufs, size_t count,
+                  ErrorCode* error_code) override;
+  ErrorCode ReadAsync(uint64_t offset, char* buf, size_t buf_size,
+                      Completion completion) override;
+  ErrorCode WriteAsync(uint64_t offset, const char* buf, size_t buf_size,
+                       Completion completion) override;
+  MappedFile* Map(ErrorCode* error_code) override;
 
  private:
   virtual ~FileImpl() = default;
 
+  // Reads up to |size| bytes to |bufs| locking only their range of bytes.
+  // Returns the number of read bytes.
+  uint64_t ReadRange(uint64_t offset, const ReadBuffer* bufs, uint64_t size);
+  // Serves the read from |read_buffer_|, which is refilled if it doesn't
+  // contain the range or the file has changed since (see
+  // FileEntry::generation).  Requires |read_buffer_mutex_| be locked.
+  uint64_t BufferedRead(uint64_t offset, const ReadBuffer* bufs, uint64_t size);
+  // Writes |size| bytes of |bufs| locking only their range of bytes (see
+  // FileEntry::LockRange).
+  void WriteRange(uint64_t offset, const WriteBuffer* bufs, uint64_t size);
+  static uint64_t RangeEnd(uint64_t offset, size_t size) {
+    return size > std::numeric_limits<uint64_t>::max() - offset
+               ? std::numeric_limits<uint64_t>::max()
+               : offset + size;
+  }
+
+  // All of them require |write_buffer_mutex_| be locked.
+  uint64_t BufferedSize() const;
+  bool BufferWrite(uint64_t cursor, const WriteBuffer* bufs, size_t count, uint64_t buf_size);
+  void FlushWriteBuffer();
+
+  // Runs |operation| on |io_executor_| and counts it until |completion| returns.
+  ErrorCode SubmitAsync(std::function<size_t(ErrorCode*)> operation, Completion completion);
+
   std::atomic<uint64_t> cursor_;
   std::shared_ptr<FileEntry> file_entry_;
   std::unique_ptr<ReaderWriter> reader_writer_;
   SectionAllocator* allocator_;
+
+  // Data written at |write_buffer_offset_| but not yet flushed to the device.
+  mutable std::mutex write_buffer_mutex_;
+  std::vector<char> write_buffer_;
+  uint64_t write_buffer_offset_ = 0;
+  size_t write_buffer_capacity_ = 0;
+  MemoryBudget* write_buffer_budget_;
+
+  // Data read ahead at |read_buffer_offset_| when the file had
+  // |read_buffer_generation_|.
+  std::mutex read_buffer_mutex_;
+  std::vector<char> read_buffer_;
+  uint64_t read_buffer_offset_ = 0;
+  uint64_t read_buffer_generation_ = 0;
+  bool read_buffer_valid_ = false;
+  size_t read_buffer_capacity_ = 0;
+  std::atomic<bool> verify_reads_{true};
+
+  // Asynchronous operations in flight.
+  IoExecutor* io_executor_;
+  size_t async_pending_ = 0;
+  std::mutex async_mutex_;
+  std::condition_variable async_cv_;
 };
 
 }  // namespace linfs
@@ -28,6 +28,21 @@ DeviceLayout::Header DeviceLayout::ParseHeader(ReaderWriter* reader, ErrorCode&
   from_file.none_entry_offset = ByteOrder::Unpack(from_file.none_entry_offset);
   from_file.root_entry_offset = ByteOrder::Unpack(from_file.root_entry_offset);
   from_file.total_clusters = ByteOrder::Unpack(from_file.total_clusters);
+  from_file.features = ByteOrder::Unpack(from_file.features);
+
+  if (from_file.version.major == 1 && from_file.version.minor < 2) {
+    // The header of v1.1 is shorter.
+    from_file.features = 0;
+    from_file.reserved0 = 0;
+  }
+  else if ((from_file.features & ~kKnownFeatures) != 0) {
+    error_code = ErrorCode::kErrorNotSupported;
+    return from_file;
+  }
+
+  // Devices formatted before data clusters were introduced have only one size.
+  if (from_file.data_cluster_size_log2 == 0)
+    from_file.data_cluster_size_log2 = from_file.cluster_size_log2;
 
   error_code = ErrorCode::kSuccess;
   return from_file;
@@ -38,6 +53,7 @@ void DeviceLayout::WriteHeader(Header header, ReaderWriter* writer) {
   header.none_entry_offset = ByteOrder::Pack(header.none_entry_offset);
   header.root_entry_offset = ByteOrder::Pack(header.root_entry_offset);
   header.total_clusters = ByteOrder::Pack(header.total_clusters);
+  header.features = ByteOrder::Pack(header.features);
 
   writer->Write<DeviceLayout::Header>(header, 0);
 }
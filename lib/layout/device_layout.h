@@ -15,28 +15,54 @@ namespace linfs {
 
 class DeviceLayout {
  public:
+  // Features of v1.2.  Devices which use any of them have version 1.2,
+  // otherwise they are still compatible with v1.1.
+  static constexpr uint32_t kFeatureExtentTree = 1 << 0;  // see ExtentLayout
+  // Set on the first clone of a file (see ExtentLayout::kFlagShared).
+  static constexpr uint32_t kFeatureSharedExtents = 1 << 1;
+  // Set on the first scrub (see ExtentLayout::kFlagChecksum).
+  static constexpr uint32_t kFeatureChecksums = 1 << 2;
+  static constexpr uint32_t kFeatureNameIndex = 1 << 3;  // see IndexLayout
+  // See EntryLayout::kFlagTaggedSlots.
+  static constexpr uint32_t kFeatureTaggedSlots = 1 << 4;
+  static constexpr uint32_t kKnownFeatures = kFeatureExtentTree | kFeatureSharedExtents |
+                                             kFeatureChecksums | kFeatureNameIndex |
+                                             kFeatureTaggedSlots;
+
   PACK(struct alignas(8) Header {
     Header() = default;
-    Header(FilesystemInterface::ClusterSize cluster_size)
-        : cluster_size_log2(static_cast<uint8_t>(cluster_size)) {}
+    Header(const FilesystemInterface::FormatOptions& options)
+        : cluster_size_log2(static_cast<uint8_t>(options.cluster_size)),
+          data_cluster_size_log2(static_cast<uint8_t>(options.data_cluster_size)),
+          features((options.extent_tree ? kFeatureExtentTree : 0) |
+                   (options.name_index ? kFeatureNameIndex : 0) |
+                   (options.tagged_slots ? kFeatureTaggedSlots : 0)) {
+      version.minor = features != 0 ? 2 : 1;
+    }
     // ---
     char identifier[8] = {'\0', 'f', 'i', 'l', 'e', 'f', 's', '='};  // fs code
     PACK(struct {
       uint8_t major = 1;
-      uint8_t minor = 1;
+      uint8_t minor = 2;
     }) version;                   // version (for backward compatibility)
     uint8_t cluster_size_log2;    // 2^n is actual cluster size
-    uint8_t reserved0 = 0;        // reserved for future usage (but actually I'm
-                                  // worry about alignment on ARM/SPARC etc.)
+    uint8_t data_cluster_size_log2;  // 2^n is actual cluster size for file data
+                                     // (0 in old devices, means |cluster_size_log2|)
     uint16_t none_entry_offset =  // location of none entry in the file
         sizeof(Header) + offsetof(Body, none_entry);
     uint16_t root_entry_offset =  // location of "/" entry
         sizeof(Header) + offsetof(Body, root.entry);
     uint64_t total_clusters = 1;  // total number of allocated clusters
+    uint32_t features = 0;        // kFeature* flags (since v1.2, v1.1 devices
+                                  // have the none entry here)
+    uint32_t reserved0 = 0;       // reserved for future usage
   });
   static_assert(SIZEOF_MEMBER(Header, cluster_size_log2) ==
                     sizeof(FilesystemInterface::ClusterSize),
                 "DeviceLayout::Header requires ClusterSize be of size uint8_t");
+  static_assert(SIZEOF_MEMBER(Header, data_cluster_size_log2) ==
+                    sizeof(FilesystemInterface::ClusterSize),
+                "DeviceLayout::Header requires ClusterSize be of size uint8_t");
   STATIC_ASSERT_STANDARD_LAYOUT_AND_TRIVIALLY_COPYABLE(Header);
 
   // The device's body looks as follows, and is used only to calculate offsets:
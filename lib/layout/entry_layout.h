@@ -15,15 +15,32 @@ namespace linfs {
 class EntryLayout {
   // Common header
   PACK(struct _Header {
-    _Header(Entry::Type _type) : type(static_cast<uint8_t>(_type)) {}
+    _Header(Entry::Type _type, uint8_t _flags = 0)
+        : type(static_cast<uint8_t>(_type)), flags(_flags) {}
     // ---
     uint8_t type;                // type of this section
-    uint8_t reserved0[7] = {0};  // say hello ARM64
+    uint8_t flags;               // type specific flags (0 in v1.1)
+    uint8_t reserved0[6] = {0};  // say hello ARM64
   });
   static_assert(SIZEOF_MEMBER(_Header, type) == sizeof(Entry::Type),
                 "EntryLayout::_Header requires Entry::Type be of size uint8_t");
 
  public:
+  // Flags of FileHeader:
+  static constexpr uint8_t kFlagExtentTree = 1 << 0;  // data is indexed by ExtentLayout (v1.2)
+  // Flags of DirectoryHeader:
+  static constexpr uint8_t kFlagNameIndex = 1 << 0;   // names are hashed by IndexLayout (v1.2)
+  static constexpr uint8_t kFlagTaggedSlots = 1 << 1; // slots are tagged, see below (v1.2)
+
+  // Offsets of entries are multiples of 16 and less than 2^48, so slots of
+  // directories with kFlagTaggedSlots also keep the entry's type in bits 1-3
+  // and the high 16 bits of its name's hash (see DirectoryIndex::Hash) in
+  // bits 48-63.  Lookups load only the entries with the same fingerprint.
+  static constexpr uint64_t kSlotOffsetMask = 0x0000fffffffffff0;
+  static constexpr int kSlotTypeShift = 1;
+  static constexpr uint64_t kSlotTypeMask = 0x7;
+  static constexpr int kSlotFingerprintShift = 48;
+
   PACK(struct alignas(8) NoneHeader {
     NoneHeader(uint64_t _head_offset) : head_offset(_head_offset) {}
     // ---
@@ -33,21 +50,23 @@ class EntryLayout {
   STATIC_ASSERT_STANDARD_LAYOUT_AND_TRIVIALLY_COPYABLE(NoneHeader);
 
   PACK(struct DirectoryHeader {
-    DirectoryHeader(const char* _name) {
+    DirectoryHeader(const char* _name, uint8_t _flags = 0)
+        : common(Entry::Type::kDirectory, _flags) {
       strncpy(name, _name, sizeof name);
     }
     // ---
-    _Header common{Entry::Type::kDirectory};
+    _Header common;
     char name[kNameMax];         // directory name
   });
   STATIC_ASSERT_STANDARD_LAYOUT_AND_TRIVIALLY_COPYABLE(DirectoryHeader);
 
   PACK(struct alignas(8) FileHeader {
-    FileHeader(uint64_t _size, const char* _name) : size(_size) {
+    FileHeader(uint64_t _size, const char* _name, uint8_t _flags = 0)
+        : common(Entry::Type::kFile, _flags), size(_size) {
       strncpy(name, _name, sizeof name);
     }
     // ---
-    _Header common{Entry::Type::kFile};
+    _Header common;
     uint64_t size;               // file size
     char name[kNameMax];         // file name
   });
@@ -75,7 +94,8 @@ class EntryLayout {
 
   // The directory's body looks like:
   // struct BodyDirectory {
-  //   uint64_t entries_offsets[];
+  //  [IndexLayout::Header index;] -- if kFlagNameIndex
+  //   uint64_t entries_offsets[];  -- 0 for free slots, or tagged
   // };
   //
   // file's body is:
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+
+#include "lib/utils/macros.h"
+
+namespace fs {
+
+namespace linfs {
+
+// Files with the extent tree (see DeviceLayout::kFeatureExtentTree) store
+// their data in separate sections, which are indexed by a B+tree.  The root
+// node follows EntryLayout::FileHeader in the file's first section, other
+// nodes take one section each.
+class ExtentLayout {
+ public:
+  // The extent's section may be shared with other files (see
+  // DeviceLayout::kFeatureSharedExtents).  Then the |next_offset| field of
+  // the section's header counts the other references, and writers copy the
+  // data they change to a section of their own first, splitting the extent
+  // around it.
+  static constexpr uint32_t kFlagShared = 1 << 0;
+  // |checksums_offset| is valid (see DeviceLayout::kFeatureChecksums).
+  // Writers of the extent clear the flag and release the section.
+  static constexpr uint32_t kFlagChecksum = 1 << 1;
+
+  // Every chunk of this many bytes of the file has a checksum of its own in
+  // each extent it overlaps, so readers check only the chunks they read.
+  // The chunks are aligned to the file offsets, so the first and the last
+  // chunk of an extent may be shorter.
+  static constexpr uint64_t kChecksumChunk = 4096;
+
+  PACK(struct alignas(8) NodeHeader {
+    uint16_t level;              // height above the leaves, 0 for leaves
+    uint16_t count;              // number of used entries
+    uint8_t reserved0[4] = {0};  // reserved for future usage
+  });
+  STATIC_ASSERT_STANDARD_LAYOUT_AND_TRIVIALLY_COPYABLE(NodeHeader);
+
+  PACK(struct alignas(8) Entry {
+    uint64_t file_offset;        // the extent's (or the child's first) offset in the file
+    uint64_t section_offset;     // section with the extent's data (or the child node)
+    uint64_t data_offset;        // offset of the extent's data in the section's data
+    uint64_t length;             // number of file bytes in the extent, 0 for nodes
+    uint64_t checksums_offset;   // section with the checksums if kFlagChecksum
+    uint32_t flags;              // kFlag* flags, 0 for nodes
+    uint8_t reserved0[4] = {0};  // reserved for future usage
+  });
+  STATIC_ASSERT_STANDARD_LAYOUT_AND_TRIVIALLY_COPYABLE(Entry);
+
+  // The section of the checksums is metadata.  Clones share it like the data
+  // (see kFlagShared), and its data looks like:
+  // uint32_t checksums[];  -- CRC-32C of every kChecksumChunk bytes
+
+  // The node's body looks like:
+  // struct Node {
+  //   NodeHeader header;
+  //   Entry entries[];  -- sorted by |file_offset|
+  // };
+};
+
+}  // namespace linfs
+
+}  // namespace fs
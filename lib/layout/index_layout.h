@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+
+#include "lib/utils/macros.h"
+
+namespace fs {
+
+namespace linfs {
+
+// Directories with the name index (see DeviceLayout::kFeatureNameIndex) keep
+// the offsets of their entries in the usual slots, but also hash the entries'
+// names into an open addressing table, so a lookup doesn't load every entry.
+// The index header follows EntryLayout::DirectoryHeader in the directory's
+// first section, the table takes one contiguous section.  If there is no room
+// for a bigger table, it's dropped and lookups scan the slots until there is.
+class IndexLayout {
+ public:
+  // Free slots of such directories are linked in a list.  Each of them holds
+  // the offset of the next free slot (0 for the last one) with this bit set,
+  // since offsets of entries are always even.
+  static constexpr uint64_t kFreeSlot = 1;
+
+  PACK(struct alignas(8) Header {
+    uint64_t table_offset;   // section with the table, 0 if there are no entries or
+                             // if the table was dropped
+    uint64_t capacity;       // number of records in the table (power of 2)
+    uint64_t count;          // number of used slots, which is that of used records
+                             // while there is the table
+    uint64_t free_slot;      // offset of the first free slot, 0 if there are none
+    uint64_t last_section;   // the directory's last section, new ones follow it
+  });
+  STATIC_ASSERT_STANDARD_LAYOUT_AND_TRIVIALLY_COPYABLE(Header);
+
+  PACK(struct alignas(8) Record {
+    uint64_t entry_offset;   // 0 for unused records
+    uint64_t slot_offset;    // the slot which holds |entry_offset|
+    uint32_t hash;           // hash of the entry's name
+    uint32_t reserved0;      // reserved for future usage
+  });
+  STATIC_ASSERT_STANDARD_LAYOUT_AND_TRIVIALLY_COPYABLE(Record);
+
+  // The table's body looks like:
+  // struct Table {
+  //   Record records[];  -- a record lives at |hash % capacity| or after it
+  // };
+};
+
+}  // namespace linfs
+
+}  // namespace fs
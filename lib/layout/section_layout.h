@@ -12,7 +12,8 @@ class SectionLayout {
  public:
   PACK(struct alignas(8) Header {
     uint64_t size;         // size of this section
-    uint64_t next_offset;  // offset of the next section
+    uint64_t next_offset;  // offset of the next section (or the reference count
+                           // of a shared section, see ExtentLayout::kFlagShared)
   });
   STATIC_ASSERT_STANDARD_LAYOUT_AND_TRIVIALLY_COPYABLE(Header);
 
@@ -2,14 +2,22 @@
 
 #include <cassert>
 #include <cstddef>
+#include <cstring>
 #include <exception>
+#include <limits>
 #include <memory>
+#include <string>
 #include <utility>
+#include <vector>
 
+#include "fs/limits.h"
+#include "lib/deduplicator.h"
 #include "lib/entries/entry.h"
 #include "lib/entries/symlink_entry.h"
 #include "lib/file_impl.h"
 #include "lib/layout/device_layout.h"
+#include "lib/scrubber.h"
+#include "lib/utils/bloom_filter.h"
 #include "lib/utils/exception_handler.h"
 
 namespace fs {
@@ -32,6 +40,12 @@ uint64_t ToBytes(uint8_t cluster_size) {
   return 1ULL << cluster_size;
 }
 
+// Returns EntryLayout flags of new directories on the device with |features|.
+uint8_t DirectoryFlags(uint32_t features) {
+  return ((features & DeviceLayout::kFeatureNameIndex) != 0 ? EntryLayout::kFlagNameIndex : 0) |
+         ((features & DeviceLayout::kFeatureTaggedSlots) != 0 ? EntryLayout::kFlagTaggedSlots : 0);
+}
+
 }  // namespace
 
 void LinFS::Release() {
@@ -46,12 +60,11 @@ std::unique_ptr<T> LinFS::CreateEntry(DirectoryEntry* cwd, ErrorCode& error_code
     return nullptr;
   }
 
-  Section place = allocator_->AllocateSection(1, accessor_.get());
+  Section place = allocator_->AllocateSection(1, Entry::Type::kNone, accessor_.get());
   try {
     std::unique_ptr<T> entry = T::Create(place.data_offset(), place.data_size(),
-                                         accessor_.get(), std::move(name),
-                                         std::forward<Args>(args)...);
-    cwd->AddEntry(entry.get(), accessor_.get(), allocator_.get());
+                                         accessor_.get(), name, std::forward<Args>(args)...);
+    AddEntry(cwd, entry.get(), name);
     return entry;
   }
   catch (...) {
@@ -61,10 +74,102 @@ std::unique_ptr<T> LinFS::CreateEntry(DirectoryEntry* cwd, ErrorCode& error_code
 }
 
 void LinFS::ReleaseEntry(std::unique_ptr<Entry>& entry) noexcept {
-  allocator_->ReleaseSection(entry->section_offset(), accessor_.get());
+  entry->Release(accessor_.get(), allocator_.get());
   entry.reset();
 }
 
+bool LinFS::LookupEntry(DirectoryEntry* dir, const char* name, DentryCache::Dentry* dentry,
+                        std::unique_ptr<Entry>* entry) {
+  DentryCache::Result result = dentries_.Find(dir->base_offset(), name, dentry);
+  if (result == DentryCache::Result::kFound)
+    return true;
+  if (result == DentryCache::Result::kNotFound)
+    return false;
+
+  if (result == DentryCache::Result::kMaybe || dir->name_index() || !dentries_.enabled()) {
+    // The index finds the entry quickly, so remember just it.  The same for
+    // directories which are too big to remember, scanning them again is no
+    // faster.
+    std::unique_ptr<Entry> found = dir->FindEntryByName(name, accessor_.get());
+    if (found == nullptr)
+      return false;
+    *dentry = DentryCache::Dentry{found->base_offset(), found->type()};
+    dentries_.Add(dir->base_offset(), name, *dentry);
+    if (entry != nullptr)
+      *entry = std::move(found);
+    return true;
+  }
+
+  // Otherwise a miss scans the whole directory anyway, so remember all of its
+  // entries or at least filter their names if they don't fit in the budget.
+  std::vector<std::pair<std::string, DentryCache::Dentry>> dentries;
+  std::vector<uint64_t> hashes;
+  uint64_t size = 0;
+  bool complete = true, found = false;
+  dir->ForEachEntry(accessor_.get(), [&](std::unique_ptr<Entry> it_entry, const char* it_name) {
+    DentryCache::Dentry it_dentry{it_entry->base_offset(), it_entry->type()};
+    hashes.push_back(BloomFilter::Hash(it_name));
+    if (!found && strcmp(name, it_name) == 0) {
+      found = true;
+      *dentry = it_dentry;
+      if (entry != nullptr)
+        *entry = std::move(it_entry);
+    }
+    if (complete) {
+      dentries.emplace_back(it_name, it_dentry);
+      size += DentryCache::DentrySize(dentries.back().first);
+      complete = size <= dentries_.limit();
+    }
+    if (!complete)
+      dentries.clear();
+  });
+
+  if (complete)
+    dentries_.Fill(dir->base_offset(), dentries);
+  else
+    dentries_.FillFilter(dir->base_offset(), hashes);
+  return found;
+}
+
+void LinFS::AddEntry(DirectoryEntry* dir, const Entry* entry, const char* name) {
+  try {
+    dir->AddEntry(entry, name, accessor_.get(), allocator_.get());
+  }
+  catch (...) {
+    // The directory could have been changed partially.
+    dentries_.Forget(dir->base_offset());
+    throw;
+  }
+  dentries_.Add(dir->base_offset(), name, DentryCache::Dentry{entry->base_offset(), entry->type()});
+}
+
+bool LinFS::RemoveEntry(DirectoryEntry* dir, const Entry* entry, const char* name) {
+  bool success;
+  try {
+    success = dir->RemoveEntry(entry, name, accessor_.get(), allocator_.get());
+  }
+  catch (...) {
+    dentries_.Forget(dir->base_offset());
+    throw;
+  }
+  if (success) {
+    dentries_.Remove(dir->base_offset(), name);
+    if (entry->type() == Entry::Type::kDirectory)
+      dentries_.Forget(entry->base_offset());
+  }
+  return success;
+}
+
+std::unique_ptr<Entry> LinFS::FindEntry(DirectoryEntry* dir, const char* name) {
+  DentryCache::Dentry dentry;
+  std::unique_ptr<Entry> entry;
+  if (!LookupEntry(dir, name, &dentry, &entry))
+    return nullptr;
+  if (entry == nullptr)
+    entry = Entry::Load(dentry.offset, accessor_.get());
+  return entry;
+}
+
 std::shared_ptr<DirectoryEntry> LinFS::GetDirectory(Path path, ErrorCode& error_code) {
   std::shared_ptr<DirectoryEntry> dir = root_entry_, next_dir;
   int symlink_depth = 0;
@@ -72,8 +177,7 @@ std::shared_ptr<DirectoryEntry> LinFS::GetDirectory(Path path, ErrorCode& error_
   for (; !path.Empty(); dir = std::move(next_dir)) {
     std::shared_lock<SharedMutex> lock = dir->LockShared();
 
-    std::unique_ptr<Entry> entry = dir->FindEntryByName(path.FirstName(),
-                                                        accessor_.get());
+    std::unique_ptr<Entry> entry = FindEntry(dir.get(), path.FirstName());
     if (entry == nullptr) {
       error_code = ErrorCode::kErrorNotFound;
       return nullptr;
@@ -110,6 +214,51 @@ std::shared_ptr<DirectoryEntry> LinFS::GetDirectory(Path path, ErrorCode& error_
   return dir;
 }
 
+std::shared_ptr<FileEntry> LinFS::GetFile(Path path, ErrorCode& error_code) {
+  int symlink_depth = 0;
+  while (1) {
+    std::shared_ptr<DirectoryEntry> cwd = GetDirectory(path.DirectoryName(), error_code);
+    if (cwd == nullptr)
+      return nullptr;
+
+    std::shared_lock<SharedMutex> lock = cwd->LockShared();
+
+    std::unique_ptr<Entry> entry = FindEntry(cwd.get(), path.BaseName());
+    if (entry == nullptr) {
+      error_code = ErrorCode::kErrorNotFound;
+      return nullptr;
+    }
+    if (entry->type() == Entry::Type::kSymlink) {
+      if (++symlink_depth >= kSymlinkDepthMax) {
+        error_code = ErrorCode::kErrorSymlinkDepth;
+        return nullptr;
+      }
+      path = entry->As<SymlinkEntry>()->GetTarget(accessor_.get());
+      continue;
+    }
+    if (entry->type() != Entry::Type::kFile) {
+      error_code = ErrorCode::kErrorIsDirectory;
+      return nullptr;
+    }
+
+    // See GetDirectory why it must be done in the locked directory.
+    return static_pointer_cast<FileEntry>(cache_.GetSharedEntry(std::move(entry)));
+  }
+}
+
+bool LinFS::EnableFeature(uint32_t feature) {
+  std::lock_guard<std::mutex> lock(features_mutex_);
+
+  // The header of v1.1 ends before the features, the none entry is there.
+  if (!has_features_)
+    return false;
+  if ((features_ & feature) != 0)
+    return true;
+  accessor_->Write<uint32_t>(features_ | feature, offsetof(DeviceLayout::Header, features));
+  features_ |= feature;
+  return true;
+}
+
 ErrorCode LinFS::Load(const char* device_path) {
   assert(device_path != nullptr);
 
@@ -130,10 +279,15 @@ ErrorCode LinFS::Load(const char* device_path) {
     std::unique_ptr<NoneEntry> none_entry = static_pointer_cast<NoneEntry>(
         Entry::Load(header.none_entry_offset, accessor_.get()));
     allocator_ = std::make_unique<SectionAllocator>(ToBytes(header.cluster_size_log2),
+                                                    ToBytes(header.data_cluster_size_log2),
                                                     uint64_t(header.total_clusters),
                                                     std::move(none_entry));
     root_entry_ = static_pointer_cast<DirectoryEntry>(
         Entry::Load(header.root_entry_offset, accessor_.get()));
+    extent_tree_ = (header.features & DeviceLayout::kFeatureExtentTree) != 0;
+    directory_flags_ = DirectoryFlags(header.features);
+    features_ = header.features;
+    has_features_ = header.version.major > 1 || header.version.minor >= 2;
     return ErrorCode::kSuccess;
   }
   catch (...) {
@@ -145,9 +299,23 @@ ErrorCode LinFS::Load(const char* device_path) {
 }
 
 ErrorCode LinFS::Format(const char* device_path, ClusterSize cluster_size) const {
+  FormatOptions options;
+  options.cluster_size = cluster_size;
+  options.data_cluster_size = cluster_size;
+  return Format(device_path, options);
+}
+
+ErrorCode LinFS::Format(const char* device_path, const FormatOptions& options) const {
   assert(device_path != nullptr);
 
-  DeviceLayout::Header header(cluster_size);
+  // Metadata clusters are limited by the 16-bit offsets in the device header,
+  // and data clusters must consist of whole metadata clusters.
+  if (options.cluster_size < ClusterSize::k512B || options.cluster_size > ClusterSize::k4KB ||
+      options.data_cluster_size < options.cluster_size ||
+      options.data_cluster_size > ClusterSize::k1MB)
+    return ErrorCode::kErrorNotSupported;
+
+  DeviceLayout::Header header(options);
   DeviceLayout::Body body(header);
   try {
     std::unique_ptr<ReaderWriter> writer(
@@ -160,7 +328,142 @@ ErrorCode LinFS::Format(const char* device_path, ClusterSize cluster_size) const
         Section::Create(header.root_entry_offset - sizeof body.root.section,
                         body.root.section.size, writer.get());
     DirectoryEntry::Create(header.root_entry_offset, root_section.data_size(),
-                           writer.get(), "/");
+                           writer.get(), "/", DirectoryFlags(header.features));
+    return ErrorCode::kSuccess;
+  }
+  catch (...) {
+    return ExceptionHandler::ToErrorCode(std::current_exception());
+  }
+}
+
+ErrorCode LinFS::StartDefragmenter(const DefragmenterOptions& options) {
+  assert(accessor_ && "filesystem isn't loaded");
+
+  if (defragmenter_)
+    return ErrorCode::kErrorBusy;
+
+  try {
+    std::unique_ptr<Defragmenter> defragmenter(
+        new Defragmenter(accessor_->Duplicate(), allocator_.get(), &cache_, root_entry_,
+                         options));
+    defragmenter->Start();
+    defragmenter_ = std::move(defragmenter);
+    return ErrorCode::kSuccess;
+  }
+  catch (...) {
+    return ExceptionHandler::ToErrorCode(std::current_exception());
+  }
+}
+
+void LinFS::StopDefragmenter() {
+  defragmenter_.reset();
+}
+
+ErrorCode LinFS::Defragment(const DefragmenterOptions& options) {
+  assert(accessor_ && "filesystem isn't loaded");
+
+  try {
+    Defragmenter(accessor_->Duplicate(), allocator_.get(), &cache_, root_entry_,
+                 options).RunPass();
+    return ErrorCode::kSuccess;
+  }
+  catch (...) {
+    return ExceptionHandler::ToErrorCode(std::current_exception());
+  }
+}
+
+ErrorCode LinFS::Deduplicate(uint64_t* released) {
+  assert(accessor_ && "filesystem isn't loaded");
+
+  try {
+    // Only the extent tree can share data, and only v1.2 devices have it.
+    if (!extent_tree_ || !EnableFeature(DeviceLayout::kFeatureSharedExtents))
+      return ErrorCode::kErrorNotSupported;
+    uint64_t released_bytes =
+        Deduplicator(accessor_->Duplicate(), allocator_.get(), &cache_, root_entry_).RunPass();
+    if (released != nullptr)
+      *released = released_bytes;
+    return ErrorCode::kSuccess;
+  }
+  catch (...) {
+    return ExceptionHandler::ToErrorCode(std::current_exception());
+  }
+}
+
+ErrorCode LinFS::Scrub(uint64_t* corrupted) {
+  assert(accessor_ && "filesystem isn't loaded");
+
+  try {
+    // Only the extent tree has checksums, and only v1.2 devices have it.
+    if (!extent_tree_ || !EnableFeature(DeviceLayout::kFeatureChecksums))
+      return ErrorCode::kErrorNotSupported;
+    uint64_t corrupted_extents =
+        Scrubber(accessor_->Duplicate(), allocator_.get(), &cache_, root_entry_).RunPass();
+    if (corrupted != nullptr)
+      *corrupted = corrupted_extents;
+    return ErrorCode::kSuccess;
+  }
+  catch (...) {
+    return ExceptionHandler::ToErrorCode(std::current_exception());
+  }
+}
+
+void LinFS::SetWriteBufferBudget(uint64_t size) {
+  write_buffer_budget_.SetLimit(size);
+}
+
+void LinFS::SetDirectoryCacheBudget(uint64_t size) {
+  dentries_.SetLimit(size);
+}
+
+ErrorCode LinFS::GetStats(Stats* stats) {
+  assert(stats != nullptr);
+  assert(accessor_ && "filesystem isn't loaded");
+
+  try {
+    // Don't count the requests of GetStats itself.
+    uint64_t reads = accessor_->reads(), writes = accessor_->writes();
+    allocator_->GetStats(stats, accessor_.get());
+    stats->device_reads = reads;
+    stats->device_writes = writes;
+    return ErrorCode::kSuccess;
+  }
+  catch (...) {
+    return ExceptionHandler::ToErrorCode(std::current_exception());
+  }
+}
+
+ErrorCode LinFS::GetStats(const char* path_cstr, EntryStats* stats) {
+  assert(path_cstr != nullptr && stats != nullptr);
+
+  ErrorCode error_code;
+  try {
+    Path path = Path::Normalize(path_cstr, error_code);
+    if (error_code != ErrorCode::kSuccess)
+      return error_code;
+
+    std::shared_ptr<Entry> entry = GetDirectory(path.DirectoryName(), error_code);
+    if (entry == nullptr)
+      return error_code;
+
+    if (path.BaseName()) {
+      std::shared_lock<SharedMutex> lock = entry->LockShared();
+
+      std::unique_ptr<Entry> child = FindEntry(entry->As<DirectoryEntry>(), path.BaseName());
+      if (child == nullptr)
+        return ErrorCode::kErrorNotFound;
+      // The entry could be open, so use the shared one with its lock.
+      entry = cache_.GetSharedEntry(std::move(child));
+    }
+
+    std::shared_lock<SharedMutex> lock = entry->LockShared();
+    uint64_t sections_size;
+    *stats = EntryStats();
+    stats->sections = entry->CountSections(accessor_.get(), &sections_size);
+    stats->average_section_size = sections_size / stats->sections;
+    if (entry->type() == Entry::Type::kDirectory)
+      stats->slots = entry->As<DirectoryEntry>()->CountSlots(accessor_.get(),
+                                                             &stats->used_slots);
     return ErrorCode::kSuccess;
   }
   catch (...) {
@@ -187,9 +490,9 @@ FileInterface* LinFS::OpenFile(const char* path_cstr, bool creat_excl, ErrorCode
 
       std::unique_lock<SharedMutex> lock = cwd->Lock();
 
-      std::unique_ptr<Entry> entry = cwd->FindEntryByName(path.BaseName(), accessor_.get());
+      std::unique_ptr<Entry> entry = FindEntry(cwd.get(), path.BaseName());
       if (!entry) {
-        entry = CreateEntry<FileEntry>(cwd.get(), *error_code, path.BaseName());
+        entry = CreateEntry<FileEntry>(cwd.get(), *error_code, path.BaseName(), extent_tree_);
         if (entry == nullptr)
           // |error_code| has already been set in CreateEntry().
           return nullptr;
@@ -215,7 +518,8 @@ FileInterface* LinFS::OpenFile(const char* path_cstr, bool creat_excl, ErrorCode
 
       std::shared_ptr<FileEntry> shared_file =
           static_pointer_cast<FileEntry>(cache_.GetSharedEntry(std::move(entry)));
-      return new FileImpl(shared_file, accessor_->Duplicate(), allocator_.get());
+      return new FileImpl(shared_file, accessor_->Duplicate(), allocator_.get(),
+                          &write_buffer_budget_, &io_executor_);
     }
   }
   catch (...) {
@@ -239,10 +543,11 @@ ErrorCode LinFS::CreateDirectory(const char* path_cstr) {
 
     std::unique_lock<SharedMutex> lock = cwd->Lock();
 
-    if (cwd->FindEntryByName(path.BaseName(), accessor_.get()))
+    DentryCache::Dentry dentry;
+    if (LookupEntry(cwd.get(), path.BaseName(), &dentry))
       return ErrorCode::kErrorExists;
 
-    if (!CreateEntry<DirectoryEntry>(cwd.get(), error_code, path.BaseName()))
+    if (!CreateEntry<DirectoryEntry>(cwd.get(), error_code, path.BaseName(), directory_flags_))
       return error_code;
     return ErrorCode::kSuccess;
   }
@@ -294,7 +599,8 @@ ErrorCode LinFS::CreateSymlink(const char* path_cstr, const char* target_cstr) {
 
     std::unique_lock<SharedMutex> lock = cwd->Lock();
 
-    if (cwd->FindEntryByName(path.BaseName(), accessor_.get()))
+    DentryCache::Dentry dentry;
+    if (LookupEntry(cwd.get(), path.BaseName(), &dentry))
       return ErrorCode::kErrorExists;
 
     if (!CreateEntry<SymlinkEntry>(cwd.get(), error_code, path.BaseName(),
@@ -322,7 +628,7 @@ ErrorCode LinFS::Remove(const char* path_cstr) {
 
     std::unique_lock<SharedMutex> lock = cwd->Lock();
 
-    std::unique_ptr<Entry> entry = cwd->FindEntryByName(path.BaseName(), accessor_.get());
+    std::unique_ptr<Entry> entry = FindEntry(cwd.get(), path.BaseName());
     if (entry == nullptr)
       return ErrorCode::kErrorNotFound;
     if (cache_.EntryIsShared(entry.get()))
@@ -336,8 +642,7 @@ ErrorCode LinFS::Remove(const char* path_cstr) {
       if (has_entries)
         return ErrorCode::kErrorDirectoryNotEmpty;
     }
-    bool success = cwd->RemoveEntry(entry.get(), accessor_.get(), allocator_.get());
-    if (!success)
+    if (!RemoveEntry(cwd.get(), entry.get(), path.BaseName()))
       return ErrorCode::kErrorFormat;
     ReleaseEntry(entry);
     return ErrorCode::kSuccess;
@@ -347,6 +652,92 @@ ErrorCode LinFS::Remove(const char* path_cstr) {
   }
 }
 
+ErrorCode LinFS::CopyFile(const char* src_cstr, const char* dst_cstr, CopyMode mode) {
+  assert(src_cstr != nullptr && dst_cstr != nullptr);
+
+  ErrorCode error_code;
+  try {
+    Path src = Path::Normalize(src_cstr, error_code);
+    if (error_code != ErrorCode::kSuccess)
+      return error_code;
+
+    Path dst = Path::Normalize(dst_cstr, error_code);
+    if (error_code != ErrorCode::kSuccess)
+      return error_code;
+    if (!dst.BaseName())
+      return ErrorCode::kErrorNotFound;
+
+    std::shared_ptr<FileEntry> source = GetFile(src, error_code);
+    if (source == nullptr)
+      return error_code;
+
+    std::shared_ptr<DirectoryEntry> cwd = GetDirectory(dst.DirectoryName(), error_code);
+    if (cwd == nullptr)
+      return error_code;
+    {
+      // Don't copy in vain.
+      std::shared_lock<SharedMutex> lock = cwd->LockShared();
+      DentryCache::Dentry dentry;
+      if (LookupEntry(cwd.get(), dst.BaseName(), &dentry))
+        return ErrorCode::kErrorExists;
+    }
+
+    // The copy is filled before it's added to the directory, so nobody sees
+    // it half-done and the directory isn't locked meanwhile.
+    Section place = allocator_->AllocateSection(1, Entry::Type::kNone, accessor_.get());
+    std::unique_ptr<Entry> copy;
+    try {
+      copy = FileEntry::Create(place.data_offset(), place.data_size(), accessor_.get(),
+                               dst.BaseName(), source->extent_tree());
+    }
+    catch (...) {
+      allocator_->ReleaseSection(place, accessor_.get());
+      throw;
+    }
+
+    try {
+      {
+        // Writers of the source must finish first.  See FileImpl::WriteRange.
+        RangeLock::Guard range_lock =
+            source->LockRangeShared(0, std::numeric_limits<uint64_t>::max());
+        bool cloned = false;
+        if (mode == CopyMode::kClone && source->extent_tree() &&
+            EnableFeature(DeviceLayout::kFeatureSharedExtents)) {
+          std::unique_lock<SharedMutex> lock = source->Lock();
+          source->WaitForAppends(lock);
+          // The mappings change the data in place, so it can't be shared.
+          if (!source->mapped()) {
+            copy->As<FileEntry>()->CloneData(source.get(), accessor_.get(), allocator_.get());
+            // The source's extents are shared now.  See Defragmenter::DefragmentFile.
+            source->BumpGeneration();
+            cloned = true;
+          }
+        }
+        if (!cloned) {
+          std::shared_lock<SharedMutex> lock = source->LockShared();
+          copy->As<FileEntry>()->CopyData(source.get(), accessor_.get(), allocator_.get());
+        }
+      }
+
+      std::unique_lock<SharedMutex> lock = cwd->Lock();
+      DentryCache::Dentry dentry;
+      if (LookupEntry(cwd.get(), dst.BaseName(), &dentry)) {
+        ReleaseEntry(copy);
+        return ErrorCode::kErrorExists;
+      }
+      AddEntry(cwd.get(), copy.get(), dst.BaseName());
+    }
+    catch (...) {
+      ReleaseEntry(copy);
+      throw;
+    }
+    return ErrorCode::kSuccess;
+  }
+  catch (...) {
+    return ExceptionHandler::ToErrorCode(std::current_exception());
+  }
+}
+
 bool LinFS::IsFile(const char* path_cstr, ErrorCode* error_code) {
   return IsType(path_cstr, error_code, Entry::Type::kFile);
 }
@@ -374,13 +765,13 @@ bool LinFS::IsType(const char* path_cstr, ErrorCode* error_code, Entry::Type typ
 
     std::shared_lock<SharedMutex> lock = cwd->LockShared();
 
-    std::unique_ptr<Entry> entry = cwd->FindEntryByName(path.BaseName(), accessor_.get());
-    if (entry == nullptr) {
+    DentryCache::Dentry dentry;
+    if (!LookupEntry(cwd.get(), path.BaseName(), &dentry)) {
       *error_code = ErrorCode::kErrorNotFound;
       return false;
     }
     // |error_code| has already been set to ErrorCode::kSuccess in Path::Normalize().
-    return entry->type() == type;
+    return dentry.type == type;
   }
   catch (...) {
     *error_code = ExceptionHandler::ToErrorCode(std::current_exception());
@@ -1,12 +1,20 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <mutex>
 
 #include "fs/error_code.h"
 #include "fs/filesystem_interface.h"
+#include "lib/defragmenter.h"
+#include "lib/dentry_cache.h"
 #include "lib/entries/directory_entry.h"
 #include "lib/entries/entry.h"
+#include "lib/entries/file_entry.h"
 #include "lib/entry_cache.h"
+#include "lib/utils/io_executor.h"
+#include "lib/utils/memory_budget.h"
 #include "lib/utils/path.h"
 #include "lib/utils/reader_writer.h"
 #include "lib/section_allocator.h"
@@ -21,6 +29,16 @@ class LinFS : public FilesystemInterface {
   void Release() override;
   ErrorCode Load(const char* device_path) override;
   ErrorCode Format(const char* device_path, ClusterSize cluster_size) const override;
+  ErrorCode Format(const char* device_path, const FormatOptions& options) const override;
+  ErrorCode StartDefragmenter(const DefragmenterOptions& options) override;
+  void StopDefragmenter() override;
+  ErrorCode Defragment(const DefragmenterOptions& options) override;
+  ErrorCode Deduplicate(uint64_t* released) override;
+  ErrorCode Scrub(uint64_t* corrupted) override;
+  void SetWriteBufferBudget(uint64_t size) override;
+  void SetDirectoryCacheBudget(uint64_t size) override;
+  ErrorCode GetStats(Stats* stats) override;
+  ErrorCode GetStats(const char* path, EntryStats* stats) override;
 
   // Filesystem operations:
   FileInterface* OpenFile(const char* path, bool creat_excl, ErrorCode* error_code) override;
@@ -32,6 +50,7 @@ class LinFS : public FilesystemInterface {
   bool IsFile(const char* path, ErrorCode* error_code) override;
   bool IsDirectory(const char* path, ErrorCode* error_code) override;
   bool IsSymlink(const char* path, ErrorCode* error_code) override;
+  ErrorCode CopyFile(const char* src, const char* dst, CopyMode mode) override;
 
  private:
   virtual ~LinFS() = default;
@@ -41,13 +60,46 @@ class LinFS : public FilesystemInterface {
                                  Path::Name&& name, Args&&... args);
   void ReleaseEntry(std::unique_ptr<Entry>& entry) noexcept;
 
+  // Both look |name| up in the dentry cache first and must be called in the
+  // locked directory.  LookupEntry loads the entry only if it has to read the
+  // device anyway and stores it in |entry| then.
+  bool LookupEntry(DirectoryEntry* dir, const char* name, DentryCache::Dentry* dentry,
+                   std::unique_ptr<Entry>* entry = nullptr);
+  std::unique_ptr<Entry> FindEntry(DirectoryEntry* dir, const char* name);
+  // Change the directory and the dentry cache.
+  void AddEntry(DirectoryEntry* dir, const Entry* entry, const char* name);
+  bool RemoveEntry(DirectoryEntry* dir, const Entry* entry, const char* name);
+
   std::shared_ptr<DirectoryEntry> GetDirectory(Path path, ErrorCode& error_code);
+  // Unlike GetDirectory, follows the symlink in the last component.
+  std::shared_ptr<FileEntry> GetFile(Path path, ErrorCode& error_code);
+  // Marks the device as using |feature| (see DeviceLayout::kFeature*).
+  // Returns false if the device is older than v1.2 and can't have features.
+  bool EnableFeature(uint32_t feature);
   bool IsType(const char* path, ErrorCode* error_code, Entry::Type type);
 
+  // By default write buffers of all open files may take up to this size.
+  static constexpr uint64_t kDefaultWriteBufferBudget = 64 << 20;
+  // By default the dentry cache may take up to this size.
+  static constexpr uint64_t kDefaultDirectoryCacheBudget = 16 << 20;
+  // Threads which run asynchronous operations of all open files.
+  static constexpr size_t kIoThreads = 4;
+
   std::unique_ptr<ReaderWriter> accessor_;
   std::unique_ptr<SectionAllocator> allocator_;
   EntryCache cache_;
+  DentryCache dentries_{kDefaultDirectoryCacheBudget};
+  MemoryBudget write_buffer_budget_{kDefaultWriteBufferBudget};
+  // Its tasks use everything above.
+  IoExecutor io_executor_{kIoThreads};
   std::shared_ptr<DirectoryEntry> root_entry_;
+  bool extent_tree_ = false;  // new files use the extent tree
+  uint8_t directory_flags_ = 0;  // EntryLayout flags of new directories
+  uint32_t features_ = 0;
+  bool has_features_ = false;  // the device is v1.2 or newer
+  std::mutex features_mutex_;
+  // It uses everything above, so it must be destroyed first.
+  std::unique_ptr<Defragmenter> defragmenter_;
 };
 
 }  // namespace linfs
@@ -0,0 +1,47 @@
+#include "lib/mapped_file_impl.h"
+
+#include <mutex>
+#include <utility>
+
+#include "lib/utils/exception_handler.h"
+
+namespace fs {
+
+namespace linfs {
+
+MappedFileImpl::MappedFileImpl(std::shared_ptr<FileEntry> file_entry,
+                               RangeLock::Guard range_lock,
+                               const FileEntry::DeviceRange& range,
+                               std::unique_ptr<ReaderWriter> writer)
+    : file_entry_(std::move(file_entry)), range_lock_(std::move(range_lock)),
+      writer_(std::move(writer)),
+      region_(writer_->device_path(), range.offset, range.size, true),
+      data_(region_.data()), size_(range.size) {
+  file_entry_->AddMapping();
+}
+
+ErrorCode MappedFileImpl::Sync() {
+  try {
+    region_.Sync();
+    file_entry_->PersistSize(writer_.get());
+    // The handles may have read the old data ahead.
+    file_entry_->BumpGeneration();
+    return ErrorCode::kSuccess;
+  }
+  catch (...) {
+    return ExceptionHandler::ToErrorCode(std::current_exception());
+  }
+}
+
+void MappedFileImpl::Release() {
+  {
+    std::unique_lock<SharedMutex> lock = file_entry_->Lock();
+    file_entry_->RemoveMapping();
+  }
+  file_entry_->BumpGeneration();
+  delete this;
+}
+
+}  // namespace linfs
+
+}  // namespace fs
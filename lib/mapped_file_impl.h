@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+
+#include "fs/error_code.h"
+#include "fs/file_interface.h"
+#include "lib/entries/file_entry.h"
+#include "lib/utils/mapped_region.h"
+#include "lib/utils/range_lock.h"
+#include "lib/utils/reader_writer.h"
+
+namespace fs {
+
+namespace linfs {
+
+class MappedFileImpl : public FileInterface::MappedFile {
+ public:
+  // Maps |range|, which holds all the data of |file_entry|.  |range_lock|
+  // must cover the whole file, and the caller must hold the exclusive lock.
+  MappedFileImpl(std::shared_ptr<FileEntry> file_entry, RangeLock::Guard range_lock,
+                 const FileEntry::DeviceRange& range, std::unique_ptr<ReaderWriter> writer);
+
+  char* data() const override { return data_; }
+  size_t size() const override { return size_; }
+  ErrorCode Sync() override;
+  void Release() override;
+
+ private:
+  virtual ~MappedFileImpl() = default;
+
+  // The lock refers to the entry, so it must be destroyed first.
+  std::shared_ptr<FileEntry> file_entry_;
+  RangeLock::Guard range_lock_;
+  std::unique_ptr<ReaderWriter> writer_;
+  MappedRegion region_;
+  char* data_;
+  size_t size_;
+};
+
+}  // namespace linfs
+
+}  // namespace fs
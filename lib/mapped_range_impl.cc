@@ -0,0 +1,28 @@
+#include "lib/mapped_range_impl.h"
+
+#include <utility>
+
+namespace fs {
+
+namespace linfs {
+
+MappedRangeImpl::MappedRangeImpl(std::shared_ptr<FileEntry> file_entry,
+                                 RangeLock::Guard range_lock,
+                                 const std::vector<FileEntry::DeviceRange>& ranges,
+                                 ReaderWriter* reader)
+    : file_entry_(std::move(file_entry)), range_lock_(std::move(range_lock)) {
+  regions_.reserve(ranges.size());
+  spans_.reserve(ranges.size());
+  for (const FileEntry::DeviceRange& range : ranges) {
+    if (range.offset == 0) {
+      spans_.push_back(Span{nullptr, range.size});  // a hole
+      continue;
+    }
+    regions_.emplace_back(reader->device_path(), range.offset, range.size);
+    spans_.push_back(Span{regions_.back().data(), range.size});
+  }
+}
+
+}  // namespace linfs
+
+}  // namespace fs
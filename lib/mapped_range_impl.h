@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "fs/file_interface.h"
+#include "lib/entries/file_entry.h"
+#include "lib/utils/mapped_region.h"
+#include "lib/utils/range_lock.h"
+#include "lib/utils/reader_writer.h"
+
+namespace fs {
+
+namespace linfs {
+
+class MappedRangeImpl : public FileInterface::MappedRange {
+ public:
+  // Maps the ranges of |file_entry| which are pinned by |range_lock|.
+  MappedRangeImpl(std::shared_ptr<FileEntry> file_entry, RangeLock::Guard range_lock,
+                  const std::vector<FileEntry::DeviceRange>& ranges, ReaderWriter* reader);
+
+  const Span* spans() const override { return spans_.data(); }
+  size_t spans_count() const override { return spans_.size(); }
+  void Release() override { delete this; }
+
+ private:
+  virtual ~MappedRangeImpl() = default;
+
+  // The lock refers to the entry, so it must be destroyed first.
+  std::shared_ptr<FileEntry> file_entry_;
+  RangeLock::Guard range_lock_;
+  std::vector<MappedRegion> regions_;
+  std::vector<Span> spans_;
+};
+
+}  // namespace linfs
+
+}  // namespace fs
@@ -0,0 +1,63 @@
+#include "lib/scrubber.h"
+
+#include <limits>
+#include <mutex>
+#include <shared_mutex>
+
+#include "lib/utils/range_lock.h"
+
+namespace fs {
+
+namespace linfs {
+
+uint64_t Scrubber::RunPass() {
+  std::vector<std::shared_ptr<DirectoryEntry>> dirs{root_entry_};
+  while (!dirs.empty()) {
+    std::shared_ptr<DirectoryEntry> dir = std::move(dirs.back());
+    dirs.pop_back();
+    ScrubDirectory(dir, dirs);
+  }
+  return corrupted_;
+}
+
+void Scrubber::ScrubDirectory(const std::shared_ptr<DirectoryEntry>& dir,
+                              std::vector<std::shared_ptr<DirectoryEntry>>& subdirs) {
+  uint64_t cookie = 0;
+  do {
+    std::shared_ptr<Entry> entry;
+    {
+      // See LinFS::GetDirectory why the entry must be shared in the locked directory.
+      std::shared_lock<SharedMutex> lock = dir->LockShared();
+
+      std::unique_ptr<Entry> next_entry;
+      cookie = dir->GetNextEntry(cookie, reader_writer_.get(), &next_entry, nullptr,
+                                 Entry::Type::kSymlink);
+      if (cookie == 0)
+        continue;
+      if (next_entry->type() == Entry::Type::kFile && !next_entry->As<FileEntry>()->extent_tree())
+        continue;  // The file has no checksums.
+      entry = cache_->GetSharedEntry(std::move(next_entry));
+    }
+
+    if (entry->type() == Entry::Type::kDirectory)
+      subdirs.push_back(std::static_pointer_cast<DirectoryEntry>(entry));
+    else
+      ScrubFile(std::static_pointer_cast<FileEntry>(entry));
+  } while (cookie != 0);
+}
+
+void Scrubber::ScrubFile(const std::shared_ptr<FileEntry>& file) {
+  // Unlike the defragmenter, open files are scrubbed too.  Their writers
+  // must finish first, see FileImpl::WriteRange.
+  RangeLock::Guard range_lock = file->LockRangeShared(0, std::numeric_limits<uint64_t>::max());
+  std::unique_lock<SharedMutex> lock = file->Lock();
+  file->WaitForAppends(lock);
+  if (file->mapped())
+    return;  // The data may change at any moment.
+
+  corrupted_ += file->Scrub(reader_writer_.get(), allocator_);
+}
+
+}  // namespace linfs
+
+}  // namespace fs
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "lib/entries/directory_entry.h"
+#include "lib/entries/file_entry.h"
+#include "lib/entry_cache.h"
+#include "lib/section_allocator.h"
+#include "lib/utils/reader_writer.h"
+
+namespace fs {
+
+namespace linfs {
+
+// Walks the whole filesystem, checks the checksums of the file data and adds
+// the missing ones (see FileEntry::Scrub).
+class Scrubber {
+ public:
+  Scrubber(std::unique_ptr<ReaderWriter> reader_writer, SectionAllocator* allocator,
+           EntryCache* cache, std::shared_ptr<DirectoryEntry> root_entry)
+      : reader_writer_(std::move(reader_writer)), allocator_(allocator), cache_(cache),
+        root_entry_(std::move(root_entry)) {}
+
+  // Returns the number of corrupted extents.
+  uint64_t RunPass();
+
+ private:
+  void ScrubDirectory(const std::shared_ptr<DirectoryEntry>& dir,
+                      std::vector<std::shared_ptr<DirectoryEntry>>& subdirs);
+  void ScrubFile(const std::shared_ptr<FileEntry>& file);
+
+  std::unique_ptr<ReaderWriter> reader_writer_;
+  SectionAllocator* allocator_;
+  EntryCache* cache_;
+  std::shared_ptr<DirectoryEntry> root_entry_;
+
+  uint64_t corrupted_ = 0;
+};
+
+}  // namespace linfs
+
+}  // namespace fs
@@ -1,6 +1,8 @@
 #include "lib/section_allocator.h"
 
+#include <algorithm>
 #include <ios>
+#include <vector>
 
 #include "lib/layout/device_layout.h"
 
@@ -12,26 +14,117 @@ namespace fs {
 
 namespace linfs {
 
-Section SectionAllocator::AllocateSection(uint64_t size, ReaderWriter* reader_writer) {
+Section SectionAllocator::AllocateSection(uint64_t size, Entry::Type type,
+                                          ReaderWriter* reader_writer) {
   // SectionAllocator owns and entirely depends on the NoneEntry and just
   // expands its functionality.  Therefore we can use only one mutex for both of
   // them.
   std::unique_lock<SharedMutex> lock = none_entry_->Lock();
 
-  // Round up to the |cluster_size_| boundary.  It's correct because
-  // |cluster_size_| is always equal to power of 2.
-  size = (size + cluster_size_ - 1) & ~(cluster_size_ - 1);
+  // Round up to the cluster boundary.
+  size = RoundUp(size, type);
 
-  if (none_entry_->HasSections())
+  if (!none_entry_->HasSections()) {
+    // There is nothing in NoneEntry chain.  Allocate a new cluster.
+    return AllocateTailSection(size, reader_writer);
+  }
+  if (Unit(type) == cluster_size_)
     return none_entry_->GetSection(size, reader_writer);
 
-  // There is nothing in NoneEntry chain.  Allocate a new cluster.
-  uint64_t required_clusters = size / cluster_size_;
-  Section section = Section::Create(total_clusters_ * cluster_size_,
-                                    required_clusters * cluster_size_, reader_writer);
-  reader_writer->Write<uint8_t>(0, section.base_offset() + section.size() - 1);
-  SetTotalClusters(total_clusters_ + required_clusters, reader_writer);
-  return section;
+  // The head may be a piece of metadata.  Take the best fit, or as much of
+  // the largest section as there is.
+  uint64_t section_offset = none_entry_->FindSection(size, reader_writer);
+  if (section_offset == 0)
+    section_offset = none_entry_->FindLargestSection(reader_writer);
+  uint64_t taken = none_entry_->TakeSectionAt(section_offset, size, Unit(type), reader_writer);
+  if (taken == 0)
+    return AllocateTailSection(size, reader_writer);
+  try {
+    return Section::Create(section_offset, taken, reader_writer);
+  }
+  catch (...) {
+    PutUnusedSection(section_offset, taken, reader_writer);
+    throw;
+  }
+}
+
+Section SectionAllocator::AllocateContiguousSection(uint64_t size, Entry::Type type,
+                                                    ReaderWriter* reader_writer) {
+  std::unique_lock<SharedMutex> lock = none_entry_->Lock();
+
+  size = RoundUp(size, type);
+
+  // Use the smallest unused section which is big enough (best fit).
+  uint64_t section_offset = none_entry_->FindSection(size, reader_writer);
+  if (section_offset == 0)
+    return AllocateTailSection(size, reader_writer);
+
+  none_entry_->TakeSectionAt(section_offset, size, Unit(type), reader_writer);
+  try {
+    return Section::Create(section_offset, size, reader_writer);
+  }
+  catch (...) {
+    PutUnusedSection(section_offset, size, reader_writer);
+    throw;
+  }
+}
+
+bool SectionAllocator::ExtendSection(Section& section, uint64_t size, Entry::Type type,
+                                     ReaderWriter* reader_writer) {
+  std::unique_lock<SharedMutex> lock = none_entry_->Lock();
+
+  size = RoundUp(size, type);
+  uint64_t section_end = section.base_offset() + section.size();
+
+  if (section_end == total_clusters_ * cluster_size_) {
+    // It's the last section on the device.  Just allocate the following clusters.
+    uint64_t old_total_clusters = total_clusters_;
+    reader_writer->Write<uint8_t>(0, section_end + size - 1);
+    SetTotalClusters(total_clusters_ + size / cluster_size_, reader_writer);
+    try {
+      section.SetSize(section.size() + size, reader_writer);
+    }
+    catch (...) {
+      // Try to give the clusters back, otherwise they are leaked.
+      try {
+        SetTotalClusters(old_total_clusters, reader_writer);
+      }
+      catch (...) {
+#ifndef NDEBUG
+        std::cerr << "Leaked clusters at " << std::hex << section_end
+                  << " of size " << std::dec << size << std::endl;
+#endif
+      }
+      throw;
+    }
+    return true;
+  }
+
+  uint64_t taken = none_entry_->TakeSectionAt(section_end, size, Unit(type), reader_writer);
+  if (taken == 0)
+    return false;
+
+  try {
+    section.SetSize(section.size() + taken, reader_writer);
+  }
+  catch (...) {
+    PutUnusedSection(section_end, taken, reader_writer);
+    throw;
+  }
+  return true;
+}
+
+void SectionAllocator::ShrinkSection(Section& section, uint64_t size, Entry::Type type,
+                                     ReaderWriter* reader_writer) {
+  std::unique_lock<SharedMutex> lock = none_entry_->Lock();
+
+  size = RoundUp(size, type);
+  if (size >= section.size())
+    return;
+
+  uint64_t unused_size = section.size() - size;
+  section.SetSize(size, reader_writer);
+  PutUnusedSection(section.base_offset() + size, unused_size, reader_writer);
 }
 
 void SectionAllocator::ReleaseSection(const Section& section,
@@ -64,6 +157,110 @@ void SectionAllocator::ReleaseSection(uint64_t section_offset,
   }
 }
 
+void SectionAllocator::ReleaseSections(const std::vector<Section>& sections,
+                                       ReaderWriter* reader_writer) noexcept {
+  if (sections.empty())
+    return;
+
+  std::unique_lock<SharedMutex> lock = none_entry_->Lock();
+
+  try {
+    none_entry_->PutSections(sections, reader_writer);
+  }
+  catch (...) {
+#ifndef NDEBUG
+    std::cerr << "Leaked " << std::dec << sections.size() << " section(s) at "
+              << std::hex << sections.front().base_offset() << std::endl;
+#endif
+  }
+}
+
+void SectionAllocator::ShareSection(uint64_t section_offset, ReaderWriter* reader_writer) {
+  std::unique_lock<SharedMutex> lock = none_entry_->Lock();
+
+  Section section = Section::Load(section_offset, reader_writer);
+  section.SetNext(section.next_offset() + 1, reader_writer);
+}
+
+bool SectionAllocator::SectionIsShared(uint64_t section_offset, ReaderWriter* reader) {
+  std::unique_lock<SharedMutex> lock = none_entry_->Lock();
+
+  return Section::Load(section_offset, reader).next_offset() != 0;
+}
+
+void SectionAllocator::ReleaseSharedSection(uint64_t section_offset,
+                                            ReaderWriter* reader_writer) noexcept {
+  std::unique_lock<SharedMutex> lock = none_entry_->Lock();
+
+  try {
+    Section section = Section::Load(section_offset, reader_writer);
+    if (section.next_offset() != 0)
+      section.SetNext(section.next_offset() - 1, reader_writer);
+    else
+      none_entry_->PutSection(section, reader_writer);
+  }
+  catch (...) {
+#ifndef NDEBUG
+    std::cerr << "Leaked shared section at " << std::hex << section_offset << std::endl;
+#endif
+  }
+}
+
+void SectionAllocator::GetStats(FilesystemInterface::Stats* stats, ReaderWriter* reader) {
+  std::unique_lock<SharedMutex> lock = none_entry_->Lock();
+
+  *stats = FilesystemInterface::Stats();
+  stats->cluster_size = cluster_size_;
+  stats->data_cluster_size = data_cluster_size_;
+  stats->total_clusters = total_clusters_;
+
+  // Unused sections are chained in the order of their release, so sort them
+  // to find the adjacent ones.
+  std::vector<Section> sections = none_entry_->GetAllSections(reader);
+  std::sort(sections.begin(), sections.end(), [](const Section& a, const Section& b) {
+    return a.base_offset() < b.base_offset();
+  });
+
+  for (auto it = sections.begin(); it != sections.end();) {
+    uint64_t extent_begin = it->base_offset();
+    uint64_t extent_end = extent_begin + it->size();
+    for (++it; it != sections.end() && it->base_offset() == extent_end; ++it)
+      extent_end += it->size();
+
+    uint64_t extent_clusters = (extent_end - extent_begin) / cluster_size_;
+    int log2 = 0;
+    while (extent_clusters >> (log2 + 1))
+      ++log2;
+    ++stats->free_extents;
+    ++stats->free_extents_histogram[log2];
+    stats->free_clusters += extent_clusters;
+    stats->largest_free_extent = std::max(stats->largest_free_extent, extent_clusters);
+  }
+}
+
+Section SectionAllocator::AllocateTailSection(uint64_t size, ReaderWriter* reader_writer) {
+  uint64_t required_clusters = size / cluster_size_;
+  Section section = Section::Create(total_clusters_ * cluster_size_,
+                                    required_clusters * cluster_size_, reader_writer);
+  reader_writer->Write<uint8_t>(0, section.base_offset() + section.size() - 1);
+  SetTotalClusters(total_clusters_ + required_clusters, reader_writer);
+  return section;
+}
+
+void SectionAllocator::PutUnusedSection(uint64_t section_offset, uint64_t size,
+                                        ReaderWriter* reader_writer) noexcept {
+  try {
+    Section section = Section::Create(section_offset, size, reader_writer);
+    none_entry_->PutSection(section, reader_writer);
+  }
+  catch (...) {
+#ifndef NDEBUG
+    std::cerr << "Leaked section at " << std::hex << section_offset
+              << " of size " << std::dec << size << std::endl;
+#endif
+  }
+}
+
 void SectionAllocator::SetTotalClusters(uint64_t total_clusters, ReaderWriter* reader_writer) {
   reader_writer->Write<uint64_t>(total_clusters, offsetof(DeviceLayout::Header, total_clusters));
   total_clusters_ = total_clusters;
@@ -2,7 +2,10 @@
 
 #include <cstdint>
 #include <memory>
+#include <vector>
 
+#include "fs/filesystem_interface.h"
+#include "lib/entries/entry.h"
 #include "lib/entries/none_entry.h"
 #include "lib/sections/section.h"
 #include "lib/utils/reader_writer.h"
@@ -13,22 +16,68 @@ namespace linfs {
 
 class SectionAllocator {
  public:
-  SectionAllocator(uint64_t cluster_size, uint64_t total_clusters,
-                   std::unique_ptr<NoneEntry> none_entry)
-      : cluster_size_(cluster_size), total_clusters_(total_clusters),
-        none_entry_(std::move(none_entry)) {}
+  SectionAllocator(uint64_t cluster_size, uint64_t data_cluster_size,
+                   uint64_t total_clusters, std::unique_ptr<NoneEntry> none_entry)
+      : cluster_size_(cluster_size), data_cluster_size_(data_cluster_size),
+        total_clusters_(total_clusters), none_entry_(std::move(none_entry)) {}
 
-  // Allocates section of the preferred |size|.
+  // Allocates section of the preferred |size| for an entry of the given |type|.
+  // File data is allocated by data clusters, everything else by clusters.
+  // Unused sections smaller than a data cluster, which metadata leaves, are
+  // never given to file data.
   // Note that the size of the allocated section may be less than |size|.
-  Section AllocateSection(uint64_t size, ReaderWriter* reader_writer);
+  Section AllocateSection(uint64_t size, Entry::Type type, ReaderWriter* reader_writer);
+
+  // Unlike AllocateSection, always allocates a section of exactly |size|
+  // bytes (rounded up to the cluster boundary).
+  Section AllocateContiguousSection(uint64_t size, Entry::Type type,
+                                    ReaderWriter* reader_writer);
+
+  // Grows |section| in place by the preferred |size| if the clusters right
+  // after it are unused or it's the last section on the device.  Returns false
+  // and leaves |section| untouched otherwise.
+  // Note that |section| may grow less than by |size|.
+  bool ExtendSection(Section& section, uint64_t size, Entry::Type type,
+                     ReaderWriter* reader_writer);
+
+  // Cuts off the unused clusters at the end of |section|, so that it stays
+  // at least of |size| bytes, and releases them.
+  void ShrinkSection(Section& section, uint64_t size, Entry::Type type,
+                     ReaderWriter* reader_writer);
+
+  // Collects the statistics of unused space.
+  void GetStats(FilesystemInterface::Stats* stats, ReaderWriter* reader);
 
   void ReleaseSection(const Section& section, ReaderWriter* reader_writer) noexcept;
   void ReleaseSection(uint64_t section_offset, ReaderWriter* reader_writer) noexcept;
+  // Releases unrelated sections at once.  Their |next_offset| fields are
+  // overwritten.
+  void ReleaseSections(const std::vector<Section>& sections,
+                       ReaderWriter* reader_writer) noexcept;
+
+  // Reference counting of data sections shared by many files (see
+  // ExtentLayout::kFlagShared).  ShareSection adds a reference,
+  // ReleaseSharedSection drops one and releases the section with the last one.
+  void ShareSection(uint64_t section_offset, ReaderWriter* reader_writer);
+  bool SectionIsShared(uint64_t section_offset, ReaderWriter* reader);
+  void ReleaseSharedSection(uint64_t section_offset, ReaderWriter* reader_writer) noexcept;
 
  private:
+  uint64_t Unit(Entry::Type type) const {
+    return type == Entry::Type::kFile ? data_cluster_size_ : cluster_size_;
+  }
+  uint64_t RoundUp(uint64_t size, Entry::Type type) const {
+    uint64_t unit = Unit(type);
+    // It's correct because |unit| is always equal to power of 2.
+    return (size + unit - 1) & ~(unit - 1);
+  }
+  Section AllocateTailSection(uint64_t size, ReaderWriter* reader_writer);
+  void PutUnusedSection(uint64_t section_offset, uint64_t size,
+                        ReaderWriter* reader_writer) noexcept;
   void SetTotalClusters(uint64_t total_clusters, ReaderWriter* reader_writer);
 
   const uint64_t cluster_size_;
+  const uint64_t data_cluster_size_;  // multiple of |cluster_size_|
   uint64_t total_clusters_;
   std::unique_ptr<NoneEntry> none_entry_;
 };
@@ -14,10 +14,10 @@ Section Section::Load(uint64_t section_offset, ReaderWriter* reader) {
 }
 
 Section Section::Create(uint64_t section_offset, uint64_t section_size,
-                        ReaderWriter* writer) {
-  SectionLayout::Header header = {ByteOrder::Pack(section_size), 0};
+                        ReaderWriter* writer, uint64_t next_offset) {
+  SectionLayout::Header header = {ByteOrder::Pack(section_size), ByteOrder::Pack(next_offset)};
   writer->Write<SectionLayout::Header>(header, section_offset);
-  return Section(section_offset, section_size, 0);
+  return Section(section_offset, section_size, next_offset);
 }
 
 void Section::SetSize(uint64_t size, ReaderWriter* writer) {
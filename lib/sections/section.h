@@ -13,7 +13,7 @@ class Section {
  public:
   static Section Load(uint64_t section_offset, ReaderWriter* reader);
   static Section Create(uint64_t section_offset, uint64_t section_size,
-                        ReaderWriter* writer);
+                        ReaderWriter* writer, uint64_t next_offset = 0);
 
   Section(uint64_t base_offset, uint64_t size, uint64_t next_offset)
       : base_offset_(base_offset), size_(size), next_offset_(next_offset) {}
@@ -1,24 +1,46 @@
 #include "lib/sections/section_directory.h"
 
+#include "lib/utils/format_exception.h"
+
 namespace fs {
 
 namespace linfs {
 
-bool SectionDirectory::AddEntry(uint64_t entry_offset, ReaderWriter* reader_writer,
+uint64_t SectionDirectory::MakeTaggedSlot(uint64_t entry_offset, Entry::Type type,
+                                          uint32_t hash) {
+  if (SlotOffset(entry_offset) != entry_offset)
+    throw FormatException();  // the offset can't be tagged
+
+  return entry_offset |
+         (static_cast<uint64_t>(type) & EntryLayout::kSlotTypeMask) << EntryLayout::kSlotTypeShift |
+         static_cast<uint64_t>(Fingerprint(hash)) << EntryLayout::kSlotFingerprintShift;
+}
+
+std::vector<uint64_t> SectionDirectory::ReadSlots(ReaderWriter* reader,
+                                                 uint64_t start_position) {
+  std::vector<uint64_t> slots((data_size() - start_position) / sizeof(uint64_t));
+  reader->Read(data_offset() + start_position, reinterpret_cast<char*>(slots.data()),
+               slots.size() * sizeof(uint64_t));
+  for (uint64_t& slot : slots)
+    slot = ByteOrder::Unpack(slot);
+  return slots;
+}
+
+bool SectionDirectory::AddEntry(uint64_t slot, ReaderWriter* reader_writer,
                                 uint64_t start_position) {
   for (Iterator it = EntriesBegin(reader_writer, start_position); it != EntriesEnd(); ++it)
     if (*it == 0) {
-      reader_writer->Write<uint64_t>(entry_offset, it.position());
+      reader_writer->Write<uint64_t>(slot, it.position());
       return true;
     }
 
   return false;
 }
 
-bool SectionDirectory::RemoveEntry(uint64_t entry_offset, ReaderWriter* reader_writer,
+bool SectionDirectory::RemoveEntry(uint64_t slot, ReaderWriter* reader_writer,
                                    uint64_t start_position) {
   for (Iterator it = EntriesBegin(reader_writer, start_position); it != EntriesEnd(); ++it)
-    if (*it == entry_offset) {
+    if (*it == slot) {
       reader_writer->Write<uint64_t>(0, it.position());
       return true;
     }
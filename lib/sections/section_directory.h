@@ -1,7 +1,11 @@
 #pragma once
 
 #include <cstdint>
+#include <vector>
 
+#include "lib/entries/entry.h"
+#include "lib/layout/entry_layout.h"
+#include "lib/layout/index_layout.h"
 #include "lib/sections/section.h"
 #include "lib/utils/reader_writer.h"
 
@@ -13,6 +17,22 @@ class SectionDirectory : public Section {
  public:
   typedef ReaderWriter::ReadIterator<uint64_t> Iterator;
 
+  // Free slots are 0 or, in directories with the name index, the links of
+  // the free list (see IndexLayout::kFreeSlot).
+  static bool IsUsed(uint64_t slot) { return slot != 0 && (slot & IndexLayout::kFreeSlot) == 0; }
+
+  // Tagged slots (see EntryLayout::kFlagTaggedSlots).
+  static uint64_t MakeTaggedSlot(uint64_t entry_offset, Entry::Type type, uint32_t hash);
+  static uint64_t SlotOffset(uint64_t slot) { return slot & EntryLayout::kSlotOffsetMask; }
+  static Entry::Type SlotType(uint64_t slot) {
+    return static_cast<Entry::Type>((slot >> EntryLayout::kSlotTypeShift) &
+                                    EntryLayout::kSlotTypeMask);
+  }
+  static uint16_t SlotFingerprint(uint64_t slot) {
+    return static_cast<uint16_t>(slot >> EntryLayout::kSlotFingerprintShift);
+  }
+  static uint16_t Fingerprint(uint32_t hash) { return static_cast<uint16_t>(hash >> 16); }
+
   SectionDirectory(const Section& base) : Section(base) {}
 
   Iterator EntriesBegin(ReaderWriter* reader, uint64_t start_position = 0) {
@@ -21,9 +41,12 @@ class SectionDirectory : public Section {
   Iterator EntriesEnd() {
     return Iterator(data_offset() + data_size());
   }
+  // Reads all slots after |start_position| at once.
+  std::vector<uint64_t> ReadSlots(ReaderWriter* reader, uint64_t start_position = 0);
 
-  bool AddEntry(uint64_t entry_offset, ReaderWriter* reader_writer, uint64_t start_position = 0);
-  bool RemoveEntry(uint64_t entry_offset, ReaderWriter* reader_writer, uint64_t start_position = 0);
+  // |slot| is the entry's offset or its tagged slot.
+  bool AddEntry(uint64_t slot, ReaderWriter* reader_writer, uint64_t start_position = 0);
+  bool RemoveEntry(uint64_t slot, ReaderWriter* reader_writer, uint64_t start_position = 0);
   bool HasEntries(ReaderWriter* reader, uint64_t start_position = 0);
 };
 
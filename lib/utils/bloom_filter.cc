@@ -0,0 +1,48 @@
+#include "lib/utils/bloom_filter.h"
+
+namespace fs {
+
+namespace linfs {
+
+uint64_t BloomFilter::Hash(const char* name) {
+  // FNV-1a mixed by the MurmurHash3 finalizer, so all bits depend on the name.
+  uint64_t hash = 14695981039346656037ULL;
+  for (; *name != '\0'; ++name)
+    hash = (hash ^ static_cast<uint8_t>(*name)) * 1099511628211ULL;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+BloomFilter::BloomFilter(uint64_t capacity)
+    : capacity_(capacity > kMinCapacity ? capacity : kMinCapacity) {
+  uint64_t bits = 64;
+  while (bits < capacity_ * kBitsPerName)
+    bits *= 2;
+  bits_.resize(bits / 64);
+}
+
+void BloomFilter::Add(uint64_t hash) {
+  // Both halves of the hash make all the positions (double hashing).
+  uint64_t mask = bits_.size() * 64 - 1;
+  uint64_t position = hash & 0xffffffff, step = (hash >> 32) | 1;
+  for (int i = 0; i != kHashes; ++i, position += step)
+    bits_[(position & mask) / 64] |= 1ULL << (position % 64);
+  ++count_;
+}
+
+bool BloomFilter::MayContain(uint64_t hash) const {
+  uint64_t mask = bits_.size() * 64 - 1;
+  uint64_t position = hash & 0xffffffff, step = (hash >> 32) | 1;
+  for (int i = 0; i != kHashes; ++i, position += step)
+    if ((bits_[(position & mask) / 64] & (1ULL << (position % 64))) == 0)
+      return false;
+  return true;
+}
+
+}  // namespace linfs
+
+}  // namespace fs
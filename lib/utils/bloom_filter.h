@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace fs {
+
+namespace linfs {
+
+// Set of names which may answer "yes" for names it doesn't hold (about 0.3%
+// of them while it holds at most |capacity| names), but never answers "no"
+// for names it holds.  Names can't be removed.
+class BloomFilter {
+ public:
+  static uint64_t Hash(const char* name);
+
+  explicit BloomFilter(uint64_t capacity);
+
+  void Add(uint64_t hash);
+  bool MayContain(uint64_t hash) const;
+
+  // Returns true if it holds more names than it was made for.
+  bool overfull() const { return count_ > capacity_; }
+  uint64_t size() const { return bits_.size() * sizeof(uint64_t); }
+
+ private:
+  static constexpr uint64_t kMinCapacity = 64;
+  static constexpr uint64_t kBitsPerName = 16;
+  static constexpr int kHashes = 4;
+
+  std::vector<uint64_t> bits_;  // the number of bits is a power of 2
+  uint64_t capacity_;
+  uint64_t count_ = 0;
+};
+
+}  // namespace linfs
+
+}  // namespace fs
@@ -0,0 +1,109 @@
+#include "lib/utils/crc32c.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace fs {
+
+namespace linfs {
+
+namespace {
+
+// The reversed polynomial.
+constexpr uint32_t kPolynomial = 0x82f63b78;
+
+struct Table {
+  Table() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; ++bit)
+        crc = (crc >> 1) ^ (crc & 1 ? kPolynomial : 0);
+      entries[i] = crc;
+    }
+  }
+
+  uint32_t entries[256];
+};
+
+uint32_t SoftwareCrc32c(uint32_t crc, const unsigned char* data, size_t size) {
+  static const Table table;
+  for (size_t i = 0; i < size; ++i)
+    crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t HardwareCrc32c(uint32_t crc, const unsigned char* data, size_t size) {
+  uint64_t crc64 = crc;
+  for (; size >= 8; data += 8, size -= 8) {
+    uint64_t word;
+    std::memcpy(&word, data, sizeof word);
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = static_cast<uint32_t>(crc64);
+  for (; size != 0; ++data, --size)
+    crc = _mm_crc32_u8(crc, *data);
+  return crc;
+}
+
+// The instruction takes 3 cycles, but a new one starts every cycle, so 3
+// chunks are hashed at once.
+__attribute__((target("sse4.2")))
+void HardwareCrc32cOf3(const unsigned char* data, size_t chunk_size, uint32_t* checksums) {
+  const unsigned char* data1 = data + chunk_size;
+  const unsigned char* data2 = data1 + chunk_size;
+  uint64_t crc0 = ~0U, crc1 = ~0U, crc2 = ~0U;
+  size_t i = 0;
+  for (; i + 8 <= chunk_size; i += 8) {
+    uint64_t word0, word1, word2;
+    std::memcpy(&word0, data + i, sizeof word0);
+    std::memcpy(&word1, data1 + i, sizeof word1);
+    std::memcpy(&word2, data2 + i, sizeof word2);
+    crc0 = _mm_crc32_u64(crc0, word0);
+    crc1 = _mm_crc32_u64(crc1, word1);
+    crc2 = _mm_crc32_u64(crc2, word2);
+  }
+  checksums[0] = ~HardwareCrc32c(static_cast<uint32_t>(crc0), data + i, chunk_size - i);
+  checksums[1] = ~HardwareCrc32c(static_cast<uint32_t>(crc1), data1 + i, chunk_size - i);
+  checksums[2] = ~HardwareCrc32c(static_cast<uint32_t>(crc2), data2 + i, chunk_size - i);
+}
+
+bool HasHardwareCrc32c() {
+  static const bool has = __builtin_cpu_supports("sse4.2");
+  return has;
+}
+#endif
+
+}  // namespace
+
+uint32_t Crc32c(uint32_t crc, const char* data, size_t size) {
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+  crc = ~crc;
+#if defined(__x86_64__)
+  if (HasHardwareCrc32c())
+    return ~HardwareCrc32c(crc, bytes, size);
+#endif
+  return ~SoftwareCrc32c(crc, bytes, size);
+}
+
+void Crc32cChunks(const char* data, size_t size, size_t chunk_size, uint32_t* checksums) {
+  size_t done = 0;
+#if defined(__x86_64__)
+  if (HasHardwareCrc32c()) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    for (; size - done >= 3 * chunk_size; done += 3 * chunk_size, checksums += 3)
+      HardwareCrc32cOf3(bytes + done, chunk_size, checksums);
+  }
+#endif
+  for (; done < size; done += chunk_size)
+    *checksums++ = Crc32c(0, data + done, std::min(chunk_size, size - done));
+}
+
+}  // namespace linfs
+
+}  // namespace fs
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace fs {
+
+namespace linfs {
+
+// CRC-32C (Castagnoli) of |size| bytes of |data| continuing |crc|, so
+// Crc32c(Crc32c(0, a), b) is the checksum of a followed by b.  Uses the
+// SSE4.2 instruction when the CPU has it.
+uint32_t Crc32c(uint32_t crc, const char* data, size_t size);
+
+// Writes the checksum of every |chunk_size| bytes of |data| to |checksums|.
+// The last chunk may be shorter.  The chunks are independent, so it's faster
+// than Crc32c for each of them.
+void Crc32cChunks(const char* data, size_t size, size_t chunk_size, uint32_t* checksums);
+
+}  // namespace linfs
+
+}  // namespace fs
@@ -0,0 +1,61 @@
+#include "lib/utils/io_executor.h"
+
+#include <new>
+#include <system_error>
+#include <utility>
+
+namespace fs {
+
+namespace linfs {
+
+void IoExecutor::Submit(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(std::move(task));
+    if (tasks_.size() > idle_threads_ && threads_.size() < max_threads_) {
+      try {
+        threads_.emplace_back([this] { Run(); });
+      }
+      catch (const std::system_error&) {
+        if (threads_.empty()) {
+          tasks_.pop_back();
+          throw std::bad_alloc();
+        }
+        /* The running threads will get to the task. */
+      }
+    }
+  }
+  cv_.notify_one();
+}
+
+void IoExecutor::Stop() noexcept {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  for (std::thread& thread : threads_)
+    thread.join();
+}
+
+void IoExecutor::Run() noexcept {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (1) {
+    ++idle_threads_;
+    cv_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+    --idle_threads_;
+    // The pending tasks are run even on stop: their owners wait for them.
+    if (tasks_.empty())
+      return;
+
+    std::function<void()> task = std::move(tasks_.front());
+    tasks_.pop_front();
+    lock.unlock();
+    task();
+    lock.lock();
+  }
+}
+
+}  // namespace linfs
+
+}  // namespace fs
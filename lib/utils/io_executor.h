@@ -0,0 +1,42 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fs {
+
+namespace linfs {
+
+// Runs queued tasks on up to |max_threads| worker threads.  The threads are
+// started on demand, so a filesystem which doesn't use asynchronous I/O
+// doesn't pay for them.
+class IoExecutor {
+ public:
+  explicit IoExecutor(size_t max_threads) : max_threads_(max_threads) {}
+  ~IoExecutor() { Stop(); }
+
+  // Tasks must not throw.  Throws std::bad_alloc if there is no thread to
+  // run the task.
+  void Submit(std::function<void()> task);
+
+ private:
+  void Stop() noexcept;
+  void Run() noexcept;
+
+  const size_t max_threads_;
+  std::vector<std::thread> threads_;
+  size_t idle_threads_ = 0;
+  std::deque<std::function<void()>> tasks_;
+  bool stop_ = false;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+};
+
+}  // namespace linfs
+
+}  // namespace fs
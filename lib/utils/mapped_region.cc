@@ -0,0 +1,45 @@
+#include "lib/utils/mapped_region.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <ios>
+#include <system_error>
+
+namespace fs {
+
+namespace linfs {
+
+MappedRegion::MappedRegion(const std::string& device_path, uint64_t offset, size_t size,
+                           bool writable) {
+  uint64_t page_size = sysconf(_SC_PAGESIZE);
+  uint64_t base_offset = offset / page_size * page_size;
+  length_ = size + (offset - base_offset);
+
+  int fd = open(device_path.c_str(), writable ? O_RDWR : O_RDONLY);
+  if (fd < 0)
+    throw std::ios_base::failure("open", std::make_error_code(std::errc::io_error));
+  base_ = mmap(nullptr, length_, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd,
+               base_offset);
+  // The mapping keeps the file open by itself.
+  close(fd);
+  if (base_ == MAP_FAILED)
+    throw std::ios_base::failure("mmap", std::make_error_code(std::errc::io_error));
+
+  data_ = static_cast<char*>(base_) + (offset - base_offset);
+}
+
+void MappedRegion::Sync() {
+  if (msync(base_, length_, MS_SYNC) != 0)
+    throw std::ios_base::failure("msync", std::make_error_code(std::errc::io_error));
+}
+
+MappedRegion::~MappedRegion() {
+  if (base_ != nullptr)
+    munmap(base_, length_);
+}
+
+}  // namespace linfs
+
+}  // namespace fs
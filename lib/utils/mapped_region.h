@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace fs {
+
+namespace linfs {
+
+// Memory mapping of |size| bytes of the device at |offset|.  It reflects the
+// writes made through ReaderWriter and vice versa since both go through the
+// system page cache.  It's read-only unless |writable|.
+class MappedRegion {
+ public:
+  MappedRegion(const std::string& device_path, uint64_t offset, size_t size,
+               bool writable = false);
+  MappedRegion(MappedRegion&& that)
+      : base_(that.base_), length_(that.length_), data_(that.data_) {
+    that.base_ = nullptr;
+  }
+  MappedRegion(const MappedRegion&) = delete;
+  MappedRegion& operator=(const MappedRegion&) = delete;
+  ~MappedRegion();
+
+  const char* data() const { return data_; }
+  char* data() { return data_; }
+
+  // Writes the changes to the device.
+  void Sync();
+
+ private:
+  void* base_;     // page aligned
+  size_t length_;
+  char* data_;
+};
+
+}  // namespace linfs
+
+}  // namespace fs
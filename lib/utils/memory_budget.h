@@ -0,0 +1,38 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace fs {
+
+namespace linfs {
+
+// Counts memory shared by many consumers (e.g. write buffers of all open
+// files) and doesn't let them use more than |limit| bytes in total.
+class MemoryBudget {
+ public:
+  explicit MemoryBudget(uint64_t limit) : limit_(limit), used_(0) {}
+
+  // Returns false if there is not enough memory left.
+  bool Acquire(uint64_t size) {
+    uint64_t used = used_.load();
+    do {
+      if (size > limit_.load() || used > limit_.load() - size)
+        return false;
+    } while (!used_.compare_exchange_weak(used, used + size));
+    return true;
+  }
+
+  void Release(uint64_t size) { used_ -= size; }
+
+  // Doesn't affect memory which has already been acquired.
+  void SetLimit(uint64_t limit) { limit_ = limit; }
+
+ private:
+  std::atomic<uint64_t> limit_;
+  std::atomic<uint64_t> used_;
+};
+
+}  // namespace linfs
+
+}  // namespace fs
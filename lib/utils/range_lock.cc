@@ -0,0 +1,47 @@
+#include "lib/utils/range_lock.h"
+
+namespace fs {
+
+namespace linfs {
+
+RangeLock::Guard& RangeLock::Guard::operator=(Guard&& that) {
+  if (this != &that) {
+    Unlock();
+    owner_ = that.owner_;
+    range_ = that.range_;
+    that.owner_ = nullptr;
+  }
+  return *this;
+}
+
+void RangeLock::Guard::Unlock() {
+  if (owner_ != nullptr)
+    owner_->Release(range_);
+  owner_ = nullptr;
+}
+
+RangeLock::Guard RangeLock::Acquire(const Range& range) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this, &range] { return !Conflicts(range); });
+  return Guard(this, ranges_.insert(ranges_.end(), range));
+}
+
+void RangeLock::Release(std::list<Range>::iterator range) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ranges_.erase(range);
+  }
+  cv_.notify_all();
+}
+
+bool RangeLock::Conflicts(const Range& range) const {
+  for (const Range& it : ranges_) {
+    if (it.begin < range.end && range.begin < it.end && (it.exclusive || range.exclusive))
+      return true;
+  }
+  return false;
+}
+
+}  // namespace linfs
+
+}  // namespace fs
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <mutex>
+
+namespace fs {
+
+namespace linfs {
+
+// Locks ranges [begin, end) of some resource (e.g. bytes of a file).  Shared
+// locks of overlapping ranges are compatible, an exclusive lock isn't
+// compatible with any lock of an overlapping range.
+class RangeLock {
+  struct Range {
+    uint64_t begin;
+    uint64_t end;
+    bool exclusive;
+  };
+
+ public:
+  // Unlocks the range on destruction.
+  class Guard {
+   public:
+    Guard() = default;
+    Guard(RangeLock* owner, std::list<Range>::iterator range) : owner_(owner), range_(range) {}
+    Guard(Guard&& that) : owner_(that.owner_), range_(that.range_) { that.owner_ = nullptr; }
+    Guard& operator=(Guard&& that);
+    ~Guard() { Unlock(); }
+
+    void Unlock();
+
+   private:
+    RangeLock* owner_ = nullptr;
+    std::list<Range>::iterator range_;
+  };
+
+  Guard Lock(uint64_t begin, uint64_t end) { return Acquire(Range{begin, end, true}); }
+  Guard LockShared(uint64_t begin, uint64_t end) { return Acquire(Range{begin, end, false}); }
+
+ private:
+  Guard Acquire(const Range& range);
+  void Release(std::list<Range>::iterator range);
+  bool Conflicts(const Range& range) const;
+
+  // The locked ranges.  There are usually few of them, so a list is enough.
+  std::list<Range> ranges_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+};
+
+}  // namespace linfs
+
+}  // namespace fs
@@ -25,13 +25,16 @@ std::unique_ptr<ReaderWriter> ReaderWriter::Duplicate() {
   std::ios_base::openmode clear_mask = std::ios_base::binary |
                                        std::ios_base::in | std::ios_base::out;
 
-  return std::make_unique<ReaderWriter>(device_path_.c_str(),
-                                        device_mode_ & clear_mask);
+  auto duplicate = std::make_unique<ReaderWriter>(device_path_.c_str(),
+                                                  device_mode_ & clear_mask);
+  duplicate->counters_ = counters_;
+  return duplicate;
 }
 
 size_t ReaderWriter::Read(uint64_t offset, char* buf, size_t buf_size) {
   std::lock_guard<std::mutex> lock(device_mutex_);
 
+  ++counters_->reads;
   device_.seekg(offset);
   if (device_.good())
     device_.read(buf, buf_size);
@@ -51,6 +54,7 @@ size_t ReaderWriter::Read(uint64_t offset, char* buf, size_t buf_size) {
 size_t ReaderWriter::Write(const char* buf, size_t buf_size, uint64_t offset) {
   std::lock_guard<std::mutex> lock(device_mutex_);
 
+  ++counters_->writes;
   device_.seekp(offset);
   if (device_.good())
     device_.write(buf, buf_size);
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <fstream>
@@ -25,6 +26,11 @@ class ReaderWriter {
   // the same device in the same mode.
   std::unique_ptr<ReaderWriter> Duplicate();
 
+  const std::string& device_path() const { return device_path_; }
+  // Numbers of reads and writes done by this ReaderWriter and its duplicates.
+  uint64_t reads() const { return counters_->reads; }
+  uint64_t writes() const { return counters_->writes; }
+
   template <typename T>
   T Read(uint64_t offset) {
     return ReadIntegral<T>(std::is_integral<T>(), offset);
@@ -99,9 +105,15 @@ class ReaderWriter {
   std::fstream device_;
   std::mutex device_mutex_;
 
-  // Required information for Duplicate().
+  // Required information for Duplicate() and memory mappings.
   const std::string device_path_;
   const std::ios_base::openmode device_mode_;
+
+  struct Counters {
+    std::atomic<uint64_t> reads{0};
+    std::atomic<uint64_t> writes{0};
+  };
+  std::shared_ptr<Counters> counters_ = std::make_shared<Counters>();
 };
 
 }  // namespace linfs
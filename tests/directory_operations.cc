@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <string>
 
 #include "tests/filesystem_fixtures.h"
@@ -520,4 +521,294 @@ BOOST_FIXTURE_TEST_CASE(is_directory_if_doesnt_exist, LoadedFSFixture) {
   BOOST_CHECK(ErrorCode::kErrorNotFound == ec);
 }
 
+BOOST_FIXTURE_TEST_CASE(name_index_create_and_remove_many_entries, NameIndexFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory("home"));
+  for (int i = 0; i < kMany; ++i) {
+    BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory(to_s(i)));
+    BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("home/" + to_s(i)));
+  }
+  for (int i = 0; i < kMany; i += 3) {
+    BOOST_REQUIRE(ErrorCode::kSuccess == Remove(to_s(i)));
+    BOOST_REQUIRE(ErrorCode::kSuccess == Remove("home/" + to_s(i)));
+  }
+
+  std::vector<std::string> expected;
+  for (int i = 0; i < kMany; ++i) {
+    bool removed = i % 3 == 0;
+    if (!removed)
+      expected.push_back(to_s(i));
+    BOOST_CHECK(fs->IsDirectory(to_s(i).c_str(), &ec) == !removed);
+    BOOST_CHECK(ec == (removed ? ErrorCode::kErrorNotFound : ErrorCode::kSuccess));
+    BOOST_CHECK((ErrorCode::kErrorExists == OpenFile("home/" + to_s(i), file, true)) ==
+                !removed);
+    file.reset();
+  }
+  expected.push_back("home");
+
+  std::vector<std::string> contents;
+  BOOST_CHECK(ErrorCode::kSuccess == ListDirectory("/", contents));
+  std::sort(contents.begin(), contents.end());
+  std::sort(expected.begin(), expected.end());
+  BOOST_CHECK(contents == expected);
+}
+
+BOOST_FIXTURE_TEST_CASE(name_index_finds_names_with_same_hash, NameIndexFSFixture) {
+  // Both names have the same FNV-1a hash.
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory("costarring"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("liquid"));
+
+  BOOST_CHECK(fs->IsDirectory("costarring", &ec));
+  BOOST_CHECK(!fs->IsDirectory("liquid", &ec));
+  BOOST_CHECK(ErrorCode::kSuccess == ec);
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == Remove("costarring"));
+  BOOST_CHECK(!fs->IsDirectory("liquid", &ec));
+  BOOST_CHECK(ErrorCode::kSuccess == ec);
+  BOOST_CHECK(ErrorCode::kErrorNotFound == Remove("costarring"));
+}
+
+BOOST_FIXTURE_TEST_CASE(name_index_reuses_slots_and_sections, NameIndexFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory("home"));
+  for (int i = 0; i < kMany; ++i)
+    BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory("home/" + to_s(i)));
+  uintmax_t device_size = boost::filesystem::file_size(device_path);
+  for (int i = 0; i < kMany; ++i)
+    BOOST_REQUIRE(ErrorCode::kSuccess == Remove("home/" + to_s(i)));
+
+  for (int i = 0; i < kMany; ++i)
+    BOOST_CHECK(ErrorCode::kSuccess == CreateDirectory("home/" + to_s(i)));
+  BOOST_CHECK(device_size == boost::filesystem::file_size(device_path));
+
+  for (int i = 0; i < kMany; ++i)
+    BOOST_REQUIRE(ErrorCode::kSuccess == Remove("home/" + to_s(i)));
+  BOOST_CHECK(ErrorCode::kSuccess == Remove("home"));
+}
+
+BOOST_FIXTURE_TEST_CASE(name_index_scans_slots_if_table_cant_grow, NameIndexFSFixture) {
+  // Interleave the sections of two files, so that removing one of them leaves
+  // only small unused sections.
+  ScopedFile other;
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("a", file, true));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("b", other, true));
+  for (int i = 0; i < 4 * kMany; ++i) {
+    BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, std::string(512, 'a')));
+    BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(other, std::string(512, 'b')));
+  }
+  file.reset();
+  other.reset();
+  BOOST_REQUIRE(ErrorCode::kSuccess == Remove("a"));
+  FilesystemInterface::Stats stats;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats(&stats));
+  // The table of 2 * kMany entries is much bigger.
+  BOOST_REQUIRE(stats.largest_free_extent <= 2);
+
+  uintmax_t device_size = boost::filesystem::file_size(device_path);
+  {
+    FileSizeLimit limit(device_size);
+    BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory("home"));
+    for (int i = 0; i < 2 * kMany; ++i)
+      BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory("home/" + to_s(i)));
+    for (int i = 0; i < 2 * kMany; i += 3)
+      BOOST_REQUIRE(ErrorCode::kSuccess == Remove("home/" + to_s(i)));
+
+    BOOST_REQUIRE(ErrorCode::kSuccess == Create(fs));
+    BOOST_REQUIRE(ErrorCode::kSuccess == Load(device_path));
+    for (int i = 0; i < 2 * kMany; ++i)
+      BOOST_CHECK(fs->IsDirectory(("home/" + to_s(i)).c_str(), &ec) == (i % 3 != 0));
+    BOOST_CHECK(ErrorCode::kErrorNotFound == Remove("home/0"));
+  }
+  BOOST_CHECK(device_size == boost::filesystem::file_size(device_path));
+
+  // The table comes back as soon as there is room for it.
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory("home/" + to_s(2 * kMany)));
+  BOOST_REQUIRE(ErrorCode::kSuccess == Create(fs));
+  BOOST_REQUIRE(ErrorCode::kSuccess == Load(device_path));
+  uint64_t reads = DeviceReads();
+  for (int i = 0; i <= 2 * kMany; ++i)
+    BOOST_CHECK(fs->IsDirectory(("home/" + to_s(i)).c_str(), &ec) == (i % 3 != 0));
+  // A scan would take at least one read per entry.
+  BOOST_CHECK(DeviceReads() - reads < 2 * kMany * 10);
+}
+
+BOOST_FIXTURE_TEST_CASE(name_index_survives_reloading, NameIndexFSFixture) {
+  for (int i = 0; i < kMany; ++i)
+    BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory(to_s(i)));
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == Create(fs));
+  BOOST_REQUIRE(ErrorCode::kSuccess == Load(device_path));
+  for (int i = 0; i < kMany; ++i)
+    BOOST_CHECK(fs->IsDirectory(to_s(i).c_str(), &ec));
+  BOOST_CHECK(ErrorCode::kSuccess == Remove(to_s(0)));
+  BOOST_CHECK(ErrorCode::kSuccess == CreateFile(to_s(0)));
+  BOOST_CHECK(!fs->IsDirectory(to_s(0).c_str(), &ec));
+  BOOST_CHECK(ErrorCode::kSuccess == ec);
+}
+
+BOOST_FIXTURE_TEST_CASE(tagged_slots_create_and_remove_many_entries, TaggedSlotsFSFixture) {
+  for (int i = 0; i < kMany; ++i)
+    BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory(to_s(i)));
+  for (int i = 0; i < kMany; i += 3)
+    BOOST_REQUIRE(ErrorCode::kSuccess == Remove(to_s(i)));
+
+  std::vector<std::string> expected;
+  for (int i = 0; i < kMany; ++i) {
+    bool removed = i % 3 == 0;
+    if (!removed)
+      expected.push_back(to_s(i));
+    BOOST_CHECK(fs->IsDirectory(to_s(i).c_str(), &ec) == !removed);
+    BOOST_CHECK(ec == (removed ? ErrorCode::kErrorNotFound : ErrorCode::kSuccess));
+  }
+
+  std::vector<std::string> contents;
+  BOOST_CHECK(ErrorCode::kSuccess == ListDirectory("/", contents));
+  BOOST_CHECK(contents == expected);
+}
+
+BOOST_FIXTURE_TEST_CASE(tagged_slots_find_names_with_same_fingerprint, TaggedSlotsFSFixture) {
+  // Both names have the same FNV-1a hash.
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("costarring"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory("liquid"));
+
+  BOOST_CHECK(!fs->IsDirectory("costarring", &ec));
+  BOOST_CHECK(fs->IsDirectory("liquid", &ec));
+  BOOST_CHECK(ErrorCode::kSuccess == ec);
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == Remove("liquid"));
+  BOOST_CHECK(fs->IsFile("costarring", &ec));
+  BOOST_CHECK(ErrorCode::kSuccess == ec);
+}
+
+BOOST_FIXTURE_TEST_CASE(tagged_slots_list_all_types, TaggedSlotsWithNameIndexFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory("home"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("home/.profile"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateSymlink("home/lnk", "/home/.profile"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory("home/user"));
+
+  std::vector<std::string> contents;
+  BOOST_CHECK(ErrorCode::kSuccess == ListDirectory("home", contents));
+  BOOST_CHECK(contents == std::vector<std::string>({".profile", "lnk", "user"}));
+  BOOST_CHECK(fs->IsSymlink("home/lnk", &ec));
+
+  // The background passes skip symlinks.
+  BOOST_CHECK(ErrorCode::kSuccess == fs->Defragment(FilesystemInterface::DefragmenterOptions()));
+  BOOST_CHECK(ErrorCode::kSuccess == Remove("home/lnk"));
+  BOOST_CHECK(ErrorCode::kSuccess == Remove("home/.profile"));
+  BOOST_CHECK(ErrorCode::kSuccess == Remove("home/user"));
+  BOOST_CHECK(ErrorCode::kSuccess == Remove("home"));
+}
+
+BOOST_FIXTURE_TEST_CASE(dentry_cache_follows_changes, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory("home"));
+  for (int i = 0; i < kMany; ++i)
+    BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory("home/" + to_s(i)));
+  // The first lookup remembers the whole directory.
+  BOOST_REQUIRE(fs->IsDirectory("home/0", &ec));
+
+  for (int i = 0; i < kMany; i += 3) {
+    BOOST_REQUIRE(ErrorCode::kSuccess == Remove("home/" + to_s(i)));
+    BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("home/" + to_s(i) + "f"));
+  }
+
+  for (int i = 0; i < kMany; ++i) {
+    bool removed = i % 3 == 0;
+    BOOST_CHECK(fs->IsDirectory(("home/" + to_s(i)).c_str(), &ec) == !removed);
+    BOOST_CHECK(ec == (removed ? ErrorCode::kErrorNotFound : ErrorCode::kSuccess));
+    BOOST_CHECK(fs->IsFile(("home/" + to_s(i) + "f").c_str(), &ec) == removed);
+  }
+  BOOST_CHECK(ErrorCode::kErrorExists == CreateDirectory("home/1"));
+  BOOST_CHECK(ErrorCode::kErrorExists == CreateDirectory("home/0f"));
+}
+
+BOOST_FIXTURE_TEST_CASE(dentry_cache_forgets_removed_dir, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory("old"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("old/file"));
+  BOOST_REQUIRE(fs->IsFile("old/file", &ec));
+  BOOST_REQUIRE(ErrorCode::kSuccess == Remove("old/file"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == Remove("old"));
+
+  // The new directory likely takes the place of the old one.
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory("new"));
+  BOOST_CHECK(!fs->IsFile("new/file", &ec));
+  BOOST_CHECK(ErrorCode::kErrorNotFound == ec);
+  BOOST_CHECK(ErrorCode::kSuccess == CreateFile("new/file"));
+}
+
+BOOST_FIXTURE_TEST_CASE(dentry_cache_under_small_budget, LoadedFSFixture) {
+  for (uint64_t budget : {uint64_t(0), uint64_t(1024), uint64_t(16 << 20)}) {
+    fs->SetDirectoryCacheBudget(budget);
+    std::string dir = "dir" + to_s(budget);
+    BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory(dir));
+    for (int i = 0; i < kMany; ++i) {
+      BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile(dir + "/" + to_s(i)));
+      // Make the cache switch between the directories.
+      BOOST_REQUIRE(fs->IsDirectory(dir.c_str(), &ec));
+    }
+    for (int i = 0; i < kMany; ++i) {
+      BOOST_CHECK(fs->IsFile((dir + "/" + to_s(i)).c_str(), &ec));
+      BOOST_CHECK(ErrorCode::kErrorExists == CreateFile(dir + "/" + to_s(i)));
+    }
+    BOOST_CHECK(!fs->IsFile((dir + "/" + to_s(kMany)).c_str(), &ec));
+    BOOST_CHECK(ErrorCode::kErrorNotFound == ec);
+  }
+}
+
+BOOST_FIXTURE_TEST_CASE(dentry_cache_filters_big_dir, LoadedFSFixture) {
+  // Only the filter of the directory fits in the budget, and it's rebuilt
+  // when it gets overfull.
+  constexpr int kMore = 3 * kMany;
+  fs->SetDirectoryCacheBudget(4096);
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory("big"));
+  for (int i = 0; i < kMore; ++i)
+    BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("big/" + to_s(i)));
+  for (int i = 0; i < kMore; i += 2)
+    BOOST_REQUIRE(ErrorCode::kSuccess == Remove("big/" + to_s(i)));
+
+  for (int i = 0; i < kMore; ++i) {
+    bool removed = i % 2 == 0;
+    BOOST_CHECK(fs->IsFile(("big/" + to_s(i)).c_str(), &ec) == !removed);
+    BOOST_CHECK(ec == (removed ? ErrorCode::kErrorNotFound : ErrorCode::kSuccess));
+    BOOST_CHECK(!fs->IsFile(("big/" + to_s(i + kMore)).c_str(), &ec));
+    BOOST_CHECK(ErrorCode::kErrorNotFound == ec);
+  }
+  BOOST_CHECK(ErrorCode::kSuccess == CreateDirectory("big/0"));
+  BOOST_CHECK(ErrorCode::kErrorExists == CreateDirectory("big/1"));
+  BOOST_CHECK(ErrorCode::kErrorExists == CreateSymlink("big/0", "/big/1"));
+}
+
+BOOST_FIXTURE_TEST_CASE(dentry_cache_filter_answers_misses_without_reads, LoadedFSFixture) {
+  constexpr int kMore = 3 * kMany;
+  // The filter of the directory fits in the budget, its entries don't.
+  fs->SetDirectoryCacheBudget(4096);
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory("big"));
+  for (int i = 0; i < kMore; ++i)
+    BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("big/" + to_s(i)));
+  BOOST_REQUIRE(!fs->IsFile("big/missing", &ec));
+
+  uint64_t reads = DeviceReads();
+  for (int i = 0; i < kMany; ++i)
+    BOOST_REQUIRE(!fs->IsFile(("big/" + to_s(i + kMore)).c_str(), &ec));
+  // A scan would take at least one read per entry.
+  BOOST_CHECK(DeviceReads() - reads < kMore);
+}
+
+BOOST_FIXTURE_TEST_CASE(dentry_cache_doesnt_rescan_oversized_dir, LoadedFSFixture) {
+  constexpr int kMore = 3 * kMany;
+  // Not even the filter of the directory fits in the budget.
+  fs->SetDirectoryCacheBudget(512);
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory("big"));
+  for (int i = 0; i < kMore; ++i)
+    BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("big/" + to_s(i)));
+  BOOST_REQUIRE(!fs->IsFile("big/missing", &ec));
+
+  // Lookups stop at the found entry instead of scanning the whole directory.
+  uint64_t reads = DeviceReads();
+  for (int i = 0; i < kMany; ++i)
+    BOOST_REQUIRE(fs->IsFile("big/0", &ec));
+  BOOST_CHECK(DeviceReads() - reads < kMany * 10);
+  // And a miss reads each entry once.
+  reads = DeviceReads();
+  BOOST_REQUIRE(!fs->IsFile("big/missing", &ec));
+  BOOST_CHECK(DeviceReads() - reads < 2 * kMore);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
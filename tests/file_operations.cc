@@ -1,4 +1,10 @@
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iterator>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "tests/filesystem_fixtures.h"
 
@@ -23,6 +29,175 @@ std::string to_s(T t) {
   return std::to_string(t);
 }
 
+// Appends records of every thread to the same file and checks them.
+void AppendFromManyThreads(LoadedFSFixture& fixture) {
+  constexpr int kThreads = 8;
+  constexpr size_t kRecordSize = k100KB / kMany;
+  LoadedFSFixture::ScopedFile files[kThreads];
+  for (LoadedFSFixture::ScopedFile& file : files)
+    BOOST_REQUIRE(ErrorCode::kSuccess == fixture.OpenFile("1", file));
+
+  // Every thread appends records of its own letter through its own handle
+  // and remembers where they were written.
+  std::vector<std::vector<uint64_t>> offsets(kThreads);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; ++i)
+    threads.emplace_back([i, &files, &offsets] {
+      std::string record(kRecordSize, 'a' + i);
+      ErrorCode error_code;
+      for (int j = 0; j < kMany; ++j) {
+        uint64_t offset = files[i]->Append(record.data(), record.size(), &error_code);
+        if (error_code == ErrorCode::kSuccess)
+          offsets[i].push_back(offset);
+      }
+    });
+  for (std::thread& thread : threads)
+    thread.join();
+
+  BOOST_CHECK(files[0]->GetSize() == kThreads * kMany * kRecordSize);
+  std::string from_file(kThreads * kMany * kRecordSize, '\0');
+  BOOST_REQUIRE(ErrorCode::kSuccess == fixture.ReadFile(files[0], from_file));
+  for (int i = 0; i < kThreads; ++i) {
+    BOOST_CHECK(offsets[i].size() == kMany);
+    for (uint64_t offset : offsets[i])
+      BOOST_CHECK(from_file.substr(offset, kRecordSize) == std::string(kRecordSize, 'a' + i));
+  }
+}
+
+// Appends records to a file in many threads, while another thread writes
+// marks at its end, and checks that no append has overwritten a mark.
+void AppendAndWriteAtEndFromManyThreads(LoadedFSFixture& fixture) {
+  constexpr int kThreads = 4;
+  constexpr size_t kRecordSize = k100KB / kMany;
+  const std::string mark(kRecordSize / 10, 'z');
+  LoadedFSFixture::ScopedFile files[kThreads + 1];
+  for (LoadedFSFixture::ScopedFile& file : files)
+    BOOST_REQUIRE(ErrorCode::kSuccess == fixture.OpenFile("1", file));
+
+  std::vector<int> errors(kThreads + 1);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; ++i)
+    threads.emplace_back([i, &files, &errors] {
+      std::string record(kRecordSize, 'a' + i);
+      ErrorCode error_code;
+      for (int j = 0; j < kMany; ++j) {
+        files[i]->Append(record.data(), record.size(), &error_code);
+        errors[i] += error_code != ErrorCode::kSuccess;
+      }
+    });
+  // The marks are written at the size the thread sees, which may lag behind
+  // the reservations.
+  std::vector<uint64_t> marks;
+  threads.emplace_back([&files, &errors, &marks, &mark] {
+    ErrorCode error_code;
+    for (int j = 0; j < kMany; ++j) {
+      uint64_t offset = files[kThreads]->GetSize();
+      files[kThreads]->WriteAt(offset, mark.data(), mark.size(), &error_code);
+      errors[kThreads] += error_code != ErrorCode::kSuccess;
+      marks.push_back(offset);
+    }
+  });
+  for (std::thread& thread : threads)
+    thread.join();
+
+  for (int error : errors)
+    BOOST_CHECK(error == 0);
+  std::string from_file(files[0]->GetSize(), '\0');
+  BOOST_REQUIRE(ErrorCode::kSuccess == fixture.OpenFile("1", fixture.file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == fixture.ReadFile(fixture.file, from_file));
+  for (uint64_t offset : marks)
+    BOOST_CHECK(from_file.substr(offset, mark.size()) == mark);
+}
+
+// Writes pages of a file in many threads through one handle, while other
+// threads read them through another one, and checks the pages.
+void AppendAfterFailedWrite(LoadedFSFixture& fixture) {
+  LoadedFSFixture::ScopedFile file;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fixture.CreateFile("1", "1234567890"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == fixture.OpenFile("1", file));
+
+  // The device can't grow, so there is no room for the data past the end.
+  ErrorCode error_code;
+  {
+    FileSizeLimit limit(boost::filesystem::file_size(fixture.device_path));
+    std::string data(k1MB, 'a');
+    file->WriteAt(10, data.data(), data.size(), &error_code);
+    BOOST_REQUIRE(error_code != ErrorCode::kSuccess);
+  }
+  BOOST_CHECK(file->GetSize() == 10);
+
+  // The failed write leaves no gap before the next append.
+  BOOST_CHECK(file->Append("ab", 2, &error_code) == 10);
+  BOOST_CHECK(error_code == ErrorCode::kSuccess);
+  BOOST_CHECK(file->GetSize() == 12);
+  std::string from_file(13, '\0');
+  BOOST_CHECK(ErrorCode::kSuccess == fixture.ReadFile(file, from_file));
+  BOOST_CHECK(from_file == "1234567890ab");
+}
+
+void WritePagesFromManyThreads(LoadedFSFixture& fixture) {
+  constexpr int kThreads = 8;
+  constexpr size_t kPageSize = 4096;
+  constexpr int kPages = kMany / 4 * kThreads;
+  LoadedFSFixture::ScopedFile file, file2;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fixture.OpenFile("1", file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == fixture.OpenFile("1", file2));
+  // Allocate half of the pages, the rest are written after the end of the file.
+  BOOST_REQUIRE(ErrorCode::kSuccess ==
+                fixture.WriteFile(file, std::string(kPages / 2 * kPageSize, '0')));
+
+  std::vector<int> errors(2 * kThreads);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; ++i) {
+    // Thread |i| writes every |kThreads|-th page, the pages are interleaved.
+    threads.emplace_back([i, &file, &errors] {
+      ErrorCode error_code;
+      for (int page = i; page < kPages; page += kThreads) {
+        std::string data(kPageSize, 'a' + page % 26);
+        file->WriteAt(page * kPageSize, data.data(), data.size(), &error_code);
+        errors[i] += error_code != ErrorCode::kSuccess;
+      }
+    });
+    threads.emplace_back([i, &file2, &errors] {
+      ErrorCode error_code;
+      std::string data(kPageSize, '\0');
+      for (int page = kPages - 1 - i; page >= 0; page -= kThreads) {
+        size_t read = file2->ReadAt(page * kPageSize, &data[0], data.size(), &error_code);
+        // A page is either old (or a hole) or new, never mixed.
+        bool consistent = read == 0 ||
+                          (data.substr(0, read) == std::string(read, data[0]) &&
+                           (data[0] == '0' || data[0] == '\0' || data[0] == 'a' + page % 26));
+        errors[kThreads + i] += error_code != ErrorCode::kSuccess || !consistent;
+      }
+    });
+  }
+  for (std::thread& thread : threads)
+    thread.join();
+
+  for (int error : errors)
+    BOOST_CHECK(error == 0);
+  BOOST_CHECK(file->GetSize() == kPages * kPageSize);
+  std::string from_file(kPages * kPageSize, '\0');
+  BOOST_REQUIRE(ErrorCode::kSuccess == fixture.ReadFile(file2, from_file));
+  for (int page = 0; page < kPages; ++page)
+    BOOST_CHECK(from_file.substr(page * kPageSize, kPageSize) ==
+                std::string(kPageSize, 'a' + page % 26));
+}
+
+// Concatenates the spans of |range| and releases it.
+std::string ReadMappedRange(FileInterface::MappedRange* range) {
+  std::string data;
+  for (size_t i = 0; i < range->spans_count(); ++i) {
+    const FileInterface::MappedRange::Span& span = range->spans()[i];
+    if (span.data != nullptr)
+      data.append(span.data, span.size);
+    else
+      data.append(span.size, '\0');
+  }
+  range->Release();
+  return data;
+}
+
 }  // namespace
 
 BOOST_FIXTURE_TEST_CASE(open_one_file, LoadedFSFixture) {
@@ -267,6 +442,845 @@ BOOST_FIXTURE_TEST_CASE(write_many_bytes_if_reuse_unused_sections, LoadedFSFixtu
   BOOST_CHECK(device_size == boost::filesystem::file_size(device_path));
 }
 
+BOOST_FIXTURE_TEST_CASE(write_many_small_chunks_takes_no_more_space_than_one_write, LoadedFSFixture) {
+  uintmax_t device_size = boost::filesystem::file_size(device_path);
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", std::string(k100KB, 'a')));
+  uintmax_t one_write_size = boost::filesystem::file_size(device_path) - device_size;
+  device_size += one_write_size;
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("2", file));
+
+  for (int i = 0; i < kMany; ++i)
+    BOOST_CHECK(ErrorCode::kSuccess == WriteFile(file, std::string(k100KB / kMany, 'a' + i % 26)));
+  BOOST_CHECK(boost::filesystem::file_size(device_path) - device_size <= one_write_size);
+}
+
+BOOST_FIXTURE_TEST_CASE(grow_in_place_over_the_end_of_long_unused_chain, LoadedFSFixture) {
+  // The unused sections are chained in the order opposite to their release,
+  // so the neighbours of the first one are at the end of the chain.
+  for (int i = 0; i < kMany; ++i)
+    BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile(to_s(i), "1"));
+  for (int i = 1; i < kMany; ++i)
+    BOOST_REQUIRE(ErrorCode::kSuccess == Remove(to_s(i)));
+  BOOST_REQUIRE(ErrorCode::kSuccess == Remove("0"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+
+  uint64_t reads = DeviceReads();
+  for (int i = 0; i < kMany; ++i)
+    BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, std::string(k100KB / kMany, 'a')));
+  BOOST_CHECK(DeviceReads() - reads < 10 * kMany);
+}
+
+BOOST_FIXTURE_TEST_CASE(read_many_small_chunks_after_interleaved_writes, LoadedFSFixture) {
+  ScopedFile file1, file2;
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file1));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("2", file2));
+  std::string to_file1, to_file2;
+  for (int i = 0; i < kMany; ++i) {
+    std::string to_file1_i(k100KB / kMany, 'a' + i % 26);
+    std::string to_file2_i(k100KB / kMany, 'z' - i % 26);
+    BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file1, to_file1_i));
+    BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file2, to_file2_i));
+    to_file1 += to_file1_i;
+    to_file2 += to_file2_i;
+  }
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file1));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("2", file2));
+
+  std::string from_file1(to_file1.size(), '\0'), from_file2(to_file2.size(), '\0');
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file1, from_file1));
+  BOOST_CHECK(from_file1 == to_file1);
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file2, from_file2));
+  BOOST_CHECK(from_file2 == to_file2);
+}
+
+BOOST_FIXTURE_TEST_CASE(read_fragmented_file_at_random_cursors_while_appending, LoadedFSFixture) {
+  ScopedFile file1, file2, reader;
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file1));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("2", file2));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", reader));
+  std::string to_file1;
+  for (int i = 0; i < kMany; ++i) {
+    std::string to_file1_i(k100KB / kMany, 'a' + i % 26);
+    BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file1, to_file1_i));
+    BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file2, std::string(k100KB / kMany, 'z')));
+    to_file1 += to_file1_i;
+
+    // Read the part of the file which has just been appended, and the
+    // part written a long time ago.
+    for (uint64_t cursor : {to_file1.size() - to_file1_i.size(), to_file1.size() / 3}) {
+      std::string from_file1(to_file1_i.size(), '\0');
+      BOOST_REQUIRE(ErrorCode::kSuccess == reader->SetCursor(cursor));
+      BOOST_REQUIRE(ErrorCode::kSuccess == ReadFile(reader, from_file1));
+      BOOST_CHECK(from_file1 == to_file1.substr(cursor, to_file1_i.size()));
+    }
+  }
+}
+
+BOOST_FIXTURE_TEST_CASE(extent_tree_read_many_bytes, ExtentTreeFSFixture) {
+  std::string to_file(k1MB, '\0');
+  for (size_t i = 0; i < to_file.size(); ++i)
+    to_file[i] = 'a' + i % 26;
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", to_file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+
+  std::string from_file(to_file.size(), '\0');
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file));
+  BOOST_CHECK(from_file == to_file);
+}
+
+BOOST_FIXTURE_TEST_CASE(extent_tree_read_fragmented_files_after_reload, ExtentTreeFSFixture) {
+  ScopedFile file1, file2;
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file1));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("2", file2));
+  // Every write takes a new section, so there are several levels of nodes.
+  std::string to_file1, to_file2;
+  for (int i = 0; i < 10 * kMany; ++i) {
+    std::string to_file1_i(k100KB / kMany, 'a' + i % 26);
+    std::string to_file2_i(k100KB / kMany / 2, 'z' - i % 26);
+    BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file1, to_file1_i));
+    BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file2, to_file2_i));
+    to_file1 += to_file1_i;
+    to_file2 += to_file2_i;
+  }
+  // Overwrite the middle of the file.
+  BOOST_REQUIRE(ErrorCode::kSuccess == file1->SetCursor(to_file1.size() / 3));
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file1, std::string(k100KB, '1')));
+  to_file1.replace(to_file1.size() / 3, k100KB, k100KB, '1');
+  file1.reset();
+  file2.reset();
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == Create(fs));
+  BOOST_REQUIRE(ErrorCode::kSuccess == Load(device_path));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file1));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("2", file2));
+  for (uint64_t cursor : {to_file1.size() / 2, to_file1.size() - k100KB, uint64_t(0)}) {
+    std::string from_file1(k100KB, '\0');
+    BOOST_REQUIRE(ErrorCode::kSuccess == file1->SetCursor(cursor));
+    BOOST_REQUIRE(ErrorCode::kSuccess == ReadFile(file1, from_file1));
+    BOOST_CHECK(from_file1 == to_file1.substr(cursor, k100KB));
+  }
+  std::string from_file2(to_file2.size(), '\0');
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file2, from_file2));
+  BOOST_CHECK(from_file2 == to_file2);
+}
+
+BOOST_FIXTURE_TEST_CASE(extent_tree_remove_releases_all_sections, ExtentTreeFSFixture) {
+  ScopedFile file1, file2;
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file1));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("2", file2));
+  for (int i = 0; i < 10 * kMany; ++i) {
+    BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file1, std::string(k100KB / kMany, 'a')));
+    BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file2, std::string(k100KB / kMany, 'b')));
+  }
+  file1.reset();
+  file2.reset();
+
+  FilesystemInterface::EntryStats entry_stats;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats("1", &entry_stats));
+  BOOST_CHECK(entry_stats.sections > 10 * kMany);
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == Remove("1"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == Remove("2"));
+  FilesystemInterface::Stats stats;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats(&stats));
+  // Only the root directory is left.
+  BOOST_CHECK(stats.free_clusters == stats.total_clusters - 1);
+}
+
+BOOST_FIXTURE_TEST_CASE(truncate_file, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", "1234567890"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+
+  BOOST_CHECK(ErrorCode::kSuccess == file->Truncate(4));
+  BOOST_CHECK(file->GetSize() == 4);
+  std::string from_file(5, '\0');
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file));
+  BOOST_CHECK(from_file == "1234");
+
+  // Write after the new end of the file.
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, "ab"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  from_file.assign(7, '\0');
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file));
+  BOOST_CHECK(from_file == "1234ab");
+}
+
+BOOST_FIXTURE_TEST_CASE(truncate_file_to_bigger_size, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", "12"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+
+  BOOST_CHECK(ErrorCode::kSuccess == file->Truncate(k100KB));
+  BOOST_CHECK(file->GetSize() == k100KB);
+  std::string from_file(k100KB, 'a');
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file));
+  BOOST_CHECK(from_file == "12" + std::string(k100KB - 2, '\0'));
+}
+
+BOOST_FIXTURE_TEST_CASE(truncate_file_moves_no_cursor, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", "1234567890"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetCursor(8));
+
+  BOOST_CHECK(ErrorCode::kSuccess == file->Truncate(5));
+  BOOST_CHECK(file->GetCursor() == 8);
+  BOOST_CHECK(ErrorCode::kSuccess == WriteFile(file, "1"));
+  BOOST_CHECK(file->GetSize() == 9);
+}
+
+BOOST_FIXTURE_TEST_CASE(truncate_file_with_buffered_writes_elsewhere, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", "1234567890"));
+  ScopedFile file2;
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file2));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetWriteBuffer(k100KB));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetCursor(8));
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, "ab"));
+
+  // The buffered data is kept and the gap is filled with zeros.
+  BOOST_CHECK(ErrorCode::kSuccess == file2->Truncate(4));
+  BOOST_CHECK(ErrorCode::kSuccess == file->Flush());
+  std::string from_file(11, '\0');
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file2, from_file));
+  BOOST_CHECK(from_file == std::string("1234\0\0\0\0ab", 10));
+}
+
+BOOST_FIXTURE_TEST_CASE(truncate_fragmented_file_releases_sections, LoadedFSFixture) {
+  ScopedFile file1, file2;
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file1));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("2", file2));
+  std::string to_file1;
+  for (int i = 0; i < kMany; ++i) {
+    std::string to_file1_i(k100KB / kMany, 'a' + i % 26);
+    BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file1, to_file1_i));
+    BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file2, to_file1_i));
+    to_file1 += to_file1_i;
+  }
+  FilesystemInterface::Stats before;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats(&before));
+
+  BOOST_CHECK(ErrorCode::kSuccess == file1->Truncate(k100KB / 3));
+  FilesystemInterface::Stats after;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats(&after));
+  BOOST_CHECK(after.free_clusters > before.free_clusters);
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file1));
+  std::string from_file1(k100KB, '\0');
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file1, from_file1));
+  BOOST_CHECK(from_file1 == to_file1.substr(0, k100KB / 3));
+
+  // Nothing is left after the file is removed.
+  file1.reset();
+  file2.reset();
+  BOOST_REQUIRE(ErrorCode::kSuccess == Remove("1"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == Remove("2"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats(&after));
+  BOOST_CHECK(after.free_clusters == after.total_clusters - 1);
+}
+
+BOOST_FIXTURE_TEST_CASE(extent_tree_truncate_fragmented_file, ExtentTreeFSFixture) {
+  ScopedFile file1, file2;
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file1));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("2", file2));
+  std::string to_file1;
+  for (int i = 0; i < 10 * kMany; ++i) {
+    std::string to_file1_i(k100KB / kMany, 'a' + i % 26);
+    BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file1, to_file1_i));
+    BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file2, to_file1_i));
+    to_file1 += to_file1_i;
+  }
+
+  uint64_t size = to_file1.size() / 3 + 1;
+  BOOST_CHECK(ErrorCode::kSuccess == file1->Truncate(size));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file1->SetCursor(size));
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file1, "123"));
+  to_file1 = to_file1.substr(0, size) + "123";
+
+  file1.reset();
+  file2.reset();
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == Create(fs));
+  BOOST_REQUIRE(ErrorCode::kSuccess == Load(device_path));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file1));
+  std::string from_file1(to_file1.size() + 1, '\0');
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file1, from_file1));
+  BOOST_CHECK(from_file1 == to_file1);
+
+  file1.reset();
+  BOOST_REQUIRE(ErrorCode::kSuccess == Remove("1"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == Remove("2"));
+  FilesystemInterface::Stats stats;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats(&stats));
+  BOOST_CHECK(stats.free_clusters == stats.total_clusters - 1);
+}
+
+BOOST_FIXTURE_TEST_CASE(extent_tree_write_sparse_file, ExtentTreeFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  uintmax_t device_size = boost::filesystem::file_size(device_path);
+
+  // Holes take no space.
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetCursor(10 * k1MB));
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, "123"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->Truncate(20 * k1MB));
+  BOOST_CHECK(file->GetSize() == 20 * k1MB);
+  BOOST_CHECK(boost::filesystem::file_size(device_path) < device_size + k100KB);
+
+  std::string from_file(5, 'a');
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetCursor(10 * k1MB - 1));
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file));
+  BOOST_CHECK(from_file == std::string("\0" "123\0", 5));
+
+  // Fill the hole partially.
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetCursor(k1MB));
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, std::string(k100KB, 'b')));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetCursor(k1MB - 1));
+  from_file.assign(k100KB + 2, 'a');
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file));
+  BOOST_CHECK(from_file == '\0' + std::string(k100KB, 'b') + '\0');
+}
+
+BOOST_FIXTURE_TEST_CASE(extent_tree_find_data_and_holes, ExtentTreeFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetCursor(k1MB));
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, std::string(k100KB, 'a')));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetCursor(3 * k1MB));
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, std::string(k100KB, 'b')));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->Truncate(4 * k1MB));
+
+  BOOST_CHECK(file->FindData(0, &ec) == k1MB);
+  BOOST_CHECK(ec == ErrorCode::kSuccess);
+  BOOST_CHECK(file->FindHole(k1MB, &ec) == k1MB + k100KB);
+  BOOST_CHECK(ec == ErrorCode::kSuccess);
+  BOOST_CHECK(file->FindData(k1MB + k100KB, &ec) == 3 * k1MB);
+  BOOST_CHECK(file->FindData(3 * k1MB + 1, &ec) == 3 * k1MB + 1);
+  BOOST_CHECK(file->FindHole(3 * k1MB + 1, &ec) == 3 * k1MB + k100KB);
+  BOOST_CHECK(file->FindHole(0, &ec) == 0);
+
+  file->FindData(3 * k1MB + k100KB, &ec);
+  BOOST_CHECK(ec == ErrorCode::kErrorNotFound);
+  BOOST_CHECK(file->FindHole(5 * k1MB, &ec) == 5 * k1MB);
+  BOOST_CHECK(ec == ErrorCode::kSuccess);
+}
+
+BOOST_FIXTURE_TEST_CASE(find_data_and_holes_in_file_without_extent_tree, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetCursor(k100KB));
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, "123"));
+
+  // The hole is filled with zeros.
+  BOOST_CHECK(file->FindData(0, &ec) == 0);
+  BOOST_CHECK(ec == ErrorCode::kSuccess);
+  BOOST_CHECK(file->FindHole(0, &ec) == k100KB + 3);
+  BOOST_CHECK(ec == ErrorCode::kSuccess);
+  std::string from_file(k100KB + 3, 'a');
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetCursor(0));
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file));
+  BOOST_CHECK(from_file == std::string(k100KB, '\0') + "123");
+}
+
+BOOST_FIXTURE_TEST_CASE(append_to_file, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", "1234567890"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+
+  BOOST_CHECK(file->Append("ab", 2, &ec) == 10);
+  BOOST_CHECK(ec == ErrorCode::kSuccess);
+  BOOST_CHECK(file->Append("cd", 2, &ec) == 12);
+  BOOST_CHECK(ec == ErrorCode::kSuccess);
+  BOOST_CHECK(file->GetSize() == 14);
+  BOOST_CHECK(file->GetCursor() == 0);
+
+  std::string from_file(15, '\0');
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file));
+  BOOST_CHECK(from_file == "1234567890abcd");
+}
+
+BOOST_FIXTURE_TEST_CASE(append_after_failed_write, LoadedFSFixture) {
+  AppendAfterFailedWrite(*this);
+}
+
+BOOST_FIXTURE_TEST_CASE(extent_tree_append_after_failed_write, ExtentTreeFSFixture) {
+  AppendAfterFailedWrite(*this);
+}
+
+BOOST_FIXTURE_TEST_CASE(append_to_file_from_many_threads, LoadedFSFixture) {
+  AppendFromManyThreads(*this);
+}
+
+BOOST_FIXTURE_TEST_CASE(extent_tree_append_to_file_from_many_threads, ExtentTreeFSFixture) {
+  AppendFromManyThreads(*this);
+}
+
+BOOST_FIXTURE_TEST_CASE(append_and_write_at_end_from_many_threads, LoadedFSFixture) {
+  AppendAndWriteAtEndFromManyThreads(*this);
+}
+
+BOOST_FIXTURE_TEST_CASE(extent_tree_append_and_write_at_end_from_many_threads,
+                        ExtentTreeFSFixture) {
+  AppendAndWriteAtEndFromManyThreads(*this);
+}
+
+BOOST_FIXTURE_TEST_CASE(write_pages_from_many_threads, LoadedFSFixture) {
+  WritePagesFromManyThreads(*this);
+}
+
+BOOST_FIXTURE_TEST_CASE(extent_tree_write_pages_from_many_threads, ExtentTreeFSFixture) {
+  WritePagesFromManyThreads(*this);
+}
+
+BOOST_FIXTURE_TEST_CASE(map_range_of_fragmented_file, LoadedFSFixture) {
+  ScopedFile file1, file2;
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file1));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("2", file2));
+  std::string to_file1;
+  for (int i = 0; i < kMany; ++i) {
+    std::string to_file1_i(k100KB / kMany, 'a' + i % 26);
+    BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file1, to_file1_i));
+    BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file2, to_file1_i));
+    to_file1 += to_file1_i;
+  }
+
+  FileInterface::MappedRange* range = file1->MapRange(0, k1MB, &ec);
+  BOOST_REQUIRE(ec == ErrorCode::kSuccess);
+  BOOST_CHECK(range->spans_count() > 1);
+  BOOST_CHECK(ReadMappedRange(range) == to_file1);
+
+  range = file1->MapRange(k100KB / 3, k100KB / 3, &ec);
+  BOOST_REQUIRE(ec == ErrorCode::kSuccess);
+  BOOST_CHECK(ReadMappedRange(range) == to_file1.substr(k100KB / 3, k100KB / 3));
+
+  range = file1->MapRange(k1MB, 1, &ec);
+  BOOST_REQUIRE(ec == ErrorCode::kSuccess);
+  BOOST_CHECK(range->spans_count() == 0);
+  range->Release();
+}
+
+BOOST_FIXTURE_TEST_CASE(map_range_is_valid_after_close, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", "1234567890"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  FileInterface::MappedRange* range = file->MapRange(2, 5, &ec);
+  BOOST_REQUIRE(ec == ErrorCode::kSuccess);
+  file.reset();
+
+  BOOST_CHECK(ReadMappedRange(range) == "34567");
+}
+
+BOOST_FIXTURE_TEST_CASE(map_range_sees_buffered_writes, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetWriteBuffer(k100KB));
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, "1234567890"));
+
+  FileInterface::MappedRange* range = file->MapRange(0, 10, &ec);
+  BOOST_REQUIRE(ec == ErrorCode::kSuccess);
+  BOOST_CHECK(ReadMappedRange(range) == "1234567890");
+
+  // The pinned data can be written again after release.
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetCursor(0));
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, "ab"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->Flush());
+  range = file->MapRange(0, 3, &ec);
+  BOOST_REQUIRE(ec == ErrorCode::kSuccess);
+  BOOST_CHECK(ReadMappedRange(range) == "ab3");
+}
+
+BOOST_FIXTURE_TEST_CASE(extent_tree_map_range_of_sparse_file, ExtentTreeFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, "123"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetCursor(k1MB));
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, "456"));
+
+  FileInterface::MappedRange* range = file->MapRange(1, k1MB + 1, &ec);
+  BOOST_REQUIRE(ec == ErrorCode::kSuccess);
+  BOOST_REQUIRE(range->spans_count() == 3);
+  BOOST_CHECK(range->spans()[1].data == nullptr);
+  BOOST_CHECK(range->spans()[1].size == k1MB - 3);
+  BOOST_CHECK(ReadMappedRange(range) == "23" + std::string(k1MB - 3, '\0') + "45");
+}
+
+BOOST_FIXTURE_TEST_CASE(read_and_write_many_buffers, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+
+  std::string payload(k100KB, 'b');
+  FileInterface::WriteBuffer write_bufs[] = {{"aaa", 3}, {"", 0}, {payload.data(), payload.size()},
+                                             {"ccc", 3}};
+  BOOST_CHECK(file->WriteV(write_bufs, 4, &ec) == k100KB + 6);
+  BOOST_CHECK(ec == ErrorCode::kSuccess);
+  BOOST_CHECK(file->GetCursor() == k100KB + 6);
+  BOOST_CHECK(file->GetSize() == k100KB + 6);
+
+  std::string header(2, '\0'), rest(k100KB + 10, '\0');
+  FileInterface::ReadBuffer read_bufs[] = {{&header[0], header.size()}, {&rest[0], rest.size()}};
+  BOOST_CHECK(file->ReadVAt(1, read_bufs, 2, &ec) == k100KB + 5);
+  BOOST_CHECK(ec == ErrorCode::kSuccess);
+  BOOST_CHECK(header == "aa");
+  BOOST_CHECK(rest.substr(0, k100KB + 3) == payload + "ccc");
+}
+
+BOOST_FIXTURE_TEST_CASE(write_many_buffers_at_offset, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", "1234567890"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetWriteBuffer(k100KB));
+
+  FileInterface::WriteBuffer write_bufs[] = {{"ab", 2}, {"cd", 2}};
+  BOOST_CHECK(file->WriteVAt(8, write_bufs, 2, &ec) == 4);
+  BOOST_CHECK(ec == ErrorCode::kSuccess);
+  BOOST_CHECK(file->GetCursor() == 0);
+
+  std::string from_file(13, '\0');
+  FileInterface::ReadBuffer read_bufs[] = {{&from_file[0], from_file.size()}};
+  BOOST_CHECK(file->ReadV(read_bufs, 1, &ec) == 12);
+  BOOST_CHECK(ec == ErrorCode::kSuccess);
+  BOOST_CHECK(from_file.substr(0, 12) == "12345678abcd");
+  BOOST_CHECK(file->GetCursor() == 12);
+}
+
+BOOST_FIXTURE_TEST_CASE(failed_write_of_many_buffers_leaves_nothing_buffered, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", "1234567890"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetWriteBuffer(k100KB));
+
+  // The small buffer fits in the write buffer, the big one has no room on the device.
+  {
+    FileSizeLimit limit(boost::filesystem::file_size(device_path));
+    std::string payload(k1MB, 'b');
+    FileInterface::WriteBuffer write_bufs[] = {{"ab", 2}, {payload.data(), payload.size()}};
+    BOOST_CHECK(file->WriteVAt(10, write_bufs, 2, &ec) == 0);
+    BOOST_CHECK(ec != ErrorCode::kSuccess);
+    BOOST_CHECK(file->GetSize() == 10);
+  }
+
+  BOOST_CHECK(ErrorCode::kSuccess == file->Flush());
+  BOOST_CHECK(file->GetSize() == 10);
+  std::string from_file(11, '\0');
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file));
+  BOOST_CHECK(from_file == "1234567890");
+}
+
+BOOST_FIXTURE_TEST_CASE(extent_tree_read_many_buffers_of_sparse_file, ExtentTreeFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetCursor(k100KB));
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, "123"));
+
+  std::string buf1(k100KB / 2, 'a'), buf2(k100KB, 'a');
+  FileInterface::ReadBuffer read_bufs[] = {{&buf1[0], buf1.size()}, {&buf2[0], buf2.size()}};
+  BOOST_CHECK(file->ReadVAt(1, read_bufs, 2, &ec) == k100KB + 2);
+  BOOST_CHECK(ec == ErrorCode::kSuccess);
+  BOOST_CHECK(buf1 == std::string(k100KB / 2, '\0'));
+  BOOST_CHECK(buf2.substr(0, k100KB / 2 + 2) == std::string(k100KB / 2 - 1, '\0') + "123");
+}
+
+BOOST_FIXTURE_TEST_CASE(write_and_read_async, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+
+  // Keep all the records in flight at once and count the completions.
+  constexpr size_t kRecordSize = k100KB / kMany;
+  std::vector<std::string> records, from_file(kMany, std::string(kRecordSize, '\0'));
+  std::atomic<int> written(0), read(0), errors(0);
+  for (int i = 0; i < kMany; ++i) {
+    records.emplace_back(kRecordSize, 'a' + i % 26);
+    BOOST_REQUIRE(ErrorCode::kSuccess ==
+                  file->WriteAsync(i * kRecordSize, records[i].data(), kRecordSize,
+                                   [&](ErrorCode error_code, size_t size) {
+                                     errors += error_code != ErrorCode::kSuccess ||
+                                               size != kRecordSize;
+                                     ++written;
+                                   }));
+  }
+  while (written != kMany)
+    std::this_thread::yield();
+  BOOST_CHECK(errors == 0);
+  BOOST_CHECK(file->GetSize() == k100KB);
+
+  for (int i = 0; i < kMany; ++i)
+    BOOST_REQUIRE(ErrorCode::kSuccess ==
+                  file->ReadAsync(i * kRecordSize, &from_file[i][0], kRecordSize,
+                                  [&](ErrorCode error_code, size_t size) {
+                                    errors += error_code != ErrorCode::kSuccess ||
+                                              size != kRecordSize;
+                                    ++read;
+                                  }));
+  while (read != kMany)
+    std::this_thread::yield();
+  BOOST_CHECK(errors == 0);
+  BOOST_CHECK(from_file == records);
+}
+
+BOOST_FIXTURE_TEST_CASE(close_waits_for_async_operations, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+
+  std::string to_file(k100KB, 'a');
+  std::atomic<int> completed(0);
+  for (int i = 0; i < kMany; ++i)
+    BOOST_REQUIRE(ErrorCode::kSuccess ==
+                  file->WriteAsync(i * k100KB, to_file.data(), to_file.size(),
+                                   [&completed](ErrorCode, size_t) { ++completed; }));
+  file.reset();
+  BOOST_CHECK(completed == kMany);
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_CHECK(file->GetSize() == kMany * k100KB);
+}
+
+BOOST_FIXTURE_TEST_CASE(buffered_writes_are_delayed_until_flush, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetWriteBuffer(k100KB));
+  uintmax_t device_size = boost::filesystem::file_size(device_path);
+
+  std::string to_file;
+  for (int i = 0; i < kMany; ++i) {
+    std::string to_file_i(k100KB / kMany, 'a' + i % 26);
+    BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, to_file_i));
+    to_file += to_file_i;
+  }
+  BOOST_CHECK(file->GetSize() == k100KB);
+  BOOST_CHECK(boost::filesystem::file_size(device_path) == device_size);
+
+  // Other handles don't see the buffered data.
+  ScopedFile file2;
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file2));
+  BOOST_CHECK(file2->GetSize() == 0);
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->Flush());
+  BOOST_CHECK(file2->GetSize() == k100KB);
+  BOOST_CHECK(boost::filesystem::file_size(device_path) > device_size);
+
+  std::string from_file(to_file.size(), '\0');
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file2, from_file));
+  BOOST_CHECK(from_file == to_file);
+}
+
+BOOST_FIXTURE_TEST_CASE(buffered_writes_are_flushed_on_close, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetWriteBuffer(k100KB));
+  std::string to_file;
+  for (int i = 0; i < kMany; ++i) {
+    std::string to_file_i(k100KB / kMany / 2, 'a' + i % 26);
+    BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, to_file_i));
+    to_file += to_file_i;
+  }
+  // Overwrite the beginning of the file, so the buffer is flushed twice.
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetCursor(0));
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, "123"));
+  to_file.replace(0, 3, "123");
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  std::string from_file(to_file.size(), '\0');
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file));
+  BOOST_CHECK(from_file == to_file);
+}
+
+BOOST_FIXTURE_TEST_CASE(buffered_writes_are_visible_for_own_reads, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetWriteBuffer(k100KB));
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, "1234567890"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetCursor(5));
+
+  std::string from_file(5, '\0');
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file));
+  BOOST_CHECK(from_file == "67890");
+}
+
+BOOST_FIXTURE_TEST_CASE(buffered_writes_if_budget_is_exhausted, LoadedFSFixture) {
+  fs->SetWriteBufferBudget(k100KB / kMany);
+  ScopedFile file1, file2;
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file1));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("2", file2));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file1->SetWriteBuffer(k100KB));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file2->SetWriteBuffer(k100KB));
+
+  // The first file takes the whole budget, the second one writes directly.
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file1, std::string(k100KB / kMany, 'a')));
+  uintmax_t device_size = boost::filesystem::file_size(device_path);
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file2, std::string(k100KB / kMany, 'b')));
+  BOOST_CHECK(boost::filesystem::file_size(device_path) > device_size);
+
+  // Flush gives the budget back.
+  BOOST_REQUIRE(ErrorCode::kSuccess == file1->Flush());
+  device_size = boost::filesystem::file_size(device_path);
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file2, std::string(k100KB / kMany, 'b')));
+  BOOST_CHECK(boost::filesystem::file_size(device_path) == device_size);
+}
+
+BOOST_FIXTURE_TEST_CASE(buffered_reads_are_served_from_memory, LoadedFSFixture) {
+  std::string to_file;
+  for (int i = 0; i < kMany; ++i)
+    to_file += "record " + to_s(i) + ";";
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", to_file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetReadBuffer(k100KB));
+
+  std::string from_file(10, '\0');
+  BOOST_REQUIRE(ErrorCode::kSuccess == ReadFile(file, from_file));
+  BOOST_REQUIRE(from_file == to_file.substr(0, 10));
+
+  // Change the data behind the filesystem's back.  The handle doesn't notice.
+  std::string device;
+  {
+    std::ifstream in(device_path.c_str(), std::ios_base::binary);
+    device.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  }
+  size_t data_offset = device.find(to_file);
+  BOOST_REQUIRE(data_offset != std::string::npos);
+  std::fstream(device_path.c_str(), std::ios_base::in | std::ios_base::out |
+                                        std::ios_base::binary).seekp(data_offset + 10).put('!');
+
+  from_file.assign(to_file.size(), '\0');
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file));
+  BOOST_CHECK(from_file == to_file.substr(10));
+}
+
+BOOST_FIXTURE_TEST_CASE(buffered_reads_see_changes_through_other_handles, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", "1234567890"));
+  ScopedFile file2;
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file2));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetReadBuffer(k100KB));
+
+  std::string from_file(3, '\0');
+  BOOST_REQUIRE(file->ReadAt(0, &from_file[0], 3, &ec) == 3);
+  BOOST_REQUIRE(from_file == "123");
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file2, "ab"));
+  BOOST_CHECK(file->ReadAt(0, &from_file[0], 3, &ec) == 3);
+  BOOST_CHECK(from_file == "ab3");
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == file2->Truncate(1));
+  BOOST_CHECK(file->ReadAt(0, &from_file[0], 3, &ec) == 1);
+  BOOST_CHECK(from_file[0] == 'a');
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == file2->SetCursor(1));
+  BOOST_REQUIRE(file2->Append("yz", 2, &ec) == 1);
+  BOOST_CHECK(file->ReadAt(0, &from_file[0], 3, &ec) == 3);
+  BOOST_CHECK(from_file == "ayz");
+}
+
+BOOST_FIXTURE_TEST_CASE(file_size_is_persisted_on_flush_and_close, LoadedFSFixture) {
+  // Another instance sees only what has reached the device.
+  auto device_size = [this] {
+    ScopedFilesystem device_fs;
+    BOOST_REQUIRE(ErrorCode::kSuccess == Create(device_fs));
+    BOOST_REQUIRE(ErrorCode::kSuccess == device_fs->Load(device_path.c_str()));
+    ErrorCode error_code;
+    ScopedFile device_file(device_fs->OpenFile("1", false, &error_code));
+    BOOST_REQUIRE(ErrorCode::kSuccess == error_code);
+    return device_file->GetSize();
+  };
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", "123"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetCursor(3));
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, "456"));
+  BOOST_CHECK(file->GetSize() == 6);
+  BOOST_CHECK(device_size() == 3);
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->Flush());
+  BOOST_CHECK(device_size() == 6);
+
+  BOOST_REQUIRE(file->Append("789", 3, &ec) == 6);
+  BOOST_CHECK(device_size() == 6);
+  file.reset();
+  BOOST_CHECK(device_size() == 9);
+
+  std::string from_file(9, '\0');
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file));
+  BOOST_CHECK(from_file == "123456789");
+}
+
+BOOST_FIXTURE_TEST_CASE(map_and_change_file, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", "1234567890"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetReadBuffer(k100KB));
+  std::string from_file(10, '\0');
+  BOOST_REQUIRE(file->ReadAt(0, &from_file[0], 10, &ec) == 10);
+
+  FileInterface::MappedFile* mapped_file = file->Map(&ec);
+  BOOST_REQUIRE(ErrorCode::kSuccess == ec);
+  BOOST_REQUIRE(mapped_file->size() == 10);
+  BOOST_CHECK(std::string(mapped_file->data(), 10) == "1234567890");
+  mapped_file->data()[1] = 'a';
+  BOOST_CHECK(ErrorCode::kSuccess == mapped_file->Sync());
+  mapped_file->Release();
+
+  BOOST_CHECK(file->ReadAt(0, &from_file[0], 10, &ec) == 10);
+  BOOST_CHECK(from_file == "1a34567890");
+  file.reset();
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  from_file.assign(10, '\0');
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file));
+  BOOST_CHECK(from_file == "1a34567890");
+}
+
+BOOST_FIXTURE_TEST_CASE(buffered_reads_see_stores_to_mapping, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", "1234567890"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  ScopedFile file2;
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file2));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file2->SetReadBuffer(k100KB));
+  std::string from_file(10, '\0');
+  BOOST_REQUIRE(file2->ReadAt(0, &from_file[0], 10, &ec) == 10);
+
+  FileInterface::MappedFile* mapped_file = file->Map(&ec);
+  BOOST_REQUIRE(ErrorCode::kSuccess == ec);
+  BOOST_REQUIRE(file2->ReadAt(0, &from_file[0], 10, &ec) == 10);
+  mapped_file->data()[1] = 'a';
+  // Neither synced nor released.
+  BOOST_CHECK(file2->ReadAt(0, &from_file[0], 10, &ec) == 10);
+  BOOST_CHECK(from_file == "1a34567890");
+  mapped_file->Release();
+}
+
+BOOST_FIXTURE_TEST_CASE(mapped_file_size_is_fixed, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", "1234567890"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  FileInterface::MappedFile* mapped_file = file->Map(&ec);
+  BOOST_REQUIRE(ErrorCode::kSuccess == ec);
+
+  std::atomic<bool> appended(false);
+  std::thread appender([this, &appended] {
+    ErrorCode error_code;
+    file->Append("abc", 3, &error_code);
+    appended = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  BOOST_CHECK(!appended);
+  BOOST_CHECK(file->GetSize() == 10);
+
+  mapped_file->Release();
+  appender.join();
+  BOOST_CHECK(file->GetSize() == 13);
+}
+
+BOOST_FIXTURE_TEST_CASE(map_sparse_or_empty_file, ExtentTreeFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_CHECK(file->Map(&ec) == nullptr);
+  BOOST_CHECK(ErrorCode::kErrorNotSupported == ec);
+
+  BOOST_REQUIRE(file->WriteAt(k100KB, "1", 1, &ec) == 1);
+  BOOST_CHECK(file->Map(&ec) == nullptr);
+  BOOST_CHECK(ErrorCode::kErrorNotSupported == ec);
+}
+
+BOOST_FIXTURE_TEST_CASE(extent_tree_map_clone, ExtentTreeFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", "1234567890"));
+  BOOST_REQUIRE(ErrorCode::kSuccess ==
+                fs->CopyFile("1", "2", FilesystemInterface::CopyMode::kClone));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("2", file));
+
+  // The clone gets the data of its own.
+  FileInterface::MappedFile* mapped_file = file->Map(&ec);
+  BOOST_REQUIRE(ErrorCode::kSuccess == ec);
+  mapped_file->data()[0] = 'a';
+  mapped_file->Release();
+
+  std::string from_file(10, '\0');
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file));
+  BOOST_CHECK(from_file == "a234567890");
+  ScopedFile file1;
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file1));
+  from_file.assign(10, '\0');
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file1, from_file));
+  BOOST_CHECK(from_file == "1234567890");
+}
+
 BOOST_FIXTURE_TEST_CASE(read_empty_file, LoadedFSFixture) {
   BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile(".profile", file));
 
@@ -410,6 +1424,64 @@ BOOST_FIXTURE_TEST_CASE(read_many_bytes_many_read_if_reuse_unused_sections, Load
   }
 }
 
+BOOST_FIXTURE_TEST_CASE(read_and_write_at_offsets, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", "1234567890"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+
+  BOOST_CHECK(file->WriteAt(8, "abcd", 4, &ec) == 4);
+  BOOST_CHECK(ec == ErrorCode::kSuccess);
+  char buf[6] = {0};
+  BOOST_CHECK(file->ReadAt(7, buf, 5, &ec) == 5);
+  BOOST_CHECK(ec == ErrorCode::kSuccess);
+  BOOST_CHECK(std::string(buf) == "8abcd");
+  BOOST_CHECK(file->GetSize() == 12);
+  BOOST_CHECK(file->GetCursor() == 0);
+
+  // Read the rest of the file only.
+  BOOST_CHECK(file->ReadAt(10, buf, 5, &ec) == 2);
+  BOOST_CHECK(ec == ErrorCode::kSuccess);
+}
+
+BOOST_FIXTURE_TEST_CASE(read_and_write_at_offsets_greater_than_file_size, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", "1234567890"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+
+  char buf[3] = {'a', 'b', 'c'};
+  BOOST_CHECK(file->ReadAt(11, buf, 1, &ec) == 0);
+  BOOST_CHECK(ec == ErrorCode::kSuccess);
+  BOOST_CHECK(file->WriteAt(11, buf, 1, &ec) == 1);
+  BOOST_CHECK(ec == ErrorCode::kSuccess);
+  BOOST_CHECK(file->GetSize() == 12);
+  BOOST_CHECK(file->ReadAt(9, buf, 3, &ec) == 3);
+  BOOST_CHECK(std::string(buf, 3) == std::string("0\0a", 3));
+}
+
+BOOST_FIXTURE_TEST_CASE(read_at_offsets_from_many_threads, LoadedFSFixture) {
+  constexpr int kThreads = 8;
+  std::string to_file(k1MB, '\0');
+  for (size_t i = 0; i < to_file.size(); ++i)
+    to_file[i] = 'a' + i % 26;
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", to_file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+
+  // Every thread reads its own part of the file using the same handle.
+  std::vector<std::string> from_file(kThreads, std::string(k1MB / kThreads, '\0'));
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; ++i)
+    threads.emplace_back([this, i, &from_file] {
+      ErrorCode error_code;
+      for (size_t done = 0; done != from_file[i].size(); done += k1MB / kThreads / 10)
+        file->ReadAt(i * (k1MB / kThreads) + done, &from_file[i][done],
+                     k1MB / kThreads / 10, &error_code);
+    });
+  for (std::thread& thread : threads)
+    thread.join();
+
+  for (int i = 0; i < kThreads; ++i)
+    BOOST_CHECK(from_file[i] == to_file.substr(i * (k1MB / kThreads), k1MB / kThreads));
+  BOOST_CHECK(file->GetCursor() == 0);
+}
+
 BOOST_FIXTURE_TEST_CASE(get_cursor_after_open_if_file_created, LoadedFSFixture) {
   BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile(".profile", file));
 
@@ -518,7 +1590,12 @@ BOOST_FIXTURE_TEST_CASE(set_cursor_if_greater_than_file_size, LoadedFSFixture) {
   BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile(".profile", "12"));
   BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile(".profile", file));
 
-  BOOST_CHECK(ErrorCode::kErrorCursorTooBig == file->SetCursor(3));
+  BOOST_CHECK(ErrorCode::kSuccess == file->SetCursor(3));
+  BOOST_CHECK(3 == file->GetCursor());
+
+  std::string from_file(1, '\0');
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file));
+  BOOST_CHECK(from_file == "");
 }
 
 BOOST_FIXTURE_TEST_CASE(get_size_after_open_if_file_created, LoadedFSFixture) {
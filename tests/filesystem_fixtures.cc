@@ -1,5 +1,7 @@
 #include "tests/filesystem_fixtures.h"
 
+#include <csignal>
+
 #include "fs/error_code.h"
 #include "fs/linfs_factory.h"
 
@@ -44,6 +46,15 @@ ErrorCode CreatedFSFixture::Format(const boost::filesystem::path& path,
   return error_code;
 }
 
+ErrorCode CreatedFSFixture::Format(const boost::filesystem::path& path,
+                                   const FilesystemInterface::FormatOptions& options) {
+  ErrorCode error_code = fs->Format(path.c_str(), options);
+  if (error_code == ErrorCode::kSuccess)
+    // Check that the device's file takes only 1 (metadata) cluster.
+    BOOST_REQUIRE(boost::filesystem::file_size(path) == (1ULL << (int)options.cluster_size));
+  return error_code;
+}
+
 ///////////////////////////////////////////////////////////
 // FormattedFSFixture
 ///////////////////////////////////////////////////////////
@@ -51,6 +62,10 @@ FormattedFSFixture::FormattedFSFixture(FilesystemInterface::ClusterSize cluster_
   BOOST_REQUIRE(ErrorCode::kSuccess == Format(device_path, cluster_size));
 }
 
+FormattedFSFixture::FormattedFSFixture(const FilesystemInterface::FormatOptions& options) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == Format(device_path, options));
+}
+
 ErrorCode FormattedFSFixture::Load(const boost::filesystem::path& path) {
   return fs->Load(path.c_str());
 }
@@ -62,6 +77,11 @@ LoadedFSFixture::LoadedFSFixture() {
   BOOST_REQUIRE(ErrorCode::kSuccess == Load(device_path));
 }
 
+LoadedFSFixture::LoadedFSFixture(const FilesystemInterface::FormatOptions& options)
+    : FormattedFSFixture(options) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == Load(device_path));
+}
+
 ErrorCode LoadedFSFixture::OpenFile(const std::string& path, ScopedFile& out_file,
                                     bool creat_excl) {
   ErrorCode error_code;
@@ -125,3 +145,58 @@ ErrorCode LoadedFSFixture::CreateSymlink(const std::string& path, const std::str
 ErrorCode LoadedFSFixture::Remove(const std::string& path) {
   return fs->Remove(path.c_str());
 }
+
+uint64_t LoadedFSFixture::DeviceReads() {
+  FilesystemInterface::Stats stats;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats(&stats));
+  return stats.device_reads;
+}
+
+///////////////////////////////////////////////////////////
+// Fixtures of devices formatted with options
+///////////////////////////////////////////////////////////
+FilesystemInterface::FormatOptions ExtentTreeFormatOptions() {
+  FilesystemInterface::FormatOptions options;
+  options.cluster_size = FilesystemInterface::ClusterSize::k512B;
+  options.data_cluster_size = FilesystemInterface::ClusterSize::k512B;
+  options.extent_tree = true;
+  return options;
+}
+
+FilesystemInterface::FormatOptions MixedClustersFormatOptions() {
+  FilesystemInterface::FormatOptions options;
+  options.cluster_size = FilesystemInterface::ClusterSize::k1KB;
+  options.data_cluster_size = FilesystemInterface::ClusterSize::k1MB;
+  return options;
+}
+
+FilesystemInterface::FormatOptions NameIndexFormatOptions() {
+  FilesystemInterface::FormatOptions options;
+  options.cluster_size = FilesystemInterface::ClusterSize::k512B;
+  options.name_index = true;
+  return options;
+}
+
+FilesystemInterface::FormatOptions TaggedSlotsFormatOptions(bool name_index) {
+  FilesystemInterface::FormatOptions options;
+  options.cluster_size = FilesystemInterface::ClusterSize::k512B;
+  options.name_index = name_index;
+  options.tagged_slots = true;
+  return options;
+}
+
+///////////////////////////////////////////////////////////
+// FileSizeLimit
+///////////////////////////////////////////////////////////
+FileSizeLimit::FileSizeLimit(uintmax_t size) {
+  getrlimit(RLIMIT_FSIZE, &old_limit_);
+  struct rlimit limit = old_limit_;
+  limit.rlim_cur = size;
+  setrlimit(RLIMIT_FSIZE, &limit);
+  old_handler_ = signal(SIGXFSZ, SIG_IGN);
+}
+
+FileSizeLimit::~FileSizeLimit() {
+  setrlimit(RLIMIT_FSIZE, &old_limit_);
+  signal(SIGXFSZ, old_handler_);
+}
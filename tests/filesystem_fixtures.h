@@ -1,5 +1,7 @@
 #pragma once
 
+#include <sys/resource.h>
+
 #include <memory>
 #include <string>
 #include <vector>
@@ -39,6 +41,8 @@ struct CreatedFSFixture : DefaultFSFixture {
   ~CreatedFSFixture();
   fs::ErrorCode Format(const boost::filesystem::path& path,
                        fs::FilesystemInterface::ClusterSize cluster_size);
+  fs::ErrorCode Format(const boost::filesystem::path& path,
+                       const fs::FilesystemInterface::FormatOptions& options);
 
   boost::filesystem::path device_path;
 };
@@ -49,6 +53,7 @@ struct CreatedFSFixture : DefaultFSFixture {
 struct FormattedFSFixture : CreatedFSFixture {
   FormattedFSFixture(fs::FilesystemInterface::ClusterSize cluster_size =
                          fs::FilesystemInterface::ClusterSize::k1KB);
+  FormattedFSFixture(const fs::FilesystemInterface::FormatOptions& options);
   fs::ErrorCode Load(const boost::filesystem::path& path);
 };
 
@@ -62,6 +67,7 @@ struct LoadedFSFixture : FormattedFSFixture {
   using ScopedFile = std::unique_ptr<fs::FileInterface, FileDeleter>;
 
   LoadedFSFixture();
+  LoadedFSFixture(const fs::FilesystemInterface::FormatOptions& options);
   fs::ErrorCode OpenFile(const std::string& path, ScopedFile& out_file,
                          bool creat_excl = false);
   fs::ErrorCode ReadFile(ScopedFile& file, std::string& data);
@@ -74,6 +80,53 @@ struct LoadedFSFixture : FormattedFSFixture {
   fs::ErrorCode CreateSymlink(const std::string& path,
                               const std::string& target);
   fs::ErrorCode Remove(const std::string& path);
+  // The number of read requests to the device since loading.
+  uint64_t DeviceReads();
 
   ScopedFile file;
 };
+
+///////////////////////////////////////////////////////////
+// Fixtures of devices formatted with options
+///////////////////////////////////////////////////////////
+// Small clusters make the extent tree grow fast.
+fs::FilesystemInterface::FormatOptions ExtentTreeFormatOptions();
+// Metadata takes 1KB clusters, data takes 1MB ones.
+fs::FilesystemInterface::FormatOptions MixedClustersFormatOptions();
+// Small clusters give more sections and tables.
+fs::FilesystemInterface::FormatOptions NameIndexFormatOptions();
+fs::FilesystemInterface::FormatOptions TaggedSlotsFormatOptions(bool name_index);
+
+struct ExtentTreeFSFixture : LoadedFSFixture {
+  ExtentTreeFSFixture() : LoadedFSFixture(ExtentTreeFormatOptions()) {}
+};
+
+struct MixedClustersFSFixture : LoadedFSFixture {
+  MixedClustersFSFixture() : LoadedFSFixture(MixedClustersFormatOptions()) {}
+};
+
+struct NameIndexFSFixture : LoadedFSFixture {
+  NameIndexFSFixture() : LoadedFSFixture(NameIndexFormatOptions()) {}
+};
+
+struct TaggedSlotsFSFixture : LoadedFSFixture {
+  TaggedSlotsFSFixture() : LoadedFSFixture(TaggedSlotsFormatOptions(false)) {}
+};
+
+struct TaggedSlotsWithNameIndexFSFixture : LoadedFSFixture {
+  TaggedSlotsWithNameIndexFSFixture() : LoadedFSFixture(TaggedSlotsFormatOptions(true)) {}
+};
+
+///////////////////////////////////////////////////////////
+// FileSizeLimit
+///////////////////////////////////////////////////////////
+// Keeps files of the process from growing past |size| while it lives.
+class FileSizeLimit {
+ public:
+  explicit FileSizeLimit(uintmax_t size);
+  ~FileSizeLimit();
+
+ private:
+  struct rlimit old_limit_;
+  void (*old_handler_)(int);
+};
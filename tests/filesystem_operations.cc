@@ -1,4 +1,8 @@
+#include <chrono>
 #include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
 
 #include "tests/filesystem_fixtures.h"
 
@@ -9,6 +13,35 @@ using namespace fs;
 
 BOOST_AUTO_TEST_SUITE(FilesystemOperationsTestSuite)
 
+namespace {
+
+// Test suite parameters:
+constexpr int kMany = 100;         // Let's say what does "many" mean.
+constexpr size_t k100KB = 100000;  // Typical file size.
+
+// Creates two files at the same time, so their sections are interleaved.
+void CreateFragmentedFiles(LoadedFSFixture& f, std::string& to_file1, std::string& to_file2) {
+  LoadedFSFixture::ScopedFile file1, file2;
+  BOOST_REQUIRE(ErrorCode::kSuccess == f.OpenFile("1", file1));
+  BOOST_REQUIRE(ErrorCode::kSuccess == f.OpenFile("2", file2));
+  for (int i = 0; i < kMany; ++i) {
+    std::string to_file1_i(k100KB / kMany, 'a' + i % 26);
+    std::string to_file2_i(k100KB / kMany, 'z' - i % 26);
+    BOOST_REQUIRE(ErrorCode::kSuccess == f.WriteFile(file1, to_file1_i));
+    BOOST_REQUIRE(ErrorCode::kSuccess == f.WriteFile(file2, to_file2_i));
+    to_file1 += to_file1_i;
+    to_file2 += to_file2_i;
+  }
+}
+
+FilesystemInterface::DefragmenterOptions UnlimitedDefragmenterOptions() {
+  FilesystemInterface::DefragmenterOptions options;
+  options.bytes_per_second = 0;
+  return options;
+}
+
+}  // namespace
+
 BOOST_FIXTURE_TEST_CASE(create_fs, DefaultFSFixture) {
   ec = Create(fs);
   BOOST_CHECK(ec == ErrorCode::kSuccess || ec == ErrorCode::kErrorNoMemory);
@@ -30,6 +63,42 @@ BOOST_FIXTURE_TEST_CASE(format_fs_with_cluster_4KB, CreatedFSFixture) {
   BOOST_CHECK(ErrorCode::kSuccess == Format(device_path, FilesystemInterface::ClusterSize::k4KB));
 }
 
+BOOST_FIXTURE_TEST_CASE(format_fs_with_data_cluster_1MB, CreatedFSFixture) {
+  BOOST_CHECK(ErrorCode::kSuccess == Format(device_path, MixedClustersFormatOptions()));
+}
+
+BOOST_FIXTURE_TEST_CASE(format_fs_with_extent_tree, CreatedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == Format(device_path, ExtentTreeFormatOptions()));
+  // The byte at 9 is a minor version.  The extent tree requires v1.2.
+  BOOST_CHECK(std::fstream(device_path.c_str()).seekg(9).get() == 2);
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == Format(device_path, FilesystemInterface::ClusterSize::k1KB));
+  BOOST_CHECK(std::fstream(device_path.c_str()).seekg(9).get() == 1);
+}
+
+BOOST_FIXTURE_TEST_CASE(format_fs_with_name_index, CreatedFSFixture) {
+  FilesystemInterface::FormatOptions options;
+  options.name_index = true;
+  BOOST_REQUIRE(ErrorCode::kSuccess == Format(device_path, options));
+  BOOST_CHECK(std::fstream(device_path.c_str()).seekg(9).get() == 2);
+}
+
+BOOST_FIXTURE_TEST_CASE(format_fs_with_data_cluster_less_than_cluster, CreatedFSFixture) {
+  FilesystemInterface::FormatOptions options;
+  options.cluster_size = FilesystemInterface::ClusterSize::k4KB;
+  options.data_cluster_size = FilesystemInterface::ClusterSize::k1KB;
+  BOOST_CHECK(ErrorCode::kErrorNotSupported == Format(device_path, options));
+}
+
+BOOST_FIXTURE_TEST_CASE(format_fs_with_too_big_cluster, CreatedFSFixture) {
+  FilesystemInterface::FormatOptions options;
+  options.cluster_size = FilesystemInterface::ClusterSize::k8KB;
+  options.data_cluster_size = FilesystemInterface::ClusterSize::k1MB;
+  BOOST_CHECK(ErrorCode::kErrorNotSupported == Format(device_path, options));
+  BOOST_CHECK(ErrorCode::kErrorNotSupported == Format(device_path,
+                                                      FilesystemInterface::ClusterSize::k8KB));
+}
+
 BOOST_FIXTURE_TEST_CASE(format_fs_if_path_is_regular_file, CreatedFSFixture) {
   BOOST_REQUIRE(ErrorCode::kSuccess == Format(device_path, FilesystemInterface::ClusterSize::k4KB));
 
@@ -78,4 +147,572 @@ BOOST_FIXTURE_TEST_CASE(load_fs_if_path_is_directory, FormattedFSFixture) {
   BOOST_CHECK(ErrorCode::kErrorDeviceUnknown == Load(device_path));
 }
 
+BOOST_FIXTURE_TEST_CASE(load_fs_without_data_cluster_size, FormattedFSFixture) {
+  // Devices formatted by older versions have zero in place of the data
+  // cluster size (the 11th byte).
+  BOOST_REQUIRE(std::fstream(device_path.c_str()).seekp(11).put('\0').good());
+  BOOST_REQUIRE(ErrorCode::kSuccess == Load(device_path));
+
+  // Data is still allocated by 1KB clusters.
+  LoadedFSFixture::ScopedFile file;
+  ec = ErrorCode::kSuccess;
+  file.reset(fs->OpenFile("file", false, &ec));
+  BOOST_REQUIRE(ec == ErrorCode::kSuccess);
+  BOOST_REQUIRE(file->Write("1234567890", 10, &ec) == 10);
+  BOOST_CHECK(boost::filesystem::file_size(device_path) == 2 * 1024);
+}
+
+BOOST_FIXTURE_TEST_CASE(mixed_clusters_metadata_takes_small_clusters, MixedClustersFSFixture) {
+  for (int i = 0; i < kMany; ++i) {
+    BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory(std::to_string(i)));
+    BOOST_REQUIRE(ErrorCode::kSuccess == CreateSymlink(std::to_string(i) + "/s", "/"));
+  }
+
+  // The root + directories + symlinks + the root's directory sections.
+  BOOST_CHECK(boost::filesystem::file_size(device_path) < (1 + 3 * kMany) * 1024);
+}
+
+BOOST_FIXTURE_TEST_CASE(mixed_clusters_data_skips_metadata_fragments, MixedClustersFSFixture) {
+  for (int i = 0; i < 2 * kMany; ++i)
+    BOOST_REQUIRE(ErrorCode::kSuccess == CreateSymlink(std::to_string(i), "/"));
+  for (int i = 0; i < 2 * kMany; i += 2)
+    BOOST_REQUIRE(ErrorCode::kSuccess == Remove(std::to_string(i)));
+
+  // The released clusters of every other symlink are too small for the data.
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("file", std::string(k100KB, 'a')));
+  FilesystemInterface::EntryStats stats;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats("file", &stats));
+  BOOST_CHECK(stats.sections <= 2);
+}
+
+BOOST_FIXTURE_TEST_CASE(mixed_clusters_data_takes_big_clusters, MixedClustersFSFixture) {
+  std::string to_file(k100KB, 'a');
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("file", file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, "a"));
+  // The file's header is metadata.
+  uint64_t device_size = boost::filesystem::file_size(device_path);
+  BOOST_CHECK(device_size == 2 * 1024);
+
+  // The data grows by 1MB at once.
+  for (int i = 0; i < 10; ++i)
+    BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, to_file));
+  BOOST_CHECK(boost::filesystem::file_size(device_path) == device_size + (1 << 20));
+
+  // The released data clusters are reused.
+  file.reset();
+  BOOST_REQUIRE(ErrorCode::kSuccess == Remove("file"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("file", file));
+  for (int i = 0; i < 10; ++i)
+    BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, to_file));
+  BOOST_CHECK(boost::filesystem::file_size(device_path) == device_size + (1 << 20));
+}
+
+BOOST_FIXTURE_TEST_CASE(get_stats_of_new_fs, LoadedFSFixture) {
+  FilesystemInterface::Stats stats;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats(&stats));
+  BOOST_CHECK(stats.cluster_size == 1024);
+  BOOST_CHECK(stats.data_cluster_size == 1024);
+  BOOST_CHECK(stats.total_clusters == 1);
+  BOOST_CHECK(stats.free_clusters == 0);
+  BOOST_CHECK(stats.free_extents == 0);
+  BOOST_CHECK(stats.largest_free_extent == 0);
+}
+
+BOOST_FIXTURE_TEST_CASE(get_stats_after_remove, LoadedFSFixture) {
+  for (int i = 0; i < kMany; ++i)
+    BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory(std::to_string(i)));
+  for (int i = 0; i < kMany; i += 2)
+    BOOST_REQUIRE(ErrorCode::kSuccess == Remove(std::to_string(i)));
+
+  FilesystemInterface::Stats stats;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats(&stats));
+  BOOST_CHECK(stats.total_clusters == boost::filesystem::file_size(device_path) / 1024);
+  BOOST_CHECK(stats.free_clusters == kMany / 2);
+  BOOST_CHECK(stats.free_extents == kMany / 2);
+  BOOST_CHECK(stats.largest_free_extent == 1);
+  BOOST_CHECK(stats.free_extents_histogram[0] == kMany / 2);
+
+  // Adjacent unused sections make up one extent.
+  for (int i = 1; i < kMany; i += 2)
+    BOOST_REQUIRE(ErrorCode::kSuccess == Remove(std::to_string(i)));
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats(&stats));
+  BOOST_CHECK(stats.free_extents < kMany / 2);
+  BOOST_CHECK(stats.largest_free_extent > 1);
+  uint64_t extents = 0;
+  for (uint64_t n : stats.free_extents_histogram)
+    extents += n;
+  BOOST_CHECK(extents == stats.free_extents);
+}
+
+BOOST_FIXTURE_TEST_CASE(get_stats_of_fragmented_file, LoadedFSFixture) {
+  std::string to_file1, to_file2;
+  CreateFragmentedFiles(*this, to_file1, to_file2);
+
+  FilesystemInterface::EntryStats stats;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats("/1", &stats));
+  BOOST_CHECK(stats.sections > 3);
+  BOOST_CHECK(stats.average_section_size * stats.sections >= k100KB);
+  BOOST_CHECK(stats.slots == 0);
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->Defragment(UnlimitedDefragmenterOptions()));
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats("/1", &stats));
+  BOOST_CHECK(stats.sections <= 2);
+}
+
+BOOST_FIXTURE_TEST_CASE(get_stats_of_dir, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory("dir"));
+  for (int i = 0; i < kMany; ++i)
+    BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("dir/" + std::to_string(i)));
+
+  FilesystemInterface::EntryStats stats;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats("/dir", &stats));
+  BOOST_CHECK(stats.sections > 1);
+  BOOST_CHECK(stats.used_slots == kMany);
+  BOOST_CHECK(stats.slots >= kMany);
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats("/", &stats));
+  BOOST_CHECK(stats.sections == 1);
+  BOOST_CHECK(stats.used_slots == 1);
+
+  BOOST_CHECK(ErrorCode::kErrorNotFound == fs->GetStats("/file", &stats));
+}
+
+BOOST_FIXTURE_TEST_CASE(defragment_fragmented_files, LoadedFSFixture) {
+  std::string to_file1, to_file2;
+  CreateFragmentedFiles(*this, to_file1, to_file2);
+  uintmax_t device_size = boost::filesystem::file_size(device_path);
+
+  BOOST_CHECK(ErrorCode::kSuccess == fs->Defragment(UnlimitedDefragmenterOptions()));
+  // There were no unused sections, so the data has been moved to the device's tail.
+  BOOST_CHECK(device_size < boost::filesystem::file_size(device_path));
+
+  std::string from_file1(to_file1.size(), '\0'), from_file2(to_file2.size(), '\0');
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file1));
+  BOOST_CHECK(from_file1 == to_file1);
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("2", file));
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file2));
+  BOOST_CHECK(from_file2 == to_file2);
+}
+
+BOOST_FIXTURE_TEST_CASE(defragment_files_with_extent_tree, ExtentTreeFSFixture) {
+  std::string to_file1, to_file2;
+  CreateFragmentedFiles(*this, to_file1, to_file2);
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->Defragment(UnlimitedDefragmenterOptions()));
+
+  FilesystemInterface::EntryStats stats;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats("1", &stats));
+  BOOST_CHECK(stats.sections == 2);  // the first section and one extent
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  std::string from_file1(to_file1.size(), '\0');
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file1));
+  BOOST_CHECK(from_file1 == to_file1);
+}
+
+BOOST_FIXTURE_TEST_CASE(defragment_skips_open_files, LoadedFSFixture) {
+  std::string to_file1, to_file2;
+  CreateFragmentedFiles(*this, to_file1, to_file2);
+  ScopedFile file1, file2;
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file1));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("2", file2));
+  uintmax_t device_size = boost::filesystem::file_size(device_path);
+
+  BOOST_CHECK(ErrorCode::kSuccess == fs->Defragment(UnlimitedDefragmenterOptions()));
+  BOOST_CHECK(device_size == boost::filesystem::file_size(device_path));
+}
+
+BOOST_FIXTURE_TEST_CASE(defragment_in_sub_dir_within_budget, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory("home"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("home/small", "1"));
+  std::string to_file1, to_file2;
+  CreateFragmentedFiles(*this, to_file1, to_file2);
+  uintmax_t device_size = boost::filesystem::file_size(device_path);
+  FilesystemInterface::DefragmenterOptions options = UnlimitedDefragmenterOptions();
+  options.bytes_per_pass = k100KB - 1;
+
+  BOOST_CHECK(ErrorCode::kSuccess == fs->Defragment(options));
+  BOOST_CHECK(device_size == boost::filesystem::file_size(device_path));
+}
+
+BOOST_FIXTURE_TEST_CASE(start_and_stop_defragmenter, LoadedFSFixture) {
+  std::string to_file1, to_file2;
+  CreateFragmentedFiles(*this, to_file1, to_file2);
+
+  BOOST_CHECK(ErrorCode::kSuccess == fs->StartDefragmenter(UnlimitedDefragmenterOptions()));
+  BOOST_CHECK(ErrorCode::kErrorBusy == fs->StartDefragmenter(UnlimitedDefragmenterOptions()));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  std::string from_file1(to_file1.size(), '\0');
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file1));
+  BOOST_CHECK(from_file1 == to_file1);
+  fs->StopDefragmenter();
+  BOOST_CHECK(ErrorCode::kSuccess == fs->StartDefragmenter(UnlimitedDefragmenterOptions()));
+}
+
+BOOST_FIXTURE_TEST_CASE(defragmenter_doesnt_lock_files_while_throttling, LoadedFSFixture) {
+  std::string to_file1, to_file2;
+  CreateFragmentedFiles(*this, to_file1, to_file2);
+  FilesystemInterface::DefragmenterOptions options;
+  options.bytes_per_second = k100KB;  // A second per file.
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->StartDefragmenter(options));
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  auto start = std::chrono::steady_clock::now();
+  ScopedFile file1, file2;
+  std::string from_file1(to_file1.size(), '\0'), from_file2(to_file2.size(), '\0');
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file1));
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file1, from_file1));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("2", file2));
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file2, from_file2));
+  // The defragmenter sleeps for most of the second.
+  BOOST_CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(500));
+  BOOST_CHECK(from_file1 == to_file1);
+  BOOST_CHECK(from_file2 == to_file2);
+  fs->StopDefragmenter();
+}
+
+BOOST_FIXTURE_TEST_CASE(copy_fragmented_file, LoadedFSFixture) {
+  std::string to_file1, to_file2;
+  CreateFragmentedFiles(*this, to_file1, to_file2);
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->CopyFile("1", "3"));
+  // The copy is allocated at once.
+  FilesystemInterface::EntryStats stats;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats("3", &stats));
+  BOOST_CHECK(stats.sections <= 2);
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("3", file));
+  std::string from_file(to_file1.size() + 1, '\0');
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file));
+  BOOST_CHECK(from_file == to_file1);
+}
+
+BOOST_FIXTURE_TEST_CASE(copy_file_if_src_or_dst_is_wrong, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", "123"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory("home"));
+
+  BOOST_CHECK(ErrorCode::kErrorNotFound == fs->CopyFile("2", "3"));
+  BOOST_CHECK(ErrorCode::kErrorIsDirectory == fs->CopyFile("home", "3"));
+  BOOST_CHECK(ErrorCode::kErrorExists == fs->CopyFile("1", "home"));
+  BOOST_CHECK(ErrorCode::kErrorNotFound == fs->CopyFile("1", "tmp/3"));
+  BOOST_CHECK(!fs->IsFile("3", &ec));
+}
+
+BOOST_FIXTURE_TEST_CASE(extent_tree_copy_sparse_file, ExtentTreeFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetCursor(k100KB));
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, "123"));
+  file.reset();
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->CopyFile("1", "2"));
+  FilesystemInterface::EntryStats stats;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats("2", &stats));
+  BOOST_CHECK(stats.sections == 2);  // the first section and one extent
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("2", file));
+  BOOST_CHECK(file->FindData(0, &ec) == k100KB);
+  std::string from_file(k100KB + 4, 'a');
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file));
+  BOOST_CHECK(from_file == std::string(k100KB, '\0') + "123");
+}
+
+BOOST_FIXTURE_TEST_CASE(extent_tree_clone_file_shares_data_until_write, ExtentTreeFSFixture) {
+  std::string to_file1, to_file2;
+  CreateFragmentedFiles(*this, to_file1, to_file2);
+  FilesystemInterface::Stats before, after;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats(&before));
+
+  BOOST_REQUIRE(ErrorCode::kSuccess ==
+                fs->CopyFile("1", "3", FilesystemInterface::CopyMode::kClone));
+  // Only the new entry and its extent tree take space, the data would take
+  // hundreds of clusters.
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats(&after));
+  BOOST_CHECK((after.total_clusters - after.free_clusters) -
+                  (before.total_clusters - before.free_clusters) < kMany / 5);
+
+  // A write to either file doesn't change the other one.
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("3", file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, "xyz"));
+  file.reset();
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->SetCursor(k100KB - 1));
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, "!"));
+  file.reset();
+
+  // The references survive reloading.
+  BOOST_REQUIRE(ErrorCode::kSuccess == Create(fs));
+  BOOST_REQUIRE(ErrorCode::kSuccess == Load(device_path));
+  std::string from_file1(to_file1.size(), '\0'), from_file3(to_file1.size(), '\0');
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file1));
+  BOOST_CHECK(from_file1 == to_file1.substr(0, k100KB - 1) + "!");
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("3", file));
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file3));
+  BOOST_CHECK(from_file3 == "xyz" + to_file1.substr(3));
+  file.reset();
+
+  // The shared sections are released with the last reference.
+  BOOST_REQUIRE(ErrorCode::kSuccess == Remove("1"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == Remove("2"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == Remove("3"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats(&after));
+  // Only the root directory is left.
+  BOOST_CHECK(after.free_clusters == after.total_clusters - 1);
+}
+
+BOOST_FIXTURE_TEST_CASE(extent_tree_write_to_clone_copies_only_written_data,
+                        ExtentTreeFSFixture) {
+  std::string to_file(k100KB, '\0');
+  for (size_t i = 0; i < to_file.size(); ++i)
+    to_file[i] = 'a' + i % 26;
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", to_file));
+  BOOST_REQUIRE(ErrorCode::kSuccess ==
+                fs->CopyFile("1", "2", FilesystemInterface::CopyMode::kClone));
+  FilesystemInterface::Stats before, after;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats(&before));
+
+  // Writes at the beginning, in the middle and at the end of the extent.
+  std::string to_file2 = to_file;
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("2", file));
+  for (size_t offset : {size_t(0), k100KB / 2, k100KB - 1}) {
+    BOOST_REQUIRE(ErrorCode::kSuccess == file->SetCursor(offset));
+    BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, "!"));
+    to_file2[offset] = '!';
+  }
+  file.reset();
+  // The data would take hundreds of clusters.
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats(&after));
+  BOOST_CHECK((after.total_clusters - after.free_clusters) -
+                  (before.total_clusters - before.free_clusters) < kMany / 10);
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == Create(fs));
+  BOOST_REQUIRE(ErrorCode::kSuccess == Load(device_path));
+  std::string from_file(k100KB, '\0');
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file));
+  BOOST_CHECK(from_file == to_file);
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("2", file));
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file));
+  BOOST_CHECK(from_file == to_file2);
+  file.reset();
+
+  // The parts of the extent hold their own references.
+  BOOST_REQUIRE(ErrorCode::kSuccess == Remove("1"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == Remove("2"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats(&after));
+  BOOST_CHECK(after.free_clusters == after.total_clusters - 1);
+}
+
+BOOST_FIXTURE_TEST_CASE(extent_tree_deduplicate_identical_files, ExtentTreeFSFixture) {
+  std::string to_file(k100KB, '\0');
+  for (size_t i = 0; i < to_file.size(); ++i)
+    to_file[i] = 'a' + i % 26;
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", to_file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateDirectory("dir"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("dir/2", to_file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("3", std::string(k100KB, 'z')));
+  FilesystemInterface::Stats before, after;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats(&before));
+
+  uint64_t released = 0;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->Deduplicate(&released));
+  BOOST_CHECK(released == k100KB);
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats(&after));
+  BOOST_CHECK((after.free_clusters - before.free_clusters) * after.data_cluster_size >= k100KB);
+
+  // Nothing is left to share.
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->Deduplicate(&released));
+  BOOST_CHECK(released == 0);
+
+  // A write to either file doesn't change the other one.
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("dir/2", file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == WriteFile(file, "xyz"));
+  file.reset();
+  std::string from_file1(to_file.size(), '\0'), from_file2(to_file.size(), '\0');
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file1));
+  BOOST_CHECK(from_file1 == to_file);
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("dir/2", file));
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file2));
+  BOOST_CHECK(from_file2 == "xyz" + to_file.substr(3));
+  file.reset();
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == Remove("1"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == Remove("dir/2"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == Remove("dir"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == Remove("3"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats(&after));
+  // Only the root directory is left.
+  BOOST_CHECK(after.free_clusters == after.total_clusters - 1);
+}
+
+BOOST_FIXTURE_TEST_CASE(extent_tree_deduplicate_skips_open_files, ExtentTreeFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", std::string(k100KB, 'a')));
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("2", std::string(k100KB, 'a')));
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("2", file));
+
+  uint64_t released = 1;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->Deduplicate(&released));
+  BOOST_CHECK(released == 0);
+}
+
+BOOST_FIXTURE_TEST_CASE(deduplicate_without_extent_tree, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", std::string(k100KB, 'a')));
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("2", std::string(k100KB, 'a')));
+
+  BOOST_CHECK(ErrorCode::kErrorNotSupported == fs->Deduplicate());
+
+  // The device is left as it was.
+  BOOST_REQUIRE(ErrorCode::kSuccess == Create(fs));
+  BOOST_REQUIRE(ErrorCode::kSuccess == Load(device_path));
+  std::string from_file(k100KB, '\0');
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("2", file));
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file));
+  BOOST_CHECK(from_file == std::string(k100KB, 'a'));
+}
+
+BOOST_FIXTURE_TEST_CASE(scrub_without_extent_tree, LoadedFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", std::string(k100KB, 'a')));
+
+  uint64_t corrupted = 1;
+  BOOST_CHECK(ErrorCode::kErrorNotSupported == fs->Scrub(&corrupted));
+
+  // The device is left as it was.
+  BOOST_REQUIRE(ErrorCode::kSuccess == Create(fs));
+  BOOST_REQUIRE(ErrorCode::kSuccess == Load(device_path));
+  std::string from_file(k100KB, '\0');
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file));
+  BOOST_CHECK(from_file == std::string(k100KB, 'a'));
+}
+
+BOOST_FIXTURE_TEST_CASE(extent_tree_scrub_detects_corruption, ExtentTreeFSFixture) {
+  std::string to_file;
+  for (int i = 0; i < kMany; ++i)
+    to_file += "record " + std::to_string(i) + ";";
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", to_file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("2", std::string(k100KB, 'a')));
+  uint64_t corrupted = 1;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->Scrub(&corrupted));
+  BOOST_CHECK(corrupted == 0);
+
+  // Change the data behind the filesystem's back.
+  std::string device;
+  {
+    std::ifstream in(device_path.c_str(), std::ios_base::binary);
+    device.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  }
+  size_t data_offset = device.find(to_file);
+  BOOST_REQUIRE(data_offset != std::string::npos);
+  std::fstream(device_path.c_str(), std::ios_base::in | std::ios_base::out |
+                                        std::ios_base::binary).seekp(data_offset + 10).put('!');
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->Scrub(&corrupted));
+  BOOST_CHECK(corrupted == 1);
+  std::string from_file(to_file.size(), '\0');
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_CHECK(file->ReadAt(0, &from_file[0], 1, &ec) == 0);
+  BOOST_CHECK(ErrorCode::kErrorFormat == ec);
+
+  file->SetVerifyReads(false);
+  BOOST_CHECK(file->ReadAt(0, &from_file[0], from_file.size(), &ec) == to_file.size());
+  BOOST_CHECK(from_file == to_file.substr(0, 10) + "!" + to_file.substr(11));
+
+  // A write drops the checksum, and the next pass takes the data as it is.
+  file->SetVerifyReads(true);
+  BOOST_REQUIRE(file->WriteAt(10, "0", 1, &ec) == 1);
+  BOOST_CHECK(file->ReadAt(0, &from_file[0], from_file.size(), &ec) == to_file.size());
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->Scrub(&corrupted));
+  BOOST_CHECK(corrupted == 0);
+}
+
+BOOST_FIXTURE_TEST_CASE(extent_tree_reads_check_only_the_chunks_read, ExtentTreeFSFixture) {
+  constexpr size_t kChunk = 4096;  // see ExtentLayout::kChecksumChunk
+
+  std::string to_file(k100KB, '\0');
+  for (size_t i = 0; i < to_file.size(); ++i)
+    to_file[i] = 'a' + i % 26;
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", to_file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->Scrub());
+
+  // Change a byte in the middle behind the filesystem's back.
+  std::string device;
+  {
+    std::ifstream in(device_path.c_str(), std::ios_base::binary);
+    device.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  }
+  size_t data_offset = device.find(to_file);
+  BOOST_REQUIRE(data_offset != std::string::npos);
+  std::fstream(device_path.c_str(), std::ios_base::in | std::ios_base::out | std::ios_base::binary)
+      .seekp(data_offset + k100KB / 2)
+      .put('!');
+
+  // The data away from it is read as usual.
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  std::string from_file(kChunk, '\0');
+  for (size_t offset : {size_t(0), k100KB / 2 + kChunk, k100KB - kChunk}) {
+    BOOST_CHECK(file->ReadAt(offset, &from_file[0], kChunk, &ec) == kChunk);
+    BOOST_CHECK(from_file == to_file.substr(offset, kChunk));
+  }
+  // Reads which cut chunks check them in full.
+  std::string from_file2(k100KB / 2 - kChunk - 1, '\0');
+  BOOST_CHECK(file->ReadAt(1, &from_file2[0], from_file2.size(), &ec) == from_file2.size());
+  BOOST_CHECK(from_file2 == to_file.substr(1, from_file2.size()));
+  FileInterface::MappedRange* range = file->MapRange(0, kChunk, &ec);
+  BOOST_REQUIRE(range != nullptr);
+  range->Release();
+
+  // Any read of its chunk fails.
+  BOOST_CHECK(file->ReadAt(k100KB / 2, &from_file[0], 1, &ec) == 0);
+  BOOST_CHECK(ErrorCode::kErrorFormat == ec);
+  BOOST_CHECK(file->ReadAt(k100KB / 2 - 100, &from_file[0], 200, &ec) == 0);
+  BOOST_CHECK(ErrorCode::kErrorFormat == ec);
+  BOOST_CHECK(file->MapRange(0, k100KB, &ec) == nullptr);
+  BOOST_CHECK(ErrorCode::kErrorFormat == ec);
+}
+
+BOOST_FIXTURE_TEST_CASE(extent_tree_checksums_are_released_with_the_data, ExtentTreeFSFixture) {
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", std::string(k100KB, 'a')));
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->Scrub());
+  BOOST_REQUIRE(ErrorCode::kSuccess ==
+                fs->CopyFile("1", "2", FilesystemInterface::CopyMode::kClone));
+
+  // Writes drop the checksums of both files, one by one.
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("2", file));
+  BOOST_REQUIRE(file->WriteAt(k100KB / 2, "!", 1, &ec) == 1);
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == file->Truncate(k100KB / 2));
+  file.reset();
+  uint64_t corrupted = 1;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->Scrub(&corrupted));
+  BOOST_CHECK(corrupted == 0);
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == Remove("1"));
+  BOOST_REQUIRE(ErrorCode::kSuccess == Remove("2"));
+  FilesystemInterface::Stats stats;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->GetStats(&stats));
+  // Only the root directory is left.
+  BOOST_CHECK(stats.free_clusters == stats.total_clusters - 1);
+}
+
+BOOST_FIXTURE_TEST_CASE(extent_tree_checksums_survive_reloading, ExtentTreeFSFixture) {
+  std::string to_file(k100KB, 'a');
+  BOOST_REQUIRE(ErrorCode::kSuccess == CreateFile("1", to_file));
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->Scrub());
+
+  // Append to the last extent: its checksum is dropped as well.
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_REQUIRE(file->Append("bcd", 3, &ec) == k100KB);
+  to_file += "bcd";
+  file.reset();
+
+  BOOST_REQUIRE(ErrorCode::kSuccess == Create(fs));
+  BOOST_REQUIRE(ErrorCode::kSuccess == Load(device_path));
+  std::string from_file(to_file.size(), '\0');
+  BOOST_REQUIRE(ErrorCode::kSuccess == OpenFile("1", file));
+  BOOST_CHECK(ErrorCode::kSuccess == ReadFile(file, from_file));
+  BOOST_CHECK(from_file == to_file);
+  uint64_t corrupted = 1;
+  BOOST_REQUIRE(ErrorCode::kSuccess == fs->Scrub(&corrupted));
+  BOOST_CHECK(corrupted == 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()